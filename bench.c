@@ -0,0 +1,439 @@
+/*  bench -- times imv's decode and resize paths over a folder of images
+ *
+ *  usage: bench [options] folder
+ *
+ *  For every image in the folder it times, over several repetitions:
+ *     decode            stb_image, from memory, reported by format
+ *     make_image        RGB->BGR and the alpha check
+ *     halving           one downsample_half()
+ *     bilinear, cubic   grScaleBitmap() down and up to each scale
+ *     sharpen           cubic upsampling with sharpening
+ *  and writes the median, 95th and 99th percentile times, and MB/s and
+ *  megapixels/s at the median, as JSON, so runs from different builds
+ *  can be compared. Decode throughput is of the compressed file and the
+ *  decoded pixels; everything else is of the pixels it writes. A resize
+ *  to or from fewer than 4 pixels either way is too small for the
+ *  resizers, and shows up as { "skipped": true } instead.
+ *
+ *    -n reps     repetitions of each stage (default 10)
+ *    -s scales   comma-separated target scales (default 0.25,0.5,0.75,1.5,2)
+ *    -j n        resize threads (default one per processor, like imv)
+ *    -o file     write the JSON to file instead of stdout
+ *
+ *  It doesn't use any of imv's Win32 code, so it builds on Linux too:
+ *     gcc -O2 bench.c -o bench -lm -lpthread
+ *     cl /O2 /MT bench.c
+ *
+ *  Add -DSTBI_PROFILE to also get "decode_profile", the time stb_image
+ *  spends in each stage of decoding, per image and for the whole folder.
+ */
+
+#ifdef _WIN32
+#include <windows.h>  // QueryPerformanceCounter
+#else
+#include <time.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define STB_DEFINE
+#include "stb.h"          /*     http://nothings.org/stb.h         */
+
+#define STBI_NO_WRITE
+#include "stb_image.c"    /*     http://nothings.org/stb_image.c   */
+
+#define BPP 4
+#include "resize.c"
+
+#define MAX_SCALES  16
+
+int reps = 10;
+float scales[MAX_SCALES] = { 0.25f, 0.5f, 0.75f, 1.5f, 2 };
+int num_scales = 5;
+
+static double now(void)
+{
+#ifdef _WIN32
+   LARGE_INTEGER t, f;
+   QueryPerformanceCounter(&t);
+   QueryPerformanceFrequency(&f);
+   return (double) t.QuadPart / f.QuadPart;
+#else
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec * 1e-9;
+#endif
+}
+
+// the same order stbi_load_from_memory() tries them in
+static char *format_name(uint8 *data, int len)
+{
+   if (stbi_jpeg_test_memory(data,len)) return "jpeg";
+   if (stbi_png_test_memory (data,len)) return "png";
+   if (stbi_bmp_test_memory (data,len)) return "bmp";
+   if (stbi_psd_test_memory (data,len)) return "psd";
+   if (stbi_hdr_test_memory (data,len)) return "hdr";
+   if (stbi_tga_test_memory (data,len)) return "tga";
+   return "unknown";
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//   results
+//
+
+typedef struct
+{
+   char name[32];
+   int skipped;            // too small for the stage to run
+   double p50, p95, p99;   // seconds
+   double bytes, pixels;   // per repetition
+} Stage;
+
+// totals over the whole corpus, one per stage name (and decode format)
+typedef struct
+{
+   char name[48];
+   int images;
+   double bytes, pixels, time;
+} Total;
+
+Total *totals;  // stb_arr
+
+#ifdef STBI_PROFILE
+stbi_profile profile;        // of the image being benchmarked, over all reps
+stbi_profile profile_total;
+#endif
+
+static int compare_double(const void *p, const void *q)
+{
+   double a = *(double *) p, b = *(double *) q;
+   return a < b ? -1 : a > b;
+}
+
+// nearest-rank percentile of sorted times
+static double percentile(double *t, int n, double p)
+{
+   int k = (int) ceil(p * n) - 1;
+   return t[stb_clamp(k, 0, n-1)];
+}
+
+static void add_total(char *name, Stage *s)
+{
+   int i;
+   for (i=0; i < stb_arr_len(totals); ++i)
+      if (!strcmp(totals[i].name, name))
+         break;
+   if (i == stb_arr_len(totals)) {
+      Total t = { 0 };
+      strcpy(t.name, name);
+      stb_arr_push(totals, t);
+   }
+   totals[i].images += 1;
+   totals[i].bytes  += s->bytes;
+   totals[i].pixels += s->pixels;
+   totals[i].time   += s->p50;
+}
+
+static void finish_stage(Stage *s, char *name, double *t, double bytes, double pixels)
+{
+   qsort(t, reps, sizeof(*t), compare_double);
+   strcpy(s->name, name);
+   s->skipped = FALSE;
+   s->p50 = percentile(t, reps, 0.50);
+   s->p95 = percentile(t, reps, 0.95);
+   s->p99 = percentile(t, reps, 0.99);
+   s->bytes = bytes;
+   s->pixels = pixels;
+}
+
+static void json_string(FILE *f, char *s)
+{
+   fputc('"', f);
+   for (; *s; ++s) {
+      if (*s == '"' || *s == '\\')
+         fprintf(f, "\\%c", *s);
+      else if ((unsigned char) *s < 32)
+         fprintf(f, "\\u%04x", *s);
+      else
+         fputc(*s, f);
+   }
+   fputc('"', f);
+}
+
+static void json_rates(FILE *f, double bytes, double pixels, double time)
+{
+   fprintf(f, "\"mb_s\": %.2f, \"mp_s\": %.2f",
+              time > 0 ? bytes  / time / (1 << 20) : 0,
+              time > 0 ? pixels / time / 1e6       : 0);
+}
+
+#ifdef STBI_PROFILE
+// cycles and bytes per decode, for the stages this format used
+static void json_profile(FILE *f, char *indent, stbi_profile *p, int decodes)
+{
+   int k, first = TRUE;
+   fprintf(f, "\"decode_profile\": {\n");
+   for (k=0; k < STBI_PROF_count; ++k) {
+      double cycles = (double) p->stage[k].cycles / decodes;
+      double bytes  = (double) p->stage[k].bytes  / decodes;
+      if (p->stage[k].calls == 0) continue;
+      fprintf(f, "%s%s  \"%s\": { \"calls\": %u, \"cycles\": %.0f, \"bytes\": %.0f, \"cycles_per_byte\": %.2f }",
+                 first ? "" : ",\n", indent, stbi_profile_stage_name(k),
+                 p->stage[k].calls / decodes, cycles, bytes, bytes > 0 ? cycles / bytes : 0);
+      first = FALSE;
+   }
+   fprintf(f, "%s%s}", first ? "" : "\n", indent);
+}
+
+static void add_profile(stbi_profile *total, stbi_profile *p)
+{
+   int k;
+   for (k=0; k < STBI_PROF_count; ++k) {
+      total->stage[k].cycles += p->stage[k].cycles;
+      total->stage[k].bytes  += p->stage[k].bytes;
+      total->stage[k].calls  += p->stage[k].calls;
+   }
+}
+#endif
+
+static void json_stage(FILE *f, Stage *s)
+{
+   fprintf(f, "        ");
+   json_string(f, s->name);
+   if (s->skipped) {
+      fprintf(f, ": { \"skipped\": true }");
+      return;
+   }
+   fprintf(f, ": { \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f, ",
+              s->p50 * 1000, s->p95 * 1000, s->p99 * 1000);
+   json_rates(f, s->bytes, s->pixels, s->p50);
+   fprintf(f, " }");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//   the stages
+//
+
+enum { MODE_bilinear, MODE_cubic, MODE_sharpen };
+
+static void set_mode(int mode)
+{
+   downsample_cubic = upsample_cubic = (mode != MODE_bilinear);
+   sharpen = (mode == MODE_sharpen);
+}
+
+// the resizers read a couple of pixels either side, and cubic divides
+// by the size less one, so they need a few pixels each way
+#define MIN_RESIZE  4
+
+// times image_resize() from src to scale, as imv would do it for a window
+static void time_resize(Stage *s, char *name, Image *src, float scale, int mode)
+{
+   double *t;
+   int gx = stb_max((int) (src->x * scale + 0.5f), 1);
+   int gy = stb_max((int) (src->y * scale + 0.5f), 1);
+   Image *dest;
+   int i;
+   if (stb_min(src->x, src->y) < MIN_RESIZE || stb_min(gx, gy) < MIN_RESIZE) {
+      memset(s, 0, sizeof(*s));
+      strcpy(s->name, name);
+      s->skipped = TRUE;
+      return;
+   }
+   t = malloc(sizeof(*t) * reps);
+   dest = bmp_alloc(gx, gy);
+   set_mode(mode);
+   for (i=0; i < reps; ++i) {
+      double t0 = now();
+      image_resize(dest, src);
+      t[i] = now() - t0;
+   }
+   finish_stage(s, name, t, (double) gx*gy*BPP, (double) gx*gy);
+   imfree(dest);
+   free(t);
+}
+
+// returns the number of stages written into s, or 0 if it didn't decode
+static int bench_image(Stage *s, uint8 *data, int len, int *x, int *y)
+{
+   double *t = malloc(sizeof(*t) * reps);
+   uint8 *pixels = NULL, *copy;
+   Image img;
+   int i,j,n, num=0;
+
+   #ifdef STBI_PROFILE
+   memset(&profile, 0, sizeof(profile));
+   stbi_profile_capture(&profile);
+   #endif
+   for (i=0; i < reps; ++i) {
+      double t0 = now();
+      uint8 *p = stbi_load_from_memory(data, len, x, y, &n, BPP);
+      t[i] = now() - t0;
+      if (p == NULL) {
+         #ifdef STBI_PROFILE
+         stbi_profile_capture(NULL);
+         #endif
+         free(pixels);
+         free(t);
+         return 0;
+      }
+      if (pixels) free(pixels);
+      pixels = p;
+   }
+   #ifdef STBI_PROFILE
+   stbi_profile_capture(NULL);
+   #endif
+   finish_stage(&s[num++], "decode", t, len, (double) *x * *y);
+
+   // make_image works in place, so each repetition gets a fresh copy
+   copy = malloc(*x * *y * BPP);
+   for (i=0; i < reps; ++i) {
+      double t0;
+      memcpy(copy, pixels, *x * *y * BPP);
+      t0 = now();
+      make_image(&img, *x, *y, copy, TRUE, n);
+      t[i] = now() - t0;
+   }
+   finish_stage(&s[num++], "make_image", t, (double) *x * *y * BPP, (double) *x * *y);
+
+   if (*x >= 2 && *y >= 2) {
+      for (i=0; i < reps; ++i) {
+         double t0 = now();
+         Image *half = downsample_half(&img);
+         t[i] = now() - t0;
+         imfree(half);
+      }
+      finish_stage(&s[num++], "halving", t, (double) (*x>>1) * (*y>>1) * BPP, (double) (*x>>1) * (*y>>1));
+   }
+
+   for (j=0; j < num_scales; ++j) {
+      char name[32];
+      float z = scales[j];
+      if (z < 1) {
+         sprintf(name, "bilinear_down_%.2f", z); time_resize(&s[num++], name, &img, z, MODE_bilinear);
+         sprintf(name, "cubic_down_%.2f", z);    time_resize(&s[num++], name, &img, z, MODE_cubic);
+      } else if (z > 1) {
+         sprintf(name, "bilinear_up_%.2f", z);   time_resize(&s[num++], name, &img, z, MODE_bilinear);
+         sprintf(name, "cubic_up_%.2f", z);      time_resize(&s[num++], name, &img, z, MODE_cubic);
+         sprintf(name, "sharpen_%.2f", z);       time_resize(&s[num++], name, &img, z, MODE_sharpen);
+      }
+   }
+
+   free(copy);
+   free(pixels);
+   free(t);
+   return num;
+}
+
+static void usage(void)
+{
+   fprintf(stderr, "usage: bench [-n reps] [-s scale,scale,...] [-j threads] [-o file.json] folder\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   Stage s[3 + MAX_SCALES*3];
+   FILE *f = stdout;
+   char **files;
+   int i,k, first = TRUE;
+
+   resize_threads = stb_min(stb_processor_count(), 16);
+   for (i=1; i < argc && argv[i][0] == '-'; ++i) {
+      if (!strcmp(argv[i], "-n") && i+1 < argc)
+         reps = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-j") && i+1 < argc)
+         resize_threads = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-o") && i+1 < argc) {
+         f = fopen(argv[++i], "w");
+         if (f == NULL) { fprintf(stderr, "Couldn't write %s\n", argv[i]); return 1; }
+      } else if (!strcmp(argv[i], "-s") && i+1 < argc) {
+         char *p = argv[++i];
+         for (num_scales=0; *p && num_scales < MAX_SCALES; ++num_scales) {
+            scales[num_scales] = (float) strtod(p, &p);
+            if (scales[num_scales] <= 0) usage();
+            if (*p == ',') ++p;
+         }
+      } else
+         usage();
+   }
+   if (i+1 != argc || reps < 1 || resize_threads < 1)
+      usage();
+
+   // the same workers and syncs imv sets up in WinMain
+   if (resize_threads > 1)
+      resize_workers = stb_workq_new(resize_threads, STB_THREADQ_DYNAMIC);
+   make_merge = stb_sync_new();
+   resize_merge = stb_sync_new();
+
+   files = stb_readdir_files_mask(argv[i], "*.jpg;*.jpeg;*.png;*.bmp;*.tga;*.hdr;*.psd");
+   if (files == NULL) {
+      fprintf(stderr, "Couldn't read folder %s\n", argv[i]);
+      return 1;
+   }
+   qsort(files, stb_arr_len(files), sizeof(*files), stb_qsort_stricmp);
+
+   fprintf(f, "{\n  \"reps\": %d,\n  \"threads\": %d,\n  \"images\": [\n", reps, resize_threads);
+   for (i=0; i < stb_arr_len(files); ++i) {
+      size_t len;
+      uint8 *data = stb_file(files[i], &len);
+      char *format;
+      int x,y,n;
+      if (data == NULL) continue;
+      format = format_name(data, len);
+      n = bench_image(s, data, len, &x, &y);
+      free(data);
+      if (n == 0) {
+         fprintf(stderr, "%s: %s\n", files[i], stbi_failure_reason());
+         continue;
+      }
+      fprintf(stderr, "%s: %dx%d %s, decode %.2f ms\n", files[i], x, y, format, s[0].p50*1000);
+
+      fprintf(f, "%s    { \"file\": ", first ? "" : ",\n");
+      json_string(f, files[i]);
+      fprintf(f, ", \"format\": \"%s\", \"bytes\": %d, \"x\": %d, \"y\": %d,\n      \"stages\": {\n", format, (int) len, x, y);
+      for (k=0; k < n; ++k) {
+         json_stage(f, &s[k]);
+         fprintf(f, k+1 < n ? ",\n" : "\n");
+      }
+      fprintf(f, "      }");
+      #ifdef STBI_PROFILE
+      fprintf(f, ",\n      ");
+      json_profile(f, "      ", &profile, reps);
+      add_profile(&profile_total, &profile);
+      #endif
+      fprintf(f, " }");
+      first = FALSE;
+
+      {
+         char name[48];
+         sprintf(name, "decode_%s", format);
+         add_total(name, &s[0]);
+         for (k=1; k < n; ++k)
+            if (!s[k].skipped)
+               add_total(s[k].name, &s[k]);
+      }
+   }
+   fprintf(f, "\n  ],\n  \"totals\": {\n");
+   for (k=0; k < stb_arr_len(totals); ++k) {
+      fprintf(f, "    ");
+      json_string(f, totals[k].name);
+      fprintf(f, ": { \"images\": %d, ", totals[k].images);
+      json_rates(f, totals[k].bytes, totals[k].pixels, totals[k].time);
+      fprintf(f, " }%s\n", k+1 < stb_arr_len(totals) ? "," : "");
+   }
+   fprintf(f, "  }");
+   #ifdef STBI_PROFILE
+   // summed over the images, so per pass over the folder
+   fprintf(f, ",\n  ");
+   json_profile(f, "  ", &profile_total, reps);
+   #endif
+   fprintf(f, "\n}\n");
+
+   if (f != stdout) fclose(f);
+   stb_readdir_free(files);
+   return 0;
+}
@@ -0,0 +1,1220 @@
+// cache.c -- imv's image cache, the loader and decoder threads, and the
+// main thread's policy for what to load and what to flush as they browse
+//
+// imv.c #includes this, and so does replay.c, to play recorded browsing
+// back against it without a window; it isn't compiled on its own. It
+// needs stb.h, stb_image.c and resize.c first, and the includer has to provide:
+//
+//    barrier(), wake(message), Sleep(ms), GetCurrentThreadId() and DWORD
+//    trace() and trace_thread(), or empty macros for them
+//    WM_APP_DECODED, WM_APP_LOAD_ERROR and WM_APP_DECODE_ERROR
+//    imv_decode_from_memory() and imv_failure_reason()
+//    update_source() and set_error(), to show what they stepped to
+//    showing(), so flush_cache() leaves what's on screen alone
+
+enum
+{
+// owned by main thread
+   LOAD_unused=0, // empty slot
+
+   LOAD_inactive, // filename slot, not loaded
+
+   // finished reading, needs decoding--originally decoder
+   // owned this, but then we couldn't free from the cache
+   LOAD_reading_done,
+
+   // in any of the following states, the image is as done as it can be
+   LOAD_error_reading,
+   LOAD_error_decoding,
+   LOAD_available, // loaded successfully
+
+// owned by resizer
+   LOAD_resizing,
+
+// owned by loader
+   LOAD_queued,   // handed to the loader, but it hasn't started yet
+   LOAD_reading,
+
+// owned by decoder
+   LOAD_decoding,
+};
+
+// does the main thread own this? (if this is true, the main
+// thread can manipulate without locking, except for LOAD_reading_done,
+// which the decoder can claim at any time, so the main thread has to
+// claim it with stb_atomic_cas() too)
+#define MAIN_OWNS(x)   ((x)->status <= LOAD_available)
+
+// data about a specific file
+typedef struct
+{
+   char *filename;   // name of the file on disk, must be free()d
+   char *filedata;   // data loaded from disk -- passed from reader to decoder
+   int len;          // length of data loaded from disk -- as above
+   Image *image;     // cached image -- passed from decoder to main
+   char *error;      // error message -- from reader or decoder, must be free()d
+   long status;      // current status/ownership with LOAD_* enum
+   int bail;         // flag from main thread to work threads indicating to give up
+   int lru;          // the larger, the higher priority--effectively a timestamp
+   int file;         // index in fileinfo, if fileinfo[file].cached points back here
+   int prefetched;   // loaded speculatively, and they haven't stepped to it yet
+} ImageFile;
+
+// Navigation stats: how long each step through the folder takes to show
+// up, and how well the cache and prefetching are doing, for tuning
+// max_cache_bytes and how far ahead we load. The main thread owns all of
+// it except the read and decode counts, which the loader and decoder
+// update atomically. Times are histograms of milliseconds in powers of
+// two: [0,1) [1,2) [2,4) ... [16384,inf)
+#define STATS_BUCKETS  16
+
+enum
+{
+   NAV_cached,     // already decoded (or known to be an error) when they stepped to it
+   NAV_in_flight,  // queued, being read or decoded
+   NAV_cold,       // nothing started on it
+
+   NAV__num
+};
+
+typedef struct
+{
+   int steps[NAV__num];    // every advance(), by where its image was
+   int shown[NAV__num];    // ...and the ones that were painted
+   int skipped;            // moved on again before it was painted
+   int errors;             // painted as an error message
+   double ttfp_ms[NAV__num];               // total time from keypress to first paint
+   long ttfp[NAV__num][STATS_BUCKETS];     // ...and its distribution
+   int evicted_images;     // flushed from the cache decoded
+   int evicted_data;       // flushed after reading, before decoding
+   int prefetched;         // files loaded speculatively
+   int prefetch_used;      // ...that they then stepped to
+   int prefetch_wasted;    // ...that were flushed first
+   volatile long files_read, kb_read;             // by the loader
+   volatile long decodes, decode[STATS_BUCKETS];  // by the decoder, not counting cancelled ones
+} NavStats;
+
+NavStats nav_stats;
+
+// current time in milliseconds
+double stats_now(void)
+{
+#ifdef _WIN32
+   static double scale;
+   LARGE_INTEGER t;
+   if (scale == 0) {
+      QueryPerformanceFrequency(&t);
+      scale = 1000.0 / t.QuadPart;
+   }
+   QueryPerformanceCounter(&t);
+   return t.QuadPart * scale;
+#else
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1000.0 + t.tv_nsec * 1e-6;
+#endif
+}
+
+int stats_bucket(double ms)
+{
+   int b=0;
+   while (b < STATS_BUCKETS-1 && ms >= (1 << b))
+      ++b;
+   return b;
+}
+
+// Handoffs between the threads. Each entry is an ImageFile *, and whoever
+// puts it on a ring has already handed it over by setting ->status, so
+// nobody needs to lock anything or scan the cache to find their work.
+// Stale entries can be left on a ring (e.g. if the main thread takes a
+// file back before the loader gets to it), so the receiver always checks
+// ->status before doing anything with an entry.
+stb_ring *disk_queue;    // main -> loader, LOAD_queued
+stb_ring *decode_queue;  // loader -> decoder, LOAD_reading_done (main re-queues bailed ones)
+stb_ring *done_queue;    // loader and decoder -> main, finished or failed
+
+// a batch of files the main thread wants loaded, most important first
+typedef struct
+{
+   int num_files;
+   ImageFile *files[4];
+} DiskCommand;
+
+// pass a file we're done with back to the main thread, and wake it up
+void finished(volatile ImageFile *f, int message)
+{
+   // the ring is much bigger than the cache, so this can only fail if
+   // the main thread is way behind; wait for it to catch up
+   while (!stb_ring_put(done_queue, (void *) f)) {
+      wake(message);
+      Sleep(1);
+   }
+   wake(message);
+}
+
+// the disk loader sits in this loop forever
+void *diskload_task(void *p)
+{
+   trace_thread("loader");
+   for(;;) {
+      size_t n;
+      uint8 *data;
+      volatile ImageFile *f;
+
+      // wait to be woken up by a request from the main thread
+      f = stb_ring_get_block(disk_queue);
+
+      // claim ownership of the file. this fails if the main thread changed
+      // its mind about it after queueing it (e.g. they've already moved on
+      // to other files, and we shouldn't waste time loading data that's no
+      // longer high-priority), or if we already loaded it from an earlier
+      // entry on the ring
+      if (stb_atomic_cas(&f->status, LOAD_reading, LOAD_queued) != LOAD_queued)
+         continue;
+
+      assert(f->filedata == NULL);
+
+      // read the data
+      trace(TRACE_read_begin, f->filename, 0);
+      data = stb_file(f->filename, &n);
+      trace(TRACE_read_end, f->filename, data ? (int) n : -1);
+      if (data) {
+         stb_atomic_add(&nav_stats.files_read, 1);
+         stb_atomic_add(&nav_stats.kb_read, (long) (n + 512) >> 10);
+      }
+
+      // update the results
+      // don't need to mutex these, because we own them via ->status
+      if (data == NULL) {
+         f->error = strdup("can't open");
+         f->filedata = NULL;
+         f->len = 0;
+         barrier();
+         f->status = LOAD_error_reading;
+         finished(f, WM_APP_LOAD_ERROR); // wake main thread to react to error
+      } else {
+         f->error = NULL;
+         f->filedata = data;
+         f->len = (int) n;
+         barrier();
+         f->status = LOAD_reading_done;
+         // hand it to the decoder; it's never more than a cache's worth
+         // behind, so this shouldn't fill up, but if it does, let it catch up
+         while (!stb_ring_put(decode_queue, (void *) f))
+            Sleep(1);
+      }
+   }
+}
+
+// Max entries in image cache. This shouldn't be TOO large, because we
+// traverse it inside mutexes sometimes. Also, for large images, we'll
+// hit cache-size limits fairly quickly (a 2 megapixel image requires
+// 8MB, so you could only fit 50 in a 400MB cache), so no reason to be
+// too large anyway
+#define MAX_CACHED_IMAGES  200
+
+// no idea if it needs to be volatile, decided not to worry about proving
+// it one way or the other
+volatile ImageFile cache[MAX_CACHED_IMAGES];
+
+// files the loader has handed us that we haven't decoded yet; only
+// the decoder thread touches this
+volatile ImageFile *decode_pending[MAX_CACHED_IMAGES];
+int num_decode_pending;
+
+// the file the decoder is working on right now, so the main thread can
+// tell it to bail; the decoder sets it, the main thread only reads it
+volatile ImageFile * volatile decoding_file;
+DWORD decode_thread_id;
+// set by decode_cancel() when it tells stb_image to stop
+int decode_was_cancelled;
+
+static void decoder_add(volatile ImageFile *f)
+{
+   int i;
+   // the same cache slot can show up more than once if it was flushed
+   // and reused, so don't let the list grow past the size of the cache
+   for (i=0; i < num_decode_pending; ++i)
+      if (decode_pending[i] == f)
+         return;
+   decode_pending[num_decode_pending++] = f;
+}
+
+// find the ready-to-decode image that was most in demand (the
+// highest priority will be the most-recently accessed image or,
+// for prefetching, one right next to it; but this is policy
+// determined by the main thread, not by this thread). returns
+// -1 if there's nothing the main thread still wants.
+static int decoder_best(void)
+{
+   int i, best=-1;
+   for (i=0; i < num_decode_pending; ) {
+      volatile ImageFile *f = decode_pending[i];
+      if (f->status != LOAD_reading_done) {
+         // flushed or already decoded; if it comes back, whoever brings
+         // it back will put it on the ring again
+         decode_pending[i] = decode_pending[--num_decode_pending];
+         continue;
+      }
+      // the main thread has moved on from this one; keep it around
+      // in case they come back, but don't spend time on it
+      if (!f->bail && (best < 0 || f->lru > decode_pending[best]->lru))
+         best = i;
+      ++i;
+   }
+   return best;
+}
+
+// choose which image to decode and claim ownership
+volatile ImageFile *decoder_choose(void)
+{
+   for(;;) {
+      void *p;
+      int best;
+      volatile ImageFile *f;
+
+      // pick up anything the loader has finished (or the main thread
+      // has asked for again); if there's nothing worth doing, wait
+      while (stb_ring_get(decode_queue, &p))
+         decoder_add(p);
+      best = decoder_best();
+      if (best < 0) {
+         decoder_add(stb_ring_get_block(decode_queue));
+         continue;
+      }
+
+      f = decode_pending[best];
+      decode_pending[best] = decode_pending[--num_decode_pending];
+
+      // it's possible it was flushed by the main thread since we looked,
+      // so make sure it's still ready to decode as we claim it
+      if (stb_atomic_cas(&f->status, LOAD_decoding, LOAD_reading_done) == LOAD_reading_done)
+         return f;
+   }
+}
+
+// stb_image polls this every row or so while decoding. we give up on
+// the current image if the main thread has told us to bail, or if the
+// loader has since handed us something the main thread wants more (e.g.
+// they flipped past a big prefetch to the next image); the file goes
+// back on the pending list with its data so we can pick it up later.
+static int decode_cancel(void *p)
+{
+   volatile ImageFile *f = decoding_file;
+   void *q;
+   int i;
+   // the main thread decodes a few things itself; never cancel those
+   if (f == NULL || GetCurrentThreadId() != decode_thread_id)
+      return 0;
+   if (f->bail)
+      return decode_was_cancelled = TRUE;
+   while (stb_ring_get(decode_queue, &q))
+      decoder_add(q);
+   for (i=0; i < num_decode_pending; ++i) {
+      volatile ImageFile *z = decode_pending[i];
+      if (z->status == LOAD_reading_done && !z->bail && z->lru > f->lru)
+         return decode_was_cancelled = TRUE;
+   }
+   return 0;
+}
+
+static uint8 *imv_decode_from_memory(uint8 *mem, int len, int *x, int *y, int *loaded_as_rgb, int *n, int n_req, char *filename);
+static char  *imv_failure_reason(void);
+void update_source(ImageFile *q);
+void set_error(volatile ImageFile *z);
+int showing(volatile ImageFile *z);
+
+void *decode_task(void *p)
+{
+   decode_thread_id = GetCurrentThreadId();
+   trace_thread("decoder");
+   for(;;) {
+      int x,y,loaded_as_rgb,n;
+      uint8 *data;
+      double start;
+
+      // find the best image to decode, waiting for one if needed
+      volatile ImageFile *f = decoder_choose();
+      assert(f->status == LOAD_decoding);
+
+      // decode image
+      decode_was_cancelled = FALSE;
+      decoding_file = f;
+      trace(TRACE_decode_begin, f->filename, 0);
+      start = stats_now();
+      data = imv_decode_from_memory(f->filedata, f->len, &x, &y, &loaded_as_rgb, &n, BPP, f->filename);
+      trace(TRACE_decode_end, f->filename, decode_was_cancelled ? -1 : data != NULL);
+      decoding_file = NULL;
+      if (data) {
+         stb_atomic_add(&nav_stats.decode[stats_bucket(stats_now() - start)], 1);
+         stb_atomic_add(&nav_stats.decodes, 1);
+      }
+
+      if (decode_was_cancelled) {
+         // hand it back undecoded but with its data, so either we or
+         // the main thread (if it wants the memory) can pick it up
+         assert(data == NULL);
+         barrier();
+         f->status = LOAD_reading_done;
+         decoder_add(f);
+         continue;
+      }
+
+      // free copy of data from disk, which we don't need anymore
+      free(f->filedata);
+      f->filedata = NULL;
+
+      if (data == NULL) {
+         // error reading file, record the reason for it
+         f->error = strdup(imv_failure_reason());
+         barrier();
+         f->status = LOAD_error_reading;
+         // wake up the main thread in case this is the most recent image
+         finished(f, WM_APP_DECODE_ERROR);
+      } else {
+         // post-process the image into the right format
+         f->image = (Image *) malloc(sizeof(*f->image));
+         make_image(f->image, x, y,data, loaded_as_rgb, n);
+         barrier();
+         f->status = LOAD_available;
+
+         // wake up the main thread in case this is the most recent image
+         finished(f, WM_APP_DECODED);
+      }
+   }
+}
+
+// allocate the queues between the threads, and start the loader and decoder
+void start_cache(void)
+{
+   disk_queue   = stb_ring_new(1024, FALSE, FALSE);
+   decode_queue = stb_ring_new(1024, TRUE, FALSE);  // loader, and main re-queueing
+   stbi_install_cancel(decode_cancel, NULL);
+   done_queue   = stb_ring_new(1024, TRUE, FALSE); // loader and decoder both put
+
+   stb_create_thread(diskload_task, NULL);
+   stb_create_thread(decode_task, NULL);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+//    The file list, and which cache slot each file has
+//
+
+int cur_loc = -1; // offset within the current list of files
+
+// information about files we have currently loaded. rather than a full
+// path for each file, every directory is stored once in 'filenames', and
+// each file just refers to its directory and to its basename (also stored
+// there). a recursive list of a big archive might have a million files in
+// a few thousand directories, so this is a fraction of the size, and it's
+// only two allocations
+struct
+{
+   uint32 dir;       // offset in 'filenames' of its directory, with trailing slash
+   uint32 name;      // offset in 'filenames' of its basename
+   int lru;
+   volatile ImageFile *cached;  // its slot in the image cache, if it has one
+} *fileinfo;
+char *filenames;     // stb_arr
+
+// cached images are found through fileinfo[].cached, and point back with
+// ImageFile.file. we keep ImageFile entries around for images not in the
+// fileinfo list, so when we build a new list, install_filelist() looks
+// for them by name and links them back up.
+
+// when switching/refreshing directories, free this data
+void free_fileinfo(void)
+{
+   stb_arr_free(fileinfo);
+   stb_arr_free(filenames);
+   fileinfo = NULL;
+   filenames = NULL;
+}
+
+// build the full path of file 'i' in the list into buf
+char *file_path(char *buf, int size, int i)
+{
+   char *dir = filenames + fileinfo[i].dir;
+   int n = strlen(dir);
+   if (n >= size) n = size-1;
+   memcpy(buf, dir, n);
+   stb_strncpy(buf+n, filenames + fileinfo[i].name, size-n);
+   return buf;
+}
+
+// append a string (with its terminator) to 'filenames', returning its offset
+static uint32 add_filename(char *str, int len)
+{
+   uint32 offset = stb_arr_len(filenames);
+   memcpy(stb_arr_addn(filenames, len+1), str, len);
+   filenames[offset+len] = 0;
+   return offset;
+}
+
+// given the array of filenames, build an equivalent fileinfo array; this
+// frees the filenames and the array
+void install_filelist(char **image_files, int loc)
+{
+   stb_sdict *dirs, *cached = NULL;
+   int i, n = stb_arr_len(image_files);
+
+   // any cached images might be in the new list
+   for (i=0; i < MAX_CACHED_IMAGES; ++i) {
+      if (cache[i].status != LOAD_unused && cache[i].filename) {
+         volatile ImageFile *z;
+         if (cached == NULL) cached = stb_sdict_new(0);
+         // if there's an out-of-date copy too, use the newer one
+         z = stb_sdict_get(cached, cache[i].filename);
+         if (z == NULL || cache[i].lru > z->lru)
+            stb_sdict_set(cached, cache[i].filename, (void *) &cache[i]);
+      }
+   }
+
+   // not an arena: stb_malloc() only works with 32-bit pointers, and
+   // replay.c builds this for 64-bit; there's only one key per directory
+   dirs = stb_sdict_new(0);
+   stb_arr_setlen(fileinfo, n);
+   for (i=0; i < n; ++i) {
+      char *path = image_files[i];
+      char *name = strrchr(path, '/');
+      void *dir;
+      name = name ? name+1 : path;
+
+      // the dict stores offset+1, so the first directory isn't NULL
+      {
+         char c = *name;
+         *name = 0;
+         dir = stb_sdict_get(dirs, path);
+         if (dir == NULL) {
+            dir = (void *) (size_t) (add_filename(path, name-path) + 1);
+            stb_sdict_add(dirs, path, dir);
+         }
+         *name = c;
+      }
+      fileinfo[i].dir  = (uint32) (size_t) dir - 1;
+      fileinfo[i].name = add_filename(name, strlen(name));
+      fileinfo[i].lru  = 0;
+      fileinfo[i].cached = NULL;
+      if (cached) {
+         volatile ImageFile *z = stb_sdict_get(cached, path);
+         if (z) {
+            fileinfo[i].cached = z;
+            z->file = i;
+         }
+      }
+      free(path);
+   }
+   stb_sdict_delete(dirs);
+   if (cached) stb_sdict_delete(cached);
+   cur_loc = loc;
+
+   stb_arr_free(image_files); 
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+//    Which files go in the list, and in what order
+//
+
+//derived from michael herf's code: http://www.stereopsis.com/strcmp4humans.html
+
+// sorts like this:
+//     foo.jpg
+//     foo1.jpg
+//     foo2.jpg
+//     foo10.jpg
+//     foo_1.jpg
+//     food.jpg
+
+// use upper, not lower, to get better sorting versus '_'
+// no, use lower not upper, to get sorting that matches explorer
+static __forceinline char tupper(char b)
+{
+	if (b >= 'A' && b <= 'Z') return b - 'A' + 'a';
+	//if (b >= 'a' && b <= 'z') return b - 'a' + 'A';
+	return b;
+}
+
+static __forceinline char isnum(char b)
+{
+	if (b >= '0' && b <= '9') return 1;
+	return 0;
+}
+
+static __forceinline int parsenum(char **a_p)
+{
+   char *a = *a_p;
+	int result = *a - '0';
+	++a;
+
+	while (isnum(*a)) {
+		result *= 10;
+		result += *a - '0';
+		++a;
+	}
+
+	*a_p = a-1;
+	return result;
+}
+
+int StringCompare(char *a, char *b)
+{
+   char *orig_a = a, *orig_b = b;
+
+	if (a == b) return 0;
+
+	if (a == NULL) return -1;
+	if (b == NULL) return 1;
+
+	while (*a && *b) {
+
+		int a0, b0;	// will contain either a number or a letter
+
+      if (isnum(*a) && isnum(*b)) {
+			a0 = parsenum(&a);
+			b0 = parsenum(&b);
+      } else {
+         // if they are mixed number and character, use ASCII comparison
+         // order between them (number before character), not herf's
+         // approach (numbers after everything else). this produces the order:
+         //     foo.jpg
+         //     foo1.jpg
+         //     food.jpg
+         //     foo_.jpg
+         // which I think looks better than having foo_ before food (but
+         // I could be wrong, given how a blank space sorts)
+
+			a0 = tupper(*a);
+			b0 = tupper(*b);
+		}
+
+		if (a0 < b0) return -1;
+		if (a0 > b0) return 1;
+
+		++a;
+		++b;
+	}
+
+	if (*a) return 1;
+	if (*b) return -1;
+
+	{
+      // if strings differ only by leading 0s, use case-insensitive ASCII sort
+      // (note, we should work this out more efficiently by noticing which one changes length first)
+      int z = stb_stricmp(orig_a, orig_b);
+      if (z) return z;
+      // if identical case-insensitive, return ASCII sort
+      return strcmp(orig_a, orig_b);
+   }
+}
+
+int StringCompareSort(const void *p, const void *q)
+{
+   return StringCompare(*(char **) p, *(char **) q);
+}
+
+// sorting a big folder with StringCompare() is slow, since every
+// comparison re-parses the numbers in both names. so instead we encode
+// each name once into a key that memcmp() puts in the same order:
+//    - a character that isn't a digit becomes one byte, its tupper()
+//      value ranked as a signed char, from 1..255
+//    - a run of digits becomes a lead byte with the rank of '0' (which
+//      compares against other characters just like any digit would),
+//      then the parsenum() value as 4 big-endian bytes, biased so that
+//      ints that wrapped negative still sort first
+//    - a 0 byte at the end, so shorter names come first
+// both keys are always at the start of a token at the same offset, so
+// memcmp() never compares a number's value bytes against a character.
+// names with equal keys fall back to stricmp() and strcmp() as before
+
+typedef struct
+{
+   uint8 *key;
+   int len;
+   char *name;
+} SortKey;
+
+static __forceinline uint8 sortkey_rank(char c)
+{
+   c = tupper(c);
+   return (uint8) (c < 0 ? c + 129 : c + 128);
+}
+
+// returns the key length; if key is NULL, just computes it
+static int make_sortkey(uint8 *key, char *s)
+{
+   int len = 0;
+   while (*s) {
+      if (isnum(*s)) {
+         uint32 v = 0;  // parsenum() in unsigned, so overflow wraps the same way
+         while (isnum(*s))
+            v = v*10 + (*s++ - '0');
+         if (key) {
+            v ^= 0x80000000;
+            key[len+0] = sortkey_rank('0');
+            key[len+1] = (uint8) (v >> 24);
+            key[len+2] = (uint8) (v >> 16);
+            key[len+3] = (uint8) (v >>  8);
+            key[len+4] = (uint8) (v      );
+         }
+         len += 5;
+      } else {
+         if (key) key[len] = sortkey_rank(*s);
+         ++len;
+         ++s;
+      }
+   }
+   if (key) key[len] = 0;
+   return len+1;
+}
+
+static __forceinline int SortKeyCompare(SortKey *a, SortKey *b)
+{
+   int z = memcmp(a->key, b->key, stb_min(a->len, b->len));
+   if (z) return z;
+   z = stb_stricmp(a->name, b->name);
+   if (z) return z;
+   return strcmp(a->name, b->name);
+}
+
+static int SortKeyCompareSort(const void *p, const void *q)
+{
+   return SortKeyCompare((SortKey *) p, (SortKey *) q);
+}
+
+// a background scan that's been superseded gets a flag set, which the
+// scan and the sort check as they go; NULL means nobody will set it
+#define ABANDONED(p)  ((p) && *(p))
+
+// each tile builds the keys for a chunk of the names and sorts it, then
+// pairs of sorted chunks are merged in parallel, until there's one left
+#define SORT_MIN_CHUNK  2048
+
+struct
+{
+   char **names;
+   SortKey *keys, *temp;
+   uint8 **blocks;      // key storage, one per chunk
+   int n, chunks;
+   int width;           // chunks per sorted run, while merging
+   volatile int *abandon; // if set, stop early; nobody wants the result
+} sort_work;
+stb_sync sort_merge;
+
+static int sort_bound(int i)
+{
+   return (int) ((double) sort_work.n * i / sort_work.chunks);
+}
+
+static void *sort_work_chunk(int i)
+{
+   int j, lo = sort_bound(i), hi = sort_bound(i+1), total=0;
+   uint8 *p;
+   if (ABANDONED(sort_work.abandon)) return NULL;
+   for (j=lo; j < hi; ++j)
+      total += make_sortkey(NULL, sort_work.names[j]);
+   p = sort_work.blocks[i] = malloc(total);
+   if (p == NULL) return NULL; // sort_filelist() notices and gives up
+   for (j=lo; j < hi; ++j) {
+      SortKey *k = &sort_work.keys[j];
+      k->name = sort_work.names[j];
+      k->key  = p;
+      k->len  = make_sortkey(p, k->name);
+      p += k->len;
+   }
+   qsort(sort_work.keys + lo, hi-lo, sizeof(SortKey), SortKeyCompareSort);
+   return NULL;
+}
+
+static void *sort_work_merge(int i)
+{
+   int w = sort_work.width;
+   int lo  = sort_bound(i*2*w);
+   int mid = sort_bound(i*2*w + w);
+   int hi  = sort_bound(i*2*w + 2*w);
+   SortKey *a = sort_work.keys, *out = sort_work.temp + lo;
+   int j=lo, k=mid;
+   while (j < mid && k < hi)
+      // take from the first run on ties, to keep it stable
+      *out++ = (SortKeyCompare(&a[k], &a[j]) < 0) ? a[k++] : a[j++];
+   while (j < mid) *out++ = a[j++];
+   while (k < hi ) *out++ = a[k++];
+   return NULL;
+}
+
+// sort an stb_arr of filenames in StringCompare() order. if *abandon
+// gets set, it gives up partway and leaves them in any order
+void sort_filelist(char **names, volatile int *abandon)
+{
+   int i, n = stb_arr_len(names), chunks = 1, ok = TRUE;
+   if (n < 2) return;
+
+   // a power of two, so every merge pass pairs up evenly
+   while (chunks < resize_threads*2 && n / (chunks*2) >= SORT_MIN_CHUNK)
+      chunks *= 2;
+
+   sort_work.names  = names;
+   sort_work.n      = n;
+   sort_work.chunks = chunks;
+   sort_work.abandon = abandon;
+   sort_work.keys   = malloc(n * sizeof(SortKey));
+   sort_work.temp   = malloc(n * sizeof(SortKey));
+   sort_work.blocks = calloc(chunks, sizeof(*sort_work.blocks));
+   if (sort_work.keys && sort_work.temp && sort_work.blocks) {
+      run_tiles(sort_merge, (stb_thread_func) sort_work_chunk, chunks);
+      for (i=0; i < chunks; ++i)
+         if (sort_work.blocks[i] == NULL)
+            ok = FALSE;
+      if (ok && !ABANDONED(abandon)) {
+         for (sort_work.width = 1; sort_work.width < chunks; sort_work.width *= 2) {
+            SortKey *t;
+            run_tiles(sort_merge, (stb_thread_func) sort_work_merge, chunks / (sort_work.width*2));
+            t = sort_work.keys; sort_work.keys = sort_work.temp; sort_work.temp = t;
+         }
+         for (i=0; i < n; ++i)
+            names[i] = sort_work.keys[i].name;
+      }
+   } else
+      ok = FALSE;
+
+   if (sort_work.blocks)
+      for (i=0; i < chunks; ++i)
+         free(sort_work.blocks[i]);
+   free(sort_work.blocks);
+   free(sort_work.keys);
+   free(sort_work.temp);
+
+   // out of memory; do it the slow way
+   if (!ok && !ABANDONED(abandon))
+      qsort(names, n, sizeof(*names), StringCompareSort);
+}
+
+// the Open dialog's filter; what's after "Image Files\0" (open_filter+12)
+// is the mask for reading folders. imv adds to it when GDI+ or FreeImage
+// is there to decode more formats
+char *open_filter = "Image Files\0*.jpg;*.jpeg;*.png;*.bmp;*.tga;*.hdr;*.spk\0";
+
+/////////////////////////////////////////////////////////////////////////////
+//
+//    What to load and what to flush; all of this is the main thread's
+//
+
+// the most recent image we've seen
+int best_lru = 0;
+
+// current lru timestamp
+int lru_stamp=1;
+
+// maximum size of the cache
+int max_cache_bytes = 256 * (1 << 20); // 256 MB; one 5MP image is 20MB
+
+// memory the decoder keeps outside the cache slots (imv's .spk bases),
+// which counts against max_cache_bytes too; the decoder keeps it up to date
+volatile long decoder_cache_bytes;
+
+// minimum number of cache entries
+#define MIN_CACHE  3    // always keep 3 images cached, to allow prefetching
+
+// compare the lru timestamps in two cached images, with extra indirection
+int ImageFilePtrCompare(const void *p, const void *q)
+{
+   ImageFile *a = *(ImageFile **) p;
+   ImageFile *b = *(ImageFile **) q;
+   return (a->lru < b->lru) ? -1 : (a->lru > b->lru);   
+}
+
+// see if we should flush any data. we should flush if
+// (a) there aren't enough free slots for prefetching, and
+// (b) if we're using too much memory
+
+void flush_cache(void)
+{
+   int limit = MAX_CACHED_IMAGES - MIN_CACHE; // maximum images to cache
+
+   volatile ImageFile *list[MAX_CACHED_IMAGES];
+   int i, total=decoder_cache_bytes, occupied_slots=0, n=0;
+
+   // count number of images in use, and size they're using
+   for (i=0; i < MAX_CACHED_IMAGES; ++i) {
+      volatile ImageFile *z = &cache[i];
+      if (z->status != LOAD_unused)
+         ++occupied_slots;
+      if (MAIN_OWNS(z)) {
+         if (z->status == LOAD_available) {
+            total += z->image->stride * z->image->y;
+         } else if (z->status == LOAD_reading_done) {
+            total += z->len;
+         }
+         list[n++] = z;
+      } // if main doesn't own, don't worry about it... so we may underestimate sometimes
+   }
+
+   if (!(total > max_cache_bytes || occupied_slots > limit))
+      return;
+
+   // sort by lru
+   qsort((void *) list, n, sizeof(*list), ImageFilePtrCompare);
+
+   // now we free earliest slots on the list... 
+   for (i=0; i < n && occupied_slots > MIN_CACHE && (occupied_slots > limit || total > max_cache_bytes); ++i) {
+      long status = list[i]->status;
+      // never the image they're looking at (or waiting to), even with a
+      // tiny cache; it's still pointed at, and would be pulled out from
+      // under the display and the resizer
+      if (showing(list[i]))
+         continue;
+      if (status <= LOAD_available && status != LOAD_unused) {
+         ImageFile p;
+         // the decoder may be claiming this right now, so claim it first
+         if (status == LOAD_reading_done)
+            if (stb_atomic_cas(&list[i]->status, LOAD_inactive, status) != status)
+               continue;
+         // copy the rest of the data out for later use, then clear the existing data
+         p = *list[i];
+         p.status = status;
+         list[i]->bail = 1; // force disk to bail if it gets this -- can't happen?
+         if (p.file < stb_arr_len(fileinfo) && fileinfo[p.file].cached == list[i])
+            fileinfo[p.file].cached = NULL;
+         list[i]->filename = NULL;
+         list[i]->filedata = NULL;
+         list[i]->len = 0;
+         list[i]->image = NULL;
+         list[i]->error = NULL;
+         list[i]->status = LOAD_unused;
+
+         // now do the potentially slow stuff
+         --occupied_slots; // occupied slots
+         if (p.status == LOAD_available) {
+            trace(TRACE_evict, p.filename, p.image->stride * p.image->y);
+            total -= p.image->stride * p.image->y;
+            ++nav_stats.evicted_images;
+         } else if (p.status == LOAD_reading_done) {
+            trace(TRACE_evict, p.filename, p.len);
+            total -= p.len;
+            ++nav_stats.evicted_data;
+         } else
+            trace(TRACE_evict, p.filename, 0);
+         if (p.prefetched)
+            ++nav_stats.prefetch_wasted;
+         free(p.filename);
+         if (p.filedata) free(p.filedata);
+         if (p.image) imfree(p.image);
+         if (p.error) free(p.error);
+      }
+   }
+}
+
+// keep an index within the 'fileinfo' array
+int wrap(int z)
+{
+   int n = stb_arr_len(fileinfo);
+   if (z < 0) return z + n;
+   while (z >= n) z = z - n;
+   return z;
+}
+
+// consider adding a file-load command to the disk-load command
+// if make_current is true, if it's already loaded, make it current
+// (maybe that should be done in advance() instead?)
+void queue_disk_command(DiskCommand *dc, int which, int make_current)
+{
+   volatile ImageFile *z;
+   int fresh = FALSE;  // a new slot, rather than one we took back earlier
+
+   // check if we already have it cached
+   z = fileinfo[which].cached;
+   if (z) {
+      // we already have a cache slot for this entry.
+      z->lru = fileinfo[which].lru;
+      if (!MAIN_OWNS(z)) {
+         // it's being loaded/decoded; if we'd told the decoder to
+         // give up on it, we've changed our minds
+         z->bail = 0;
+         return;
+      }
+
+      // it's waiting to be decoded, so doesn't need queueing; but if
+      // the decoder gave up on it, it won't look at it again unless
+      // we un-bail it and poke it
+      if (z->status == LOAD_reading_done) {
+         if (z->bail) {
+            z->bail = 0;
+            stb_ring_put(decode_queue, (void *) z);
+         }
+         return;
+      }
+
+      // it's already loaded
+      if (z->status == LOAD_available) {
+         if (make_current)
+            update_source((ImageFile *) z);
+         return;
+      }
+
+      // if it's not inactive and none of the above, it's an error
+      if (z->status != LOAD_inactive) {
+         if (make_current) {
+            set_error(z);
+         }
+         return;
+      }
+      
+      // z->status == LOAD_inactive
+      // "fall through" to after the if, below
+   } else {
+      char path[4096];
+      int i,tried_again=FALSE;
+
+      // didn't already have a cache slot, so find one; we called
+      // flush_cache() before calling this so a slot should be free
+      for (i=0; i < MAX_CACHED_IMAGES; ++i)
+         if (cache[i].status == LOAD_unused)
+            break;
+      if (i == MAX_CACHED_IMAGES) {
+         stb_fatal("Internal logic error: no free cache slots, but flush_cache() should free a few");
+         return;
+      }
+
+      // allocate this slot and fill in the info
+      z = &cache[i];
+      free(z->filename);
+      assert(z->filedata == NULL);
+      z->filename = strdup(file_path(path, sizeof(path), which));
+      z->lru = 0;
+      z->status = LOAD_inactive;
+      z->file = which;
+      fileinfo[which].cached = z;
+      fresh = TRUE;
+   }
+
+   // now, take the z we already had, or just allocated, prep it for loading
+   assert(z->status == LOAD_inactive);
+
+   trace(TRACE_queue, z->filename, 0);
+   z->status = LOAD_inactive;     // we still own it for now
+   z->image = NULL;
+   z->bail = 0;
+   // only count a prefetch once, when it's first loaded; if advance()
+   // took it back and we're queueing it again, it's already counted.
+   // whatever they're looking at is never a prefetch
+   if (make_current || which == cur_loc)
+      z->prefetched = FALSE;
+   else if (fresh) {
+      z->prefetched = TRUE;
+      ++nav_stats.prefetched;
+   }
+   z->lru = fileinfo[which].lru;  // pass lru value through
+
+   // and now really put it on the command list
+   dc->files[dc->num_files++] = (ImageFile *) z;
+}
+
+
+// files we've put on disk_queue that the loader might not have started
+// yet, so we can take them back if they stop being interesting
+#define MAX_QUEUED  16
+ImageFile *queued_files[MAX_QUEUED];
+int num_queued_files;
+
+// hand the files in a disk command to the disk thread in priority order
+void submit_disk_command(DiskCommand *dc)
+{
+   int i;
+   for (i=0; i < dc->num_files; ++i) {
+      ImageFile *z = dc->files[i];
+      assert(z->filedata == NULL);
+      z->status = LOAD_queued;
+      if (stb_ring_put(disk_queue, z)) {
+         if (num_queued_files < MAX_QUEUED)
+            queued_files[num_queued_files++] = z;
+      } else {
+         // ring is full of stale requests; leave it for next time
+         stb_atomic_cas(&z->status, LOAD_inactive, LOAD_queued);
+      }
+   }
+}
+
+// when the background filelist arrives, start loading the files on either
+// side of the one we're showing, so the first step either way is instant
+void prefetch_neighbors(void)
+{
+   DiskCommand dc;
+   if (stb_arr_len(fileinfo) == 0) return;
+   fileinfo[wrap(cur_loc-1)].lru = lru_stamp;
+   fileinfo[wrap(cur_loc+1)].lru = lru_stamp;
+   // don't let the neighbors replace what we're showing (or are about
+   // to show) when they finish decoding
+   if (best_lru < lru_stamp)
+      best_lru = lru_stamp;
+   fileinfo[cur_loc].lru = ++lru_stamp;
+
+   flush_cache();
+
+   dc.num_files = 0;
+   queue_disk_command(&dc, cur_loc, 0);  // just refreshes its lru (and isn't a prefetch)
+   queue_disk_command(&dc, wrap(cur_loc+1), 0);
+   queue_disk_command(&dc, wrap(cur_loc-1), 0);
+   submit_disk_command(&dc);
+}
+
+// the loader and decoder put every file they finish with on done_queue;
+// we have to decide whether to show any of them by finding the most
+// recently-browsed one that's more recent than what we're showing. we
+// use a global variable for 'best_lru' so we won't ever retreat.
+void collect_finished(int decoded)
+{
+   void *p;
+   volatile ImageFile *best = NULL;
+   while (stb_ring_get(done_queue, &p)) {
+      volatile ImageFile *z = p;
+      // it could have been flushed (or even reused) since, so
+      // make sure it's still finished
+      if (z->lru > best_lru && z->status >= LOAD_error_reading && z->status <= LOAD_available) {
+         if (best == NULL || z->lru > best->lru)
+            best = z;
+      }
+   }
+   if (best) {
+      if (best->status == LOAD_available) {
+         assert(best->image != NULL);
+         update_source((ImageFile *) best);
+      } else {
+         // if the most recently-browsed and displayable image is an error, show it
+         best_lru = best->lru;
+         set_error(best);
+      }
+   }
+   // since we've decoded a new image, our cache might be too big,
+   // so try flushing it
+   if (decoded)
+      flush_cache();
+}
+
+// the step we're timing: which file they stepped to, when, and where
+// it was at the time; nav_file is -1 once it's been painted
+int nav_file = -1;
+int nav_kind;
+double nav_start;
+
+// they've just stepped to file 'which'
+void stats_advance(int which)
+{
+   volatile ImageFile *z = fileinfo[which].cached;
+   int kind = NAV_cold;
+   if (nav_file >= 0)
+      ++nav_stats.skipped;
+   if (z) {
+      if (z->status == LOAD_available || z->status == LOAD_resizing
+                || z->status == LOAD_error_reading || z->status == LOAD_error_decoding)
+         kind = NAV_cached;
+      else if (z->status != LOAD_inactive)
+         kind = NAV_in_flight;
+      if (z->prefetched) {
+         ++nav_stats.prefetch_used;
+         z->prefetched = FALSE;
+      }
+   }
+   ++nav_stats.steps[kind];
+   nav_kind = kind;
+   nav_file = which;
+   nav_start = stats_now();
+}
+
+// 'z' is being painted; if it's the first paint of the file they stepped
+// to (even a quick preview of it), that's the end of the step. returns
+// how long the step took, or -1 if this wasn't the end of one
+double stats_painted(volatile ImageFile *z, int error)
+{
+   double ms;
+   if (nav_file < 0 || nav_file >= stb_arr_len(fileinfo)) return -1;
+   if (z == NULL || fileinfo[nav_file].cached != z) return -1;
+   ms = stats_now() - nav_start;
+   if (error)
+      ++nav_stats.errors;
+   ++nav_stats.shown[nav_kind];
+   nav_stats.ttfp_ms[nav_kind] += ms;
+   ++nav_stats.ttfp[nav_kind][stats_bucket(ms)];
+   nav_file = -1;
+   return ms;
+}
+
+// a copy of the stats so far
+void stats_snapshot(NavStats *s)
+{
+   memcpy(s, (void *) &nav_stats, sizeof(*s));
+}
+
+// the upper end of the bucket the p'th fraction of the counts falls in
+int stats_percentile(long *hist, float p)
+{
+   long total=0, n=0;
+   int b;
+   for (b=0; b < STATS_BUCKETS; ++b)
+      total += hist[b];
+   if (total == 0)
+      return 0;
+   for (b=0; b < STATS_BUCKETS-1; ++b) {
+      n += hist[b];
+      if (n >= total * p)
+         break;
+   }
+   return 1 << b;
+}
+
+// the cache's side of a step through the file list: reprioritize, make
+// room, start loading it and its neighbors, and tell the loader and
+// decoder to give up on anything they've left behind
+void advance_cache(int dir)
+{
+   DiskCommand dc;
+   int i;
+
+   cur_loc = wrap(cur_loc + dir);
+   trace(TRACE_advance, filenames + fileinfo[cur_loc].name, dir);
+   stats_advance(cur_loc);
+
+   // set adjacent files to previous lru value, so they're 2nd-highest priority
+   fileinfo[wrap(cur_loc-1)].lru = lru_stamp;
+   fileinfo[wrap(cur_loc+1)].lru = lru_stamp;
+   // set this file to new value
+   fileinfo[cur_loc].lru = ++lru_stamp;
+
+   // make sure there's room for new images
+   flush_cache();
+
+   dc.num_files = 0;
+   queue_disk_command(&dc, cur_loc, 1);           // first thing to load: this file
+   if (dir) {
+      queue_disk_command(&dc, wrap(cur_loc+dir), 0); // second thing to load: the next file (preload)
+      queue_disk_command(&dc, wrap(cur_loc-dir), 0); // last thing to load: the previous file (in case it got skipped when they went fast)
+   }
+
+   submit_disk_command(&dc);
+
+   // tell disk loader not to bother with older files; if it hasn't started
+   // one yet, take it back (if it has, the cas fails and it's the loader's)
+   for (i=0; i < num_queued_files; ) {
+      ImageFile *z = queued_files[i];
+      if (z->status == LOAD_queued && z->lru < lru_stamp-1) {
+         if (stb_atomic_cas(&z->status, LOAD_inactive, LOAD_queued) == LOAD_queued) {
+            trace(TRACE_bail, z->filename, TRACE_read_begin);
+            z->bail = 1;
+         }
+      }
+      if (z->status != LOAD_queued)
+         queued_files[i] = queued_files[--num_queued_files];
+      else
+         ++i;
+   }
+
+   // likewise the decoder; it'll stop at the next row and leave it
+   // for later, so whatever we want now can start sooner
+   {
+      volatile ImageFile *z = decoding_file;
+      if (z != NULL && z->lru < lru_stamp-1 && !z->bail) {
+         trace(TRACE_bail, z->filename, TRACE_decode_begin);
+         z->bail = 1;
+      }
+   }
+}
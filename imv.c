@@ -53,6 +53,10 @@
 #define ALLOW_RECOLORING 0
 #endif
 
+#ifndef USE_TRACE
+#define USE_TRACE 1
+#endif
+
 //#define MONO2
 
 // implement USE_STBI
@@ -82,7 +86,6 @@ typedef int Bool;
 
 Bool do_show;
 float delay_time = 4;
-int nearest_neighbor = 0; // internal use
 
 // all programs get the version number from the same place: version.bat
 #define set   static char *
@@ -93,23 +96,225 @@ int nearest_neighbor = 0; // internal use
 // trivial error handling
 void error(char *str) { MessageBox(NULL, str, "imv(stb) error", MB_OK); }
 
-// OutputDebugString with varargs, can be compiled out
-#ifdef _DEBUG
-int do_debug=1;
-void ods(char *str, ...)
+// Event tracing: each thread records what it's doing into its own ring
+// of timestamped events, which ctrl-T (or exiting, if the IMV_TRACE
+// environment variable names a file) writes out as Chrome trace-event
+// JSON, for chrome://tracing or ui.perfetto.dev. Recording an event is a
+// timer read and a few stores, with no locks and no system calls, so
+// it's always on; define USE_TRACE 0 to compile it out entirely.
+#if USE_TRACE
+enum
 {
-   if (do_debug) {
-      char buffer[1024];
-      va_list va;
-      va_start(va,str);
-      vsprintf(buffer, str, va);
-      va_end(va);
-      OutputDebugString(buffer);
+   TRACE_advance,       // main: they pressed a key to move; arg = direction
+   TRACE_queue,         // main: asked the loader for a file
+   TRACE_read_begin,    // loader
+   TRACE_read_end,      //    arg = bytes, or -1 if it couldn't be read
+   TRACE_decode_begin,  // decoder
+   TRACE_decode_end,    //    arg = 1 if decoded, 0 if not, -1 if cancelled
+   TRACE_resize_begin,  // main or a resize worker
+   TRACE_resize_end,
+   TRACE_current,       // main: this is now the image to show
+   TRACE_display,       // main: first paint of a new cur
+   TRACE_evict,         // main: flushed from the cache; arg = bytes freed
+   TRACE_bail,          // someone gave up on a file; arg = which TRACE_*_begin
+
+   TRACE__num
+};
+
+static struct
+{
+   char *name;
+   char phase;    // 'B'egin, 'E'nd or 'i'nstant, as in the JSON
+   char *arg;     // what the arg means, or NULL if there isn't one
+} trace_info[TRACE__num] =
+{
+   { "advance", 'i', "dir"    },
+   { "queue"  , 'i', NULL     },
+   { "read"   , 'B', NULL     },
+   { "read"   , 'E', "bytes"  },
+   { "decode" , 'B', NULL     },
+   { "decode" , 'E', "result" },
+   { "resize" , 'B', NULL     },
+   { "resize" , 'E', NULL     },
+   { "current", 'i', NULL     },
+   { "display", 'i', NULL     },
+   { "evict"  , 'i', "bytes"  },
+   { "bail"   , 'i', "stage"  },
+};
+
+#define TRACE_EVENTS    4096   // per thread; must be a power of two
+#define TRACE_THREADS   64
+#define TRACE_NAME      40
+
+typedef struct
+{
+   __int64 time;
+   int type, arg;
+   char file[TRACE_NAME];  // just the start of the name, without the path
+} TraceEvent;
+
+// only the owning thread writes to its ring; ->head counts every event
+// it's ever written, so a reader can tell what got overwritten
+typedef struct
+{
+   char *name;
+   volatile long head;
+   TraceEvent events[TRACE_EVENTS];
+} TraceRing;
+
+TraceRing *trace_rings[TRACE_THREADS];
+volatile long trace_num_rings;
+__declspec(thread) TraceRing *trace_my_ring;
+__declspec(thread) int trace_no_ring;
+__int64 trace_start;
+
+void barrier(void);
+
+// the calling thread's ring, created on its first event; returns NULL
+// if it's out of slots or memory, in which case its events are dropped
+static TraceRing *trace_ring(void)
+{
+   if (trace_my_ring == NULL && !trace_no_ring) {
+      long n = stb_atomic_add(&trace_num_rings, 1);
+      TraceRing *r = n < TRACE_THREADS ? (TraceRing *) malloc(sizeof(*r)) : NULL;
+      if (r == NULL) {
+         trace_no_ring = TRUE;
+         return NULL;
+      }
+      r->name = "worker";
+      r->head = 0;
+      trace_my_ring = r;
+      barrier();
+      trace_rings[n] = r;
+   }
+   return trace_my_ring;
+}
+
+// name the calling thread in the trace
+void trace_thread(char *name)
+{
+   TraceRing *r = trace_ring();
+   if (r) r->name = name;
+}
+
+void trace(int type, char *filename, int arg)
+{
+   TraceRing *r = trace_ring();
+   TraceEvent *e;
+   int i=0;
+   if (r == NULL) return;
+   e = &r->events[r->head & (TRACE_EVENTS-1)];
+   QueryPerformanceCounter((LARGE_INTEGER *) &e->time);
+   e->type = type;
+   e->arg = arg;
+   if (filename) {
+      char *s = filename + strlen(filename);
+      while (s > filename && s[-1] != '/' && s[-1] != '\\')
+         --s;
+      for (; s[i] && i < TRACE_NAME-1; ++i)
+         e->file[i] = s[i];
+      // don't cut a utf8 character in half
+      while (i > 0 && (s[i] & 0xc0) == 0x80)
+         --i;
+   }
+   e->file[i] = 0;
+   // the event is complete before the reader can see it
+   barrier();
+   ++r->head;
+}
+
+static void trace_json_string(FILE *f, char *s)
+{
+   fputc('"', f);
+   for (; *s; ++s) {
+      if (*s == '"' || *s == '\\')
+         fprintf(f, "\\%c", *s);
+      else if ((unsigned char) *s < 32)
+         fprintf(f, "\\u%04x", *s);
+      else
+         fputc(*s, f);
    }
+   fputc('"', f);
+}
+
+// write out everything still in the rings. the other threads keep
+// recording while we do this, so copy each ring first and then drop
+// whatever might have been overwritten while we were copying it
+int trace_dump(char *filename)
+{
+   static TraceEvent copy[TRACE_EVENTS];
+   LARGE_INTEGER freq;
+   FILE *f = fopen(filename, "w");
+   int i, first=TRUE, num = stb_min(trace_num_rings, TRACE_THREADS);
+   if (f == NULL) return FALSE;
+   QueryPerformanceFrequency(&freq);
+
+   fprintf(f, "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+   for (i=0; i < num; ++i) {
+      TraceRing *r = trace_rings[i];
+      long start, end, j;
+      if (r == NULL) continue;  // still being created
+      end = r->head;
+      start = stb_max(end - TRACE_EVENTS, 0);
+      barrier();
+      for (j=start; j < end; ++j)
+         copy[j & (TRACE_EVENTS-1)] = r->events[j & (TRACE_EVENTS-1)];
+      barrier();
+      // the owner may be part-way through writing slot 'head', which is
+      // the same slot as head-TRACE_EVENTS, so that one can't be trusted
+      start = stb_max(start, r->head - TRACE_EVENTS + 1);
+
+      fprintf(f, "%s  { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": { \"name\": \"%s\" } }",
+                 first ? "" : ",\n", i, r->name);
+      first = FALSE;
+      for (j=start; j < end; ++j) {
+         TraceEvent *e = &copy[j & (TRACE_EVENTS-1)];
+         fprintf(f, ",\n  { \"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.1f, \"pid\": 1, \"tid\": %d",
+                    trace_info[e->type].name, trace_info[e->type].phase,
+                    (double) (e->time - trace_start) * 1e6 / freq.QuadPart, i);
+         if (trace_info[e->type].phase == 'i')
+            fprintf(f, ", \"s\": \"t\"");
+         fprintf(f, ", \"args\": { \"file\": ");
+         trace_json_string(f, e->file);
+         if (trace_info[e->type].arg) {
+            if (e->type == TRACE_bail)
+               fprintf(f, ", \"stage\": \"%s\"", trace_info[e->arg].name);
+            else
+               fprintf(f, ", \"%s\": %d", trace_info[e->type].arg, e->arg);
+         }
+         fprintf(f, " } }");
+      }
+   }
+   fprintf(f, "\n] }\n");
+   fclose(f);
+   return TRUE;
+}
+
+// where ctrl-T writes the trace: $IMV_TRACE, else the temp directory
+char *trace_filename(char *buffer, int size)
+{
+   char *env = getenv("IMV_TRACE");
+   if (env && *env) return env;
+   if (!GetTempPath(size - 32, buffer)) strcpy(buffer, "c:/");
+   strcat(buffer, "imv(stb)_trace.json");
+   return buffer;
+}
+
+void trace_exit(void)
+{
+   trace_dump(getenv("IMV_TRACE"));
+}
+
+void trace_init(void)
+{
+   QueryPerformanceCounter((LARGE_INTEGER *) &trace_start);
+   trace_thread("main");
+   if (getenv("IMV_TRACE") && *getenv("IMV_TRACE"))
+      atexit(trace_exit);
 }
-#define o(x) ods x
 #else
-#define o(x)
+#define trace(type,filename,arg)
+#define trace_thread(name)
 #endif
 
 
@@ -119,6 +324,9 @@ enum
    WM_APP_DECODED = WM_APP,
    WM_APP_LOAD_ERROR,
    WM_APP_DECODE_ERROR,
+   WM_APP_RESIZED,
+   WM_APP_FILELIST,
+   WM_APP_FOLDER,
 };
 
 
@@ -188,159 +396,15 @@ void wake(int message)
    PostMessage(win, message, 0,0);
 }
 
-typedef struct
-{
-   int x,y;         // size of the image
-   int stride;      // distance between rows in bytes  
-   int frame;       // does this image have a frame (border)?
-   uint8 *pixels;   // pointer to (0,0)th pixel
-   int had_alpha;   // did this have alpha and we statically overwrote it?
-} Image;
-
-enum
-{
-// owned by main thread
-   LOAD_unused=0, // empty slot
-
-   LOAD_inactive, // filename slot, not loaded
-
-   // finished reading, needs decoding--originally decoder
-   // owned this, but then we couldn't free from the cache
-   LOAD_reading_done,
-
-   // in any of the following states, the image is as done as it can be
-   LOAD_error_reading,
-   LOAD_error_decoding,
-   LOAD_available, // loaded successfully
-
-// owned by resizer
-   LOAD_resizing,
-
-// owned by loader
-   LOAD_reading,
-
-// owned by decoder
-   LOAD_decoding,
-};
-
-// does the main thread own this? (if this is true, the main
-// thread can manipulate without locking, except for LOAD_reading_done
-// which requires locking)
-#define MAIN_OWNS(x)   ((x)->status <= LOAD_available)
+// Image, make_image() and the resizers
+#include "resize.c"
 
-// data about a specific file
-typedef struct
-{
-   char *filename;   // name of the file on disk, must be free()d
-   char *filedata;   // data loaded from disk -- passed from reader to decoder
-   int len;          // length of data loaded from disk -- as above
-   Image *image;     // cached image -- passed from decoder to main
-   char *error;      // error message -- from reader or decoder, must be free()d
-   int status;       // current status/ownership with LOAD_* enum
-   int bail;         // flag from main thread to work threads indicating to give up
-   int lru;          // the larger, the higher priority--effectively a timestamp
-} ImageFile;
-
-// controls for interlocking communications
-stb_mutex cache_mutex, decode_mutex;
-stb_semaphore decode_queue;
-stb_semaphore disk_command_queue;
-stb_sync resize_merge;
-
-// a request communicated from the main thread to the disk-loader task
-typedef struct
-{
-   int num_files;
-   ImageFile *files[4];
-} DiskCommand;
-
-// there can only be one pending command in flight
-volatile DiskCommand dc_shared;
-
-// the disk loader sits in this loop forever
-void *diskload_task(void *p)
-{
-   for(;;) {
-      int i;
-      DiskCommand dc;
-
-      // wait to be woken up by a command from the main thread
-      o(("READ: Waiting for disk request.\n"));
-      stb_sem_waitfor(disk_command_queue);
-      // it's possible for the main thread to do:
-      //   1. ... store a command in the command buffer ...
-      //   2. sem_release()
-      //   3. ... store a command in the command buffer ...
-      //   4. sem_release()
-      // and for this thread to complete a previous command and
-      // reach the waitfor() right after step 3 above. If this happens,
-      // this thread will pass the waitfor() (setting the semaphore to 0),
-      // process the latest command, the main thread will do step 4 (setting
-      // the semaphore to 1), and then this thread comes back around and
-      // passes the waitfor() again with no actual pending command. This
-      // case is handled below by clearing the command length to 0.
-
-      // grab the command; don't let the command or the cache change while we do it
-      stb_mutex_begin(cache_mutex);
-      {
-         // copy the command into a local buffer
-         dc = dc_shared;
-         // claim ownership over all the files in the command
-         for (i=0; i < dc.num_files; ++i) {
-            dc.files[i]->status = LOAD_reading;
-            assert(dc.files[i]->filedata == NULL);
-         }
-         // clear the command so we won't re-process it
-         dc_shared.num_files = 0;
-      }
-      stb_mutex_end(cache_mutex);
-
-      o(("READ: Got disk request, %d items.\n", dc.num_files));
-      for (i=0; i < dc.num_files; ++i) {
-         int n;
-         uint8 *data;
-         assert(dc.files[i]->status == LOAD_reading);
-
-         // check if the main thread changed its mind about this
-         // e.g. if this is the third file in a request, and the main thread
-         // has already made another command pending, then it will set this
-         // flag on previous requests, and we shouldn't waste time loading
-         // data that's no longer high-priority
-         if (dc.files[i]->bail) {
-            o(("READ: Bailing on disk request\n"));
-            dc.files[i]->status = LOAD_inactive;
-         } else {
-            o(("READ: Loading file %s\n", dc.files[i]->filename));
-            assert(dc.files[i]->filedata == NULL);
+// the image cache, the loader and decoder threads, and the policy for
+// what to load and what to flush as they browse
+#include "cache.c"
 
-            // read the data
-            data = stb_file(dc.files[i]->filename, &n);
-         
-            // update the results
-            // don't need to mutex these, because we own them via ->status
-            if (data == NULL) {
-               o(("READ: error reading\n"));
-               dc.files[i]->error = strdup("can't open");
-               dc.files[i]->filedata = NULL;
-               dc.files[i]->len = 0;
-               barrier();
-               dc.files[i]->status = LOAD_error_reading;
-               wake(WM_APP_LOAD_ERROR); // wake main thread to react to error
-            } else {
-               o(("READ: Successfully read %d bytes\n", n));
-               dc.files[i]->error = NULL;
-               assert(dc.files[i]->filedata == NULL);
-               dc.files[i]->filedata = data;
-               dc.files[i]->len = n;
-               barrier();
-               dc.files[i]->status = LOAD_reading_done;
-               stb_sem_release(decode_queue); // wake the decode task if needed
-            }
-
-         }
-      }
-   }
-}
+stb_mutex spk_lock;  // guards the .spk base image cache; both the decoder and main decode
+stb_sync spk_merge;  // .spk tiles are decoded on the resize workers
 
 static unsigned char alpha_background[2][3] =
 {
@@ -348,249 +412,11 @@ static unsigned char alpha_background[2][3] =
    { 150,30,150 },
 };
 
-// given raw decoded data from stbi_load, make it into a proper Image (e.g. creating a
-// windows-compatible bitmap with 4-byte aligned rows and BGR color order)
-#if ALLOW_RECOLORING
-float lmin=0,lmax=1;
-int mono;
-#endif
-void make_image(Image *z, int image_x, int image_y, uint8 *image_data, BOOL image_loaded_as_rgb, int image_n)
-{
-   #ifdef ALLOW_RECOLORING
-   int ms,md, ns,nd;
-   #endif
-   int i,j,k,ymin=0,ymax=256*8-1;
-   z->pixels = image_data;
-   z->x = image_x;
-   z->y = image_y;
-   z->stride = image_x*BPP;
-   z->frame = 0;
-   z->had_alpha = (image_n==4);
-
-   if (z->had_alpha) {
-      int n=0;
-      for (n=0; n < image_x * image_y; ++n)
-         if (image_data[n*4+3])
-            break;
-      if (n == image_x * image_y) {
-         // all alpha is 0, so force to 255
-         for (n=0; n < image_x * image_y; ++n)
-            image_data[n*4+3] = 255;
-      }
-   }
-
-   #if ALLOW_RECOLORING
-   if (mono) {
-      k = 0;
-      for (j=0; j < image_y; ++j) {
-         for (i=0; i < image_x; ++i) {
-            int y = image_data[k+0]*5 + image_data[k+1]*9 + image_data[k+2]*2;
-            if (y < ymin) ymin = y;
-            if (y > ymax) ymax = y;
-            k += BPP;
-         }
-      }
-   }
-   #endif
-
-   #if ALLOW_RECOLORING
-   if (lmin > 0)
-      ms = (int) (lmin * 255), md=0;
-   else
-      ms = 0, md = (int)(-lmin*255);
-   if (lmax < 1)
-      ns = (int)(lmax * 255), nd=255;
-   else
-      ns = 255, nd = (int) ((2-lmax)*255);
-   if (ns <= ms)
-      ns = ms+1;
-   if (nd < md)
-      nd = md+1;
-   if (ns == 256) --ns,--ms;
-   if (nd == 256) --nd,--md;
-   #endif
-
-   k=0;
-   for (j=0; j < image_y; ++j) {
-      for (i=0; i < image_x; ++i) {
-         // TODO: hoist branches outside of loops?
-         if (image_loaded_as_rgb) {
-            // swap RGB to BGR
-            unsigned char t = image_data[k+0];
-            image_data[k+0] = image_data[k+2];
-            image_data[k+2] = t;
-         }
-
-         #if ALLOW_RECOLORING
-         if (mono) {
-#ifdef MONO2
-            int p = image_data[k+2];
-#else
-            int y = image_data[k+0]*5 + image_data[k+1]*9 + image_data[k+2]*2;
-            int p = (int) stb_linear_remap(y, ymin, ymax, 0,255);
-#endif
-            image_data[k+0] = p;
-            image_data[k+1] = p;
-            image_data[k+2] = p;
-         } else if (lmin != 0 || lmax != 1) {
-            int c;
-            for (c=0; c < 3; ++c) {
-               int z = (int) stb_linear_remap(image_data[k+c], ms,ns, md,nd);
-               image_data[k+c] = stb_clamp(z, 0, 255);
-            }
-         }
-         #endif
-
-         #if BPP==4
-         // if image had an alpha channel, pre-blend with background
-         if (image_n == 4) {
-            unsigned char *p = image_data+k;
-            int a = (255-p[3]);
-            if ((i ^ j) & 8) {
-               p[0] += (((alpha_background[0][2] - (int) p[0])*a)>>8);
-               p[1] += (((alpha_background[0][1] - (int) p[1])*a)>>8);
-               p[2] += (((alpha_background[0][0] - (int) p[2])*a)>>8);
-            } else {
-               p[0] += (((alpha_background[1][2] - (int) p[0])*a)>>8);
-               p[1] += (((alpha_background[1][1] - (int) p[1])*a)>>8);
-               p[2] += (((alpha_background[1][0] - (int) p[2])*a)>>8);
-            }
-         }
-         #endif
-         k += BPP;
-      }
-   }
-}
-
-
-// Max entries in image cache. This shouldn't be TOO large, because we
-// traverse it inside mutexes sometimes. Also, for large images, we'll
-// hit cache-size limits fairly quickly (a 2 megapixel image requires
-// 8MB, so you could only fit 50 in a 400MB cache), so no reason to be
-// too large anyway
-#define MAX_CACHED_IMAGES  200
-
-// no idea if it needs to be volatile, decided not to worry about proving
-// it one way or the other
-volatile ImageFile cache[MAX_CACHED_IMAGES];
-
-// choose which image to decode and claim ownership
-volatile ImageFile *decoder_choose(void)
-{
-   int i, best_lru=0;
-   volatile ImageFile *best = NULL;
-
-   // if we get unlucky we may have to bail and start over
-start:
-
-   // iterate through the cache and find the ready-to-decode image
-   // that was most in demand (the highest priority will be the most-recently
-   // accessed image or, for prefetching, one right next to it; but this
-   // is policy determined by the main thread, not by this thread).
-   for (i=0; i < MAX_CACHED_IMAGES; ++i) {
-      if (cache[i].status == LOAD_reading_done) {
-         if (cache[i].lru > best_lru) {
-            best = &cache[i];
-            best_lru = best->lru;
-         }
-      }
-   }
-   // it's possible there is no image to decode; see the description
-   // in diskload_task of how it's possible for a task to be woken
-   // from the sem_release() without there being a pending command.
-   if (best) {
-      int retry = FALSE;
-      // if there is a best one, it's possible that while iterating
-      // it was flushed by the main thread. so let's make sure it's
-      // still ready to decode. (Of course it ALSO could have changed
-      // lru priority and other such, so not be the best anymore, but
-      // it's no big deal to get that wrong since it's close.)
-      stb_mutex_begin(cache_mutex);
-      {
-         if (best->status == LOAD_reading_done)
-            best->status = LOAD_decoding;
-         else
-            retry = TRUE;
-      }
-      stb_mutex_end(cache_mutex);
-      // if the status changed out from under us, try again
-      if (retry)
-         goto start;
-   }
-   return best;
-}
-
-static uint8 *imv_decode_from_memory(uint8 *mem, int len, int *x, int *y, BOOL *loaded_as_rgb, int *n, int n_req, char *filename);
-static char  *imv_failure_reason(void);
-
-void *decode_task(void *p)
-{
-   for(;;) {
-
-      // find the best image to decode
-      volatile ImageFile *f = decoder_choose();
-
-      if (f == NULL) {
-         // wait for load thread to wake us
-         o(("DECODE: blocking\n"));
-         stb_sem_waitfor(decode_queue);
-         o(("DECODE: woken\n"));
-      } else {
-         int x,y,loaded_as_rgb,n;
-         uint8 *data;
-         assert(f->status == LOAD_decoding);
-
-         // decode image
-         o(("DECIDE: decoding %s\n", f->filename));
-         data = imv_decode_from_memory(f->filedata, f->len, &x, &y, &loaded_as_rgb, &n, BPP, f->filename);
-         o(("DECODE: decoded %s\n", f->filename));
-
-         // free copy of data from disk, which we don't need anymore
-         free(f->filedata);
-         f->filedata = NULL;
-
-         if (data == NULL) {
-            // error reading file, record the reason for it
-            f->error = strdup(imv_failure_reason());
-            barrier();
-            f->status = LOAD_error_reading;
-            // wake up the main thread in case this is the most recent image
-            wake(WM_APP_DECODE_ERROR);
-         } else {
-            // post-process the image into the right format
-            f->image = (Image *) malloc(sizeof(*f->image));
-            make_image(f->image, x, y,data, loaded_as_rgb, n);
-            barrier();
-            f->status = LOAD_available;
-
-            // wake up the main thread in case this is the most recent image
-            wake(WM_APP_DECODED);
-         }
-      }
-   }
-}
-
 // the image cache entry currently trying to be displayed (may be waiting on resizer)
 ImageFile *source_c;
 // the image currently being displayed--historically redundant to source_c->image
 Image *source;
 
-// allocate an image in windows-friendly format
-Image *bmp_alloc(int x, int y)
-{
-   Image *i = malloc(sizeof(*i));
-   if (!i) return NULL;
-   i->x = x;
-   i->y = y;
-   i->stride = x*BPP;
-   i->stride += (-i->stride) & 3;
-   i->pixels = malloc(i->stride * i->y);
-   i->frame = 0;
-   i->had_alpha = 0;
-   if (i->pixels == NULL) { free(i); return NULL; }
-   return i;
-}
-
 // toggle for whether to draw the stripe in the middle of the border
 int extra_border = TRUE;
 
@@ -620,15 +446,6 @@ void frame(Image *z)
    }
 }
 
-// free an image and its contents
-void imfree(Image *x)
-{
-   if (x) {
-      free(x->pixels);
-      free(x);
-   }
-}
-
 // return an Image which is a sub-region of another image
 Image image_region(Image *p, int x, int y, int w, int h)
 {
@@ -637,27 +454,20 @@ Image image_region(Image *p, int x, int y, int w, int h)
    q.x = w;
    q.y = h;
    q.pixels = p->pixels + y*p->stride + x*BPP;
+   q.frame = 0;
+   q.had_alpha = p->had_alpha;
    return q;
 }
 
 // the currently displayed image--may slightly lag source/source_c
 // while waiting on a resize
 Image *cur;
+// bump whenever cur (or how we display it) changes
+int cur_version;
 
 // the filename for the currently displayed image
 char *cur_filename;
 int show_help=0;
-int downsample_cubic = TRUE;
-int upsample_cubic = TRUE;
-
-int cur_loc = -1; // offset within the current list of files
-
-// information about files we have currently loaded
-struct
-{
-   char *filename;
-   int lru;
-} *fileinfo;
 
 // declare with extra bytes so we can print the version number into it
 char helptext_center[150] =
@@ -730,6 +540,7 @@ void set_error(volatile ImageFile *z)
    InvalidateRect(win, NULL, FALSE);
    imfree(cur);
    cur = NULL;
+   ++cur_version;
    free(cur_filename);
    cur_filename = strdup(z->filename);
    source_c = (ImageFile *) z;
@@ -756,10 +567,277 @@ int show_label = FALSE;  // display the help text or not
 int recursive = FALSE;
 
 // WM_PAINT, etc.
+#if ALLOW_RECOLORING
+float lmin=0,lmax=1;
+int mono;
+#endif
+
+// Display adjustments (levels, mono, alpha) aren't baked into the cache; they're
+// applied to a copy of cur when it's painted, so changing them costs one
+// pass over a window's worth of pixels, instead of throwing away every
+// decoded image and going back to disk.
+Image *cur_adjusted;       // cur with the adjustments applied
+int cur_adjusted_version;  // cur_version that cur_adjusted was built for
+stb_sync adjust_merge;
+
+#if ALLOW_RECOLORING
+// the adjustments are defined on straight color, but alpha images are
+// premultiplied (see make_image()), so undo that around the lookups;
+// 'a' is 255 for images without alpha
+static void straight_color(uint8 *p, int a, int *c)
+{
+   int k;
+   for (k=0; k < 3; ++k)
+      c[k] = (a == 255) ? p[k] : a ? stb_min(p[k]*255 / a, 255) : 0;
+}
+
+#define premultiplied(v,a)   ((a) == 255 ? (v) : ((v)*(a) + 127) / 255)
+
+static void mono_row(uint8 *p, int n, uint8 *lut, int alpha)
+{
+   int i;
+   for (i=0; i < n; ++i, p += BPP) {
+      int a = alpha ? p[3] : 255, c[3], v;
+      straight_color(p, a, c);
+#ifdef MONO2
+      v = c[2];
+#else
+      v = lut[c[0]*5 + c[1]*9 + c[2]*2];
+#endif
+      v = premultiplied(v, a);
+      p[0] = v;
+      p[1] = v;
+      p[2] = v;
+   }
+}
+
+static void levels_row(uint8 *p, int n, uint8 *lut, int alpha)
+{
+   int i;
+   for (i=0; i < n; ++i, p += BPP) {
+      int a = alpha ? p[3] : 255, c[3];
+      straight_color(p, a, c);
+      p[0] = premultiplied(lut[c[0]], a);
+      p[1] = premultiplied(lut[c[1]], a);
+      p[2] = premultiplied(lut[c[2]], a);
+   }
+}
+#endif
+
+#if BPP==4
+// blend a run of premultiplied pixels over one background color:
+//    p += bg * (255-alpha) / 255
+// where the /255 is done as *256/255 (a += a>>7, exact at both ends), >>8
+#if RESIZE_MMX
+static void composite_span(uint8 *p, int len, uint32 bg)
+{
+   if (len <= 0) return;
+   __asm {
+      push eax
+      push ecx
+      push edx
+      push esi
+      mov   esi,p
+      mov   ecx,len
+      pxor  mm7,mm7
+      movd  mm6,bg
+      punpcklbw mm6,mm7   // mm6 = background
+      psllw mm6,2         // ...times 4, to make up for the scale below
+   } composite_top: __asm {
+      movzx edx,byte ptr [esi+3]
+      movd  mm0,[esi]
+      xor   edx,255       // edx = 255-alpha
+      mov   eax,edx
+      shr   eax,7
+      add   edx,eax       // ...scaled to 0..256
+      shl   edx,6         // as 2.14, to stay clear of the sign bit
+      movd  mm2,edx
+      punpcklbw mm0,mm7   // mm0 = p
+      punpcklwd mm2,mm2
+      movq  mm1,mm6
+      punpckldq mm2,mm2   // mm2 = (255-alpha)<<6 x4
+      pmulhw mm1,mm2      // mm1 = bg * (255-alpha) >> 8
+      paddw mm0,mm1
+      packuswb mm0,mm0
+      movd  [esi],mm0
+      add   esi,4
+      dec   ecx
+      jnz   composite_top
+      emms
+      pop esi
+      pop edx
+      pop ecx
+      pop eax
+   }
+}
+#else
+static void composite_span(uint8 *p, int len, uint32 bg)
+{
+   int i, b0 = bg & 255, b1 = (bg >> 8) & 255, b2 = (bg >> 16) & 255;
+   for (i=0; i < len; ++i, p += 4) {
+      int a = (255-p[3]);
+      a += a >> 7;
+      // cubic can overshoot a little past alpha, so saturate like packuswb
+      p[0] = stb_min(p[0] + ((b0*a)>>8), 255);
+      p[1] = stb_min(p[1] + ((b1*a)>>8), 255);
+      p[2] = stb_min(p[2] + ((b2*a)>>8), 255);
+   }
+}
+#endif
+
+// composite row j onto the checkerboard, which alternates every 8 pixels
+static void composite_row(uint8 *p, int n, int j, uint32 *checker)
+{
+   int i;
+   for (i=0; i < n; i += 8)
+      composite_span(p + i*4, stb_min(8, n-i), checker[((i ^ j) & 8) ? 0 : 1]);
+}
+#endif
+
+struct
+{
+   Image *dest;
+   Image *src;
+   #if ALLOW_RECOLORING
+   uint8 *mono_lut;         // luminance (0..255*16) -> gray, or NULL
+   uint8 *levels_lut;       // lmin/lmax remapping, or NULL
+   #endif
+   uint32 checker[2];       // alpha_background, as BGR pixels
+} adjust_work;
+
+#define ADJUST_BAND  32
+
+void *adjust_image_work(int n)
+{
+   Image *dest = adjust_work.dest, *src = adjust_work.src;
+   int j  = n * ADJUST_BAND;
+   int j1 = stb_min(j + ADJUST_BAND, src->y);
+   for (; j < j1; ++j) {
+      uint8 *p = dest->pixels + j*dest->stride;
+      memcpy(p, src->pixels + j*src->stride, src->x*BPP);
+      // leave the frame alone
+      if (j < src->frame || j >= src->y - src->frame)
+         continue;
+      p += src->frame*BPP;
+      #if ALLOW_RECOLORING
+      if (adjust_work.mono_lut)
+         mono_row(p, src->x - src->frame*2, adjust_work.mono_lut, src->had_alpha);
+      else if (adjust_work.levels_lut)
+         levels_row(p, src->x - src->frame*2, adjust_work.levels_lut, src->had_alpha);
+      #endif
+      #if BPP==4
+      // alpha is composited here, at display size, rather than into the
+      // full-size image before resizing: there are far fewer pixels, and
+      // the checkerboard stays crisp
+      if (src->had_alpha)
+         composite_row(p, src->x - src->frame*2, j - src->frame, adjust_work.checker);
+      #endif
+   }
+   return NULL;
+}
+
+int adjustments_active(void)
+{
+   #if ALLOW_RECOLORING
+   if (mono || lmin != 0 || lmax != 1)
+      return TRUE;
+   #endif
+   return FALSE;
+}
+
+// call after changing any of the adjustments
+void adjustments_changed(void)
+{
+   ++cur_version;
+   InvalidateRect(win, NULL, FALSE);
+}
+
+// return the image to actually draw for cur, rebuilding cur_adjusted
+// if it's out of date
+Image *display_image(void)
+{
+   int i;
+   #if ALLOW_RECOLORING
+   uint8 levels_lut[256], *mono_lut=NULL;
+   int j, ms,md, ns,nd;
+   #endif
+
+   if (!adjustments_active() && !cur->had_alpha)
+      return cur;
+   if (cur_adjusted && cur_adjusted_version == cur_version)
+      return cur_adjusted;
+
+   imfree(cur_adjusted);
+   cur_adjusted = bmp_alloc(cur->x, cur->y);
+   if (!cur_adjusted)
+      return cur;
+   cur_adjusted->frame = cur->frame;
+
+   #if ALLOW_RECOLORING
+   adjust_work.mono_lut = NULL;
+   adjust_work.levels_lut = NULL;
+   if (mono) {
+      int ymin=0,ymax=256*8-1;
+      for (j=cur->frame; j < cur->y - cur->frame; ++j) {
+         uint8 *p = cur->pixels + j*cur->stride + cur->frame*BPP;
+         for (i=cur->frame; i < cur->x - cur->frame; ++i, p += BPP) {
+            int a = cur->had_alpha ? p[3] : 255, c[3], y;
+            if (a == 0) continue; // invisible, so its color doesn't count
+            straight_color(p, a, c);
+            y = c[0]*5 + c[1]*9 + c[2]*2;
+            if (y < ymin) ymin = y;
+            if (y > ymax) ymax = y;
+         }
+      }
+      mono_lut = (uint8 *) malloc(255*16+1);
+      if (mono_lut)
+         for (i=0; i <= 255*16; ++i)
+            mono_lut[i] = (int) stb_linear_remap(i, ymin, ymax, 0,255);
+      adjust_work.mono_lut = mono_lut;
+   } else if (lmin != 0 || lmax != 1) {
+      if (lmin > 0)
+         ms = (int) (lmin * 255), md=0;
+      else
+         ms = 0, md = (int)(-lmin*255);
+      if (lmax < 1)
+         ns = (int)(lmax * 255), nd=255;
+      else
+         ns = 255, nd = (int) ((2-lmax)*255);
+      if (ns <= ms)
+         ns = ms+1;
+      if (nd < md)
+         nd = md+1;
+      if (ns == 256) --ns,--ms;
+      if (nd == 256) --nd,--md;
+      for (i=0; i < 256; ++i) {
+         int v = (int) stb_linear_remap(i, ms,ns, md,nd);
+         levels_lut[i] = stb_clamp(v, 0, 255);
+      }
+      adjust_work.levels_lut = levels_lut;
+   }
+   #endif
+
+
+   for (i=0; i < 2; ++i)
+      adjust_work.checker[i] = RGB(alpha_background[i][2], alpha_background[i][1], alpha_background[i][0]);
+   adjust_work.dest = cur_adjusted;
+   adjust_work.src  = cur;
+   run_tiles(adjust_merge, (stb_thread_func) adjust_image_work, (cur->y + ADJUST_BAND-1) / ADJUST_BAND);
+
+   #if ALLOW_RECOLORING
+   free(mono_lut);
+   #endif
+   cur_adjusted_version = cur_version;
+   return cur_adjusted;
+}
+
+void stats_paint(int error);
+
 void display(HWND win, HDC hdc)
 {
    RECT rect,r2;
    HBRUSH b = GetStockObject(BLACK_BRUSH);
+   Image *image;
    int w,h,x,y;
 
    // get the window size for centering
@@ -775,6 +853,7 @@ void display(HWND win, HDC hdc)
       FillRect(hdc, &rect, b);  // clear to black -- will flicker
       if (rect.bottom > rect.top + 100) rect.top += 50; // displace down from top; could center
       draw_nice(hdc, display_error, &rect, DT_CENTER);
+      stats_paint(TRUE);
       return;
    }
 
@@ -785,7 +864,18 @@ void display(HWND win, HDC hdc)
    // of the window.
    x = (w - cur->x) >> 1;
    y = (h - cur->y) >> 1;
-   platformDrawBitmap(hdc, x,y,cur->pixels, cur->x, cur->y, cur->stride, show_help);
+   image = display_image();
+   platformDrawBitmap(hdc, x,y,image->pixels, image->x, image->y, image->stride, show_help);
+   stats_paint(FALSE);
+   #if USE_TRACE
+   {
+      static int traced_version = -1;
+      if (traced_version != cur_version) {
+         trace(TRACE_display, cur_filename, 0);
+         traced_version = cur_version;
+      }
+   }
+   #endif
 
    // draw in infinite borders on all four sides
    r2 = rect;
@@ -864,41 +954,61 @@ typedef struct
    int w,h;
 } queued_size;
 
-// most recent unsatisfied resize request (private to main thread)
+// most recent unsatisfied resize request (private to main thread); newer
+// requests simply overwrite older ones, so however fast they drag the
+// window, we only ever have one resize running and one waiting
 queued_size qs;
 
-// active resize request, mainly just used by main thread (resize
-// thread writes to 'image' field.
+// active resize request, private to main thread; size.w is non-zero
+// while a background resize is in flight ('image' is only used for
+// immediate resizes)
 struct
 {
    queued_size size;
    Image *image;
-   char *filename;
    ImageFile *image_c;
 } pending_resize;
 
-// temporary structure for communicating across stb_workq() call
+// if resizing would touch more pixels than this, show a quick preview
+// first and then swap in the real thing when it's done
+#define PREVIEW_PIXELS  (3 << 20)
+
+// a resize job; background jobs are malloc()ed by queue_resize and
+// come back to the main thread on resized_queue when they're done
 typedef struct
 {
    ImageFile *src;
    Image dest;
    Image *result;
+   queued_size size;  // window size to show the result at
+   char *filename;    // strdup()ed, ownership passes to whoever shows it
 } Resize;
 
+stb_ring *resized_queue;  // resizer -> main, finished resizes
+
 // threaded image resizer, uses work queue AND current thread
 void image_resize(Image *dest, Image *src);
+// fast, ugly point-sampled version of the same
+void image_resize_preview(Image *dest, Image *src);
 
-// wrapper for image_resize() to be called via work queue
+// wrapper for image_resize() to be called via work queue; hands the
+// finished job back to the main thread and wakes it up, so it never
+// has to poll for us
 void * work_resize(void *p)
 {
    Resize *r = (Resize *) p;
+   trace_thread("resizer");
+   trace(TRACE_resize_begin, r->filename, 0);
    image_resize(&r->dest, r->src->image);
-   return r->result;
+   trace(TRACE_resize_end, r->filename, 0);
+   // the ring is far deeper than the number of resizes in flight, but
+   // don't lose the result if the main thread is somehow way behind
+   while (!stb_ring_put(resized_queue, r))
+      Sleep(1);
+   wake(WM_APP_RESIZED);
+   return NULL;
 }
 
-// dedicate workqueue workers for resizing
-stb_workqueue *resize_workers;
-
 // compute the size to resize an image to given a target window (gw,gh);
 // we assume the input window (sw,wh) has already been expanded by its
 // frame size.
@@ -920,13 +1030,45 @@ void compute_size(int gw, int gh, int sw, int sh, int *ox, int *oy)
    }
 }
 
+// show a freshly resized image (taking ownership of it and of filename),
+// and move the window to 'size' to match
+void present_resize(Image *image, char *filename, queued_size size)
+{
+   HDC hdc;
+
+   // free the current image we're about to write over
+   imfree(cur);
+   cur = image;
+   ++cur_version;
+   free(cur_filename);
+   cur_filename = filename;
+
+   // clear error messages
+   display_error[0] = 0;
+
+   if (!show_frame) {
+      size.x += FRAME;
+      size.y += FRAME;
+      size.w -= FRAME*2;
+      size.h -= FRAME*2;
+   }
+
+   // resize the window
+   SetWindowPos(win,NULL,size.x, size.y, size.w, size.h, SWP_NOZORDER|SWP_NOCOPYBITS);
+
+   // paint the window
+   hdc = GetDC(win);
+   display(win, hdc);
+   ReleaseDC(win, hdc);
+}
+
 // resize an image. if immediate=TRUE, we run it from the main thread
 // and won't return until it's resized; if !immediate, we hand it to
 // a workqueue and return before it's done. (note that if immediate=TRUE,
 // we still use the work queue to accelerate, if possible)
 void queue_resize(int w, int h, ImageFile *src_c, int immediate)
 {
-   static Resize res; // must be static because we expose (very briefly) to other thread
+   Resize local, *res = &local;
    Image *src = src_c->image;
    Image *dest;
    int w2,h2;
@@ -944,29 +1086,86 @@ void queue_resize(int w, int h, ImageFile *src_c, int immediate)
 
    // encode the border around it
    frame(dest);
+   dest->had_alpha = src->had_alpha;
+
+   // background jobs outlive this call, so they need their own storage
+   if (!immediate) {
+      res = (Resize *) malloc(sizeof(*res));
+      if (!res) { imfree(dest); return; }
+   }
 
    // build the parameter list for image_resize
-   res.src = src_c;
-   res.dest = image_region(dest, FRAME, FRAME, w2, h2);
-   res.result = dest;
+   res->src = src_c;
+   res->dest = image_region(dest, FRAME, FRAME, w2, h2);
+   res->result = dest;
+   res->size = pending_resize.size;
+   res->filename = NULL;
+   resize_abandon = FALSE;
 
    if (!immediate) {
+      // a big resize can take long enough to notice, so put up a quick
+      // point-sampled version right now, and swap in the real one later
+      if (src->x*src->y + w2*h2 > PREVIEW_PIXELS) {
+         Image *preview = bmp_alloc(w2+FRAME*2,h2+FRAME*2);
+         if (preview) {
+            Image region = image_region(preview, FRAME, FRAME, w2, h2);
+            frame(preview);
+            preview->had_alpha = src->had_alpha;
+            image_resize_preview(&region, src);
+            present_resize(preview, strdup(src_c->filename), res->size);
+         }
+      }
       // update status to be owned by the resizer (which isn't running yet,
       // so there's no thread issues here)
       src_c->status = LOAD_resizing;
       // store data to come back for later
       pending_resize.image = NULL;
       pending_resize.image_c = src_c;
-      pending_resize.filename = strdup(src_c->filename);
-      // run the resizer in the background (equivalent to the call below)
-      stb_workq(resize_workers, work_resize, &res, &pending_resize.image);
+      res->filename = strdup(src_c->filename);
+      // run the resizer in the background; it posts WM_APP_RESIZED when done
+      stb_workq(resize_workers, work_resize, res, NULL);
    } else {
       // run the resizer in the main thread
-      pending_resize.image = work_resize(&res);
+      trace(TRACE_resize_begin, src_c->filename, 0);
+      image_resize(&res->dest, src);
+      trace(TRACE_resize_end, src_c->filename, 0);
+      pending_resize.image = dest;
+   }
+}
+
+// collect finished background resizes from resized_queue and show them;
+// returns TRUE if there were any
+int finish_resizes(void)
+{
+   void *p;
+   int any = FALSE;
+   while (stb_ring_get(resized_queue, &p)) {
+      Resize *r = (Resize *) p;
+
+      // reclaim ownership of the image from the resizer
+      r->src->status = LOAD_available;
+
+      if (resize_abandon || r->src != source_c) {
+         // it's half-done garbage, or of an image they've left; either way
+         // nobody wants it, and painting it would cover what's there now
+         imfree(r->result);
+         free(r->filename);
+      } else {
+         // r->filename was strdup()ed, so just pass ownership along
+         present_resize(r->result, r->filename, r->size);
+      }
+      free(r);
+
+      // clear the resize request info, so the next one can start
+      resize_abandon = FALSE;
+      pending_resize.size.w = 0;
+      any = TRUE;
    }
+   return any;
 }
 
-// put a resize request in the "queue" (which is only one deep)
+// put a resize request in the "queue" (which is only one deep, so requests
+// coalesce; the main loop cancels a running resize that this supersedes)
 void enqueue_resize(int left, int top, int width, int height)
 {
    if (cur && ((width == cur->x && height >= cur->y) || (height == cur->y && width >= cur->x))) {
@@ -1143,9 +1342,11 @@ void size_to_current(int maximize)
 
       // build the new one
       cur = bmp_alloc(w2,h2);
+      ++cur_version;
       cur_filename = strdup(source_c->filename);
       // build a frame around the data
       frame(cur);
+      cur->had_alpha = source->had_alpha;
       // copy the raw data in
       for (j=0; j < source->y; ++j) {
          unsigned char *q = cur->pixels + (j+FRAME)*cur->stride + FRAME*BPP;
@@ -1190,8 +1391,12 @@ void toggle_frame(void)
    SetWindowPos(win, NULL, rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top, SWP_NOCOPYBITS|SWP_NOOWNERZORDER);
 }
 
-// the most recent image we've seen
-int best_lru = 0;
+// the cache mustn't flush the image we're showing; cur is our own
+// copy, so that's just source_c
+int showing(volatile ImageFile *z)
+{
+   return z == source_c;
+}
 
 // when we change which file is the one being viewed/resized,
 // call this function to update our globals and fit to window
@@ -1199,7 +1404,8 @@ void update_source(ImageFile *q)
 {
    source = q->image;
    source_c = q;
-   o(("Making %s (%d) current\n", q->filename, q->lru));
+   q->prefetched = FALSE;  // it's being shown, so it wasn't wasted
+   trace(TRACE_current, q->filename, 0);
    if (q->lru > best_lru)
       best_lru = q->lru;
 
@@ -1207,12 +1413,15 @@ void update_source(ImageFile *q)
       size_to_current(FALSE); // don't maximize
 }
 
+void record_view(void);
+
 // toggle between the two main display modes
 void toggle_display(void)
 {
    if (source) {
       display_mode = (display_mode + 1) % DISPLAY__num;
       size_to_current(TRUE); // _DO_ maximize if DISPLAY_current
+      record_view();
    }
 }
 
@@ -1223,388 +1432,373 @@ void toggle_display(void)
 // before they're flushed, it will still be valid
 char *filename;   // @TODO: gah, we have cur_filename AND filename. and filename is being set dumbly!
 
-// stb_sdict is a string dictionary (strings as keys, void * as values)
-// dictionary mapping filenames (key) to cached images (ImageFile *)
-// We can't just replace this with an ImageFile* in the fileinfo (and
-// the backpointer) because we keep ImageFile entries around for images
-// not in the fileinfo list.
-stb_sdict *file_cache;
+// the full path of the current file; 'filename' usually points here
+char curfile_path[4096];
+
+stb_mutex scan_lock;  // one scan_filelist() at a time
 
-// when switching/refreshing directories, free this data
-void free_fileinfo(void)
+// build a filelist for the current directory
+// recursive scans spend most of their time waiting on the disk, so scan
+// each top-level subdirectory on a different worker
+struct
 {
-   int i;
-   for (i=0; i < stb_arr_len(fileinfo); ++i)
-      free(fileinfo[i].filename); // allocated by stb_readdir
-   stb_arr_free(fileinfo);
-   fileinfo = NULL;
+   char **dirs;
+   char ***found;
+   char *mask;
+   volatile int *abandon;
+} readdir_work;
+stb_sync readdir_merge;
+
+void *readdir_work_dir(int n)
+{
+   if (ABANDONED(readdir_work.abandon)) return NULL;
+   readdir_work.found[n] = stb_readdir_recursive(readdir_work.dirs[n], readdir_work.mask);
+   return NULL;
 }
 
-//derived from michael herf's code: http://www.stereopsis.com/strcmp4humans.html
-
-// sorts like this:
-//     foo.jpg
-//     foo1.jpg
-//     foo2.jpg
-//     foo10.jpg
-//     foo_1.jpg
-//     food.jpg
-
-// use upper, not lower, to get better sorting versus '_'
-// no, use lower not upper, to get sorting that matches explorer
-__forceinline char tupper(char b)
+// same as stb_readdir_recursive(), in the same order, unless abandoned
+char **readdir_recursive(char *dir, char *mask, volatile int *abandon)
 {
-	if (b >= 'A' && b <= 'Z') return b - 'A' + 'a';
-	//if (b >= 'a' && b <= 'z') return b - 'a' + 'A';
-	return b;
+   char **files = stb_readdir_files_mask(dir, mask);
+   char **dirs  = stb_readdir_subdirs(dir);
+   int i,j, n = stb_arr_len(dirs);
+   if (n) {
+      readdir_work.dirs  = dirs;
+      readdir_work.mask  = mask;
+      readdir_work.abandon = abandon;
+      readdir_work.found = (char ***) calloc(n, sizeof(*readdir_work.found));
+      if (readdir_work.found == NULL) {
+         stb_readdir_free(dirs);
+         stb_readdir_free(files);
+         return stb_readdir_recursive(dir, mask);
+      }
+      run_tiles(readdir_merge, (stb_thread_func) readdir_work_dir, n);
+      for (i=0; i < n; ++i) {
+         // take ownership of the filenames, but not the array
+         for (j=0; j < stb_arr_len(readdir_work.found[i]); ++j)
+            stb_arr_push(files, readdir_work.found[i][j]);
+         stb_arr_free(readdir_work.found[i]);
+      }
+      free(readdir_work.found);
+   }
+   stb_readdir_free(dirs);
+   return files;
 }
 
-__forceinline char isnum(char b)
+// read and sort the image files in 'dir'. this can run on any thread;
+// scan_lock takes them one at a time, since they share readdir_work and
+// sort_work. 'abandon' may be NULL; if it's set partway, it stops early
+// and what it returns is junk for the caller to free
+char **scan_filelist(char *dir, int recurse, volatile int *abandon)
 {
-	if (b >= '0' && b <= '9') return 1;
-	return 0;
+   char **image_files; // stb_arr (dynamic array type) of filenames
+   stb_mutex_begin(scan_lock);
+   if (ABANDONED(abandon))
+      image_files = NULL;
+   else if (recurse)
+      image_files = readdir_recursive(dir, open_filter + 12, abandon);
+   else
+      image_files = stb_readdir_files_mask(dir, open_filter + 12);
+   if (image_files && !ABANDONED(abandon))
+      sort_filelist(image_files, abandon);
+   stb_mutex_end(scan_lock);
+   return image_files;
 }
 
-__forceinline int parsenum(char **a_p)
+// look for 'name' in a scanned filelist; if it's not there, we start at 0
+int find_in_filelist(char **image_files, char *name)
 {
-   char *a = *a_p;
-	int result = *a - '0';
-	++a;
-
-	while (isnum(*a)) {
-		result *= 10;
-		result += *a - '0';
-		++a;
-	}
-
-	*a_p = a-1;
-	return result;
+   int i, loc = 0;
+   for (i=0; i < stb_arr_len(image_files); ++i)
+      if (!stricmp(image_files[i], name))
+         loc = i;
+   return loc;
 }
 
-int StringCompare(char *a, char *b)
+// when we're started on a single file, we don't need the filelist until
+// they start browsing, and a big folder (or a recursive one on a network
+// drive) can take seconds to read. so read it in the background, and
+// don't make the window or the first keypress wait for it. rescans work
+// the same way, browsing the old list until the new one arrives
+typedef struct
 {
-   char *orig_a = a, *orig_b = b;
-
-	if (a == b) return 0;
+   char *path;       // our own copies; the main thread may change them
+   char *filename;
+   int recursive;
+   int replace;      // a rescan: install over a real filelist, too...
+   int jump;         // ...and go to 'loc', rather than stay on the current file
+   volatile int abandon;  // set when the main thread no longer wants it
+   stb_semaphore done;    // released when the scan thread exits
+   char **files;     // results: sorted stb_arr of filenames
+   int loc;          // index of 'filename' in 'files'
+   void **changes;   // FolderChange *s seen while a rescan ran (stb_arr)
+} FileScan;
+
+FileScan *pending_scan;    // the scan in progress, if any; main thread only
+int filelist_provisional;  // fileinfo is just the opened file, until the scan is done
+
+void *filelist_task(void *p)
+{
+   FileScan *s = p;
+   s->files = scan_filelist(s->path, s->recursive, &s->abandon);
+   if (s->files && !s->abandon)
+      s->loc = find_in_filelist(s->files, s->filename);
+   // pass the scan along so the main thread can tell if it's stale
+   PostMessage(win, WM_APP_FILELIST, 0, (LPARAM) s);
+   return NULL;
+}
 
-	if (a == NULL) return -1;
-	if (b == NULL) return 1;
+static void run_filelist_scan(int replace, int jump)
+{
+   FileScan *s = malloc(sizeof(*s));
+   if (s == NULL) return; // advance() reads it synchronously if it has to
+   s->path = strdup(path_to_file);
+   s->filename = strdup(jump ? "" : filename);
+   s->recursive = recursive;
+   s->replace = replace;
+   s->jump = jump;
+   s->abandon = FALSE;
+   s->done = stb_sem_new(1);
+   s->files = NULL;
+   s->loc = 0;
+   s->changes = NULL;
+   pending_scan = s;
+   stb_create_thread2(filelist_task, s, NULL, s->done);
+}
 
-	while (*a && *b) {
+void start_filelist_scan(void)
+{
+   if ((fileinfo && !filelist_provisional) || pending_scan) return;
+   run_filelist_scan(FALSE, FALSE);
+}
 
-		int a0, b0;	// will contain either a number or a letter
+// once its WM_APP_FILELIST arrives, the thread is about to exit; wait for
+// that, then free the scan and anything it found that wasn't installed.
+// that message is the only place this happens, so it's exactly once
+static void free_filelist_scan(FileScan *s)
+{
+   int i;
+   stb_sem_waitfor(s->done);
+   stb_sem_delete(s->done);
+   if (s->files)
+      stb_readdir_free(s->files);
+   for (i=0; i < stb_arr_len(s->changes); ++i)
+      free(s->changes[i]);
+   stb_arr_free(s->changes);
+   free(s->path);
+   free(s->filename);
+   free(s);
+}
 
-      if (isnum(*a) && isnum(*b)) {
-			a0 = parsenum(&a);
-			b0 = parsenum(&b);
-      } else {
-         // if they are mixed number and character, use ASCII comparison
-         // order between them (number before character), not herf's
-         // approach (numbers after everything else). this produces the order:
-         //     foo.jpg
-         //     foo1.jpg
-         //     food.jpg
-         //     foo_.jpg
-         // which I think looks better than having foo_ before food (but
-         // I could be wrong, given how a blank space sorts)
-
-			a0 = tupper(*a);
-			b0 = tupper(*b);
-		}
-
-		if (a0 < b0) return -1;
-		if (a0 > b0) return 1;
-
-		++a;
-		++b;
-	}
-
-	if (*a) return 1;
-	if (*b) return -1;
-
-	{
-      // if strings differ only by leading 0s, use case-insensitive ASCII sort
-      // (note, we should work this out more efficiently by noticing which one changes length first)
-      int z = stricmp(orig_a, orig_b);
-      if (z) return z;
-      // if identical case-insensitive, return ASCII sort
-      return strcmp(orig_a, orig_b);
+// stop wanting the background scan, without waiting for it; it bails
+// out at its next check, and WM_APP_FILELIST frees it when it's done
+void abandon_filelist_scan(void)
+{
+   if (pending_scan) {
+      pending_scan->abandon = TRUE;
+      pending_scan = NULL;
    }
 }
 
-int StringCompareSort(const void *p, const void *q)
+// read the folder again in the background; they keep browsing the list
+// they have until it's done. if 'jump' is set, it then goes to the first
+// file in the new list, instead of staying on the current one
+void rescan_filelist(int jump)
 {
-   return StringCompare(*(char **) p, *(char **) q);
+   abandon_filelist_scan();
+   if (stb_arr_len(fileinfo))
+      filename = file_path(curfile_path, sizeof(curfile_path), cur_loc);
+   run_filelist_scan(TRUE, jump);
 }
 
-char *open_filter = "Image Files\0*.jpg;*.jpeg;*.png;*.bmp;*.tga;*.hdr;*.spk\0";
+void watch_folder(void);
+void apply_scan_changes(FileScan *s);
 
-// build a filelist for the current directory
+// wait for the background scan, if there is one. if 'install' is set and
+// we don't have a real filelist yet (or it's a rescan), use its results.
+// returns TRUE if it installed a filelist
+int finish_filelist_scan(int install)
+{
+   FileScan *s = pending_scan;
+   int installed = FALSE;
+   if (s == NULL) return FALSE;
+   stb_sem_waitfor(s->done);
+   stb_sem_release(s->done);  // free_filelist_scan() waits on it too
+   pending_scan = NULL;
+   if (s->files && install && (fileinfo == NULL || filelist_provisional || s->replace)) {
+      // they may have moved on while it was scanning
+      int loc = (s->replace && !s->jump) ? find_in_filelist(s->files, filename) : s->loc;
+      free_fileinfo();
+      install_filelist(s->files, loc);
+      s->files = NULL;
+      if (stb_arr_len(fileinfo))
+         filename = file_path(curfile_path, sizeof(curfile_path), cur_loc);
+      apply_scan_changes(s);
+      watch_folder();
+      installed = TRUE;
+   }
+   filelist_provisional = FALSE;
+   return installed;
+}
+
+// read the filelist right now, when they can't do anything until it's
+// there (starting on a folder, or when the background scan couldn't
+// start); otherwise use rescan_filelist()
 void init_filelist(void)
 {
    char **image_files; // stb_arr (dynamic array type) of filenames
-   char *to_free = NULL; 
-   int i;
+
+   // anything the background scan found is about to be out of date;
+   // scan_lock makes ours wait for it to notice and give up
+   abandon_filelist_scan();
+
    if (fileinfo) {
-      // cache the current filename so we can look for it in the list below
-      // @BUG: is this leaking the old filename?
-      filename = to_free = strdup(fileinfo[cur_loc].filename);
+      // save the current filename so we can look for it in the list below
+      filename = file_path(curfile_path, sizeof(curfile_path), cur_loc);
       free_fileinfo();
    }
 
-   if (recursive)
-      image_files = stb_readdir_recursive(path_to_file, open_filter + 12);
-   else
-      image_files = stb_readdir_files_mask(path_to_file, open_filter + 12);
-
+   image_files = scan_filelist(path_to_file, recursive, NULL);
    if (image_files == NULL) { error("Error: couldn't read directory."); exit(0); }
-   qsort(image_files, stb_arr_len(image_files), sizeof(*image_files), StringCompareSort);
-
-   // given the array of filenames, build an equivalent fileinfo array
-   stb_arr_setlen(fileinfo, stb_arr_len(image_files));
 
-   // while we're going through, let's look for the current file, and
+   // while we're building fileinfo, look for the current file, and
    // initialize 'cur_loc' to that value. Otherwise it gets a 0.
-   cur_loc = 0;
-   for (i=0; i < stb_arr_len(image_files); ++i) {
-      fileinfo[i].filename = image_files[i];
-      fileinfo[i].lru = 0;      
-      if (!stricmp(image_files[i], filename))
-         cur_loc = i;
-   }
-
-   // if we made a temp copy of the filename, free it... wait, why,
-   // given that we're not setting filename=NULL?!
-   // @TODO: why didn't this hurt? if (to_free) free(to_free);
+   install_filelist(image_files, find_in_filelist(image_files, filename));
+   filelist_provisional = FALSE;
 
-   // free the stb_readdir() array, but not the filenames themselves
-   stb_arr_free(image_files); 
+   // and keep it up to date
+   watch_folder();
 }
 
-// current lru timestamp
-int lru_stamp=1;
+int cur_is_current(void);
 
-// maximum size of the cache
-int max_cache_bytes = 256 * (1 << 20); // 256 MB; one 5MP image is 20MB
-
-// minimum number of cache entries
-#define MIN_CACHE  3    // always keep 3 images cached, to allow prefetching
-
-// compare the lru timestamps in two cached images, with extra indirection
-int ImageFilePtrCompare(const void *p, const void *q)
+// we're painting; it only counts if what's on screen is really
+// the file they stepped to, not something left over from before
+void stats_paint(int error)
 {
-   ImageFile *a = *(ImageFile **) p;
-   ImageFile *b = *(ImageFile **) q;
-   return (a->lru < b->lru) ? -1 : (a->lru > b->lru);   
+   if (cur_is_current())
+      stats_painted(source_c, error);
 }
 
-// see if we should flush any data. we should flush if
-// (a) there aren't enough free slots for prefetching, and
-// (b) if we're using too much memory
+// IMV_STATS names a file to append a line of stats to every 30 seconds
+// (and at exit), for comparing cache and prefetch settings in real use
+#define STATS_TIMER     1
+#define STATS_PERIOD    30000
+char *stats_log_name;
 
-void flush_cache(int locked)
+void stats_log(void)
 {
-   int limit = MAX_CACHED_IMAGES - MIN_CACHE; // maximum images to cache
-
-   volatile ImageFile *list[MAX_CACHED_IMAGES];
-   int i, total=0, occupied_slots=0, n=0;
-
-   // count number of images in use, and size they're using
-   for (i=0; i < MAX_CACHED_IMAGES; ++i) {
-      volatile ImageFile *z = &cache[i];
-      if (z->status != LOAD_unused)
-         ++occupied_slots;
-      if (MAIN_OWNS(z)) {
-         if (z->status == LOAD_available) {
-            total += z->image->stride * z->image->y;
-         } else if (z->status == LOAD_reading_done) {
-            total += z->len;
-         }
-         list[n++] = z;
-      } // if main doesn't own, don't worry about it... so we may underestimate sometimes
-   }
-
-   if (!(total > max_cache_bytes || occupied_slots > limit))
-      return;
-
-   // sort by lru
-   qsort((void *) list, n, sizeof(*list), ImageFilePtrCompare);
-
-   // now we free earliest slots on the list... 
-   
-   // we could just leave the cache locked the whole time, but will be slightly smarter
-   if (!locked) stb_mutex_begin(cache_mutex);
-
-   for (i=0; i < n && occupied_slots > MIN_CACHE && (occupied_slots > limit || total > max_cache_bytes); ++i) {
-      if (MAIN_OWNS(list[i]) && list[i]->status != LOAD_unused) {
-         // copy the rest of the data out for later use, then clear the existing data
-         ImageFile p = *list[i];
-         list[i]->bail = 1; // force disk to bail if it gets this -- can't happen?
-         list[i]->filename = NULL;
-         list[i]->filedata = NULL;
-         list[i]->len = 0;
-         list[i]->image = NULL;
-         list[i]->error = NULL;
-         list[i]->status = LOAD_unused;
-
-         // we're done touching this entry (but not done with the data),
-         // so release the mutex
-         if (!locked) stb_mutex_end(cache_mutex);
-
-         // now do the potentially slow stuff
-         o(("MAIN: freeing cache: %s\n", p.filename));
-         stb_sdict_remove(file_cache, p.filename, NULL);
-         --occupied_slots; // occupied slots
-         if (p.status == LOAD_available)
-            total -= p.image->stride * p.image->y;
-         else if (p.status == LOAD_reading_done)
-            total -= p.len;
-         free(p.filename);
-         if (p.filedata) free(p.filedata);
-         if (p.image) imfree(p.image);
-         if (p.error) free(p.error);
-
-         // and now we're ready to return to the loop, so reclaim the mutex
-         if (!locked) stb_mutex_begin(cache_mutex);
-      }
+   NavStats s;
+   long all[STATS_BUCKETS];
+   int i,b, steps=0, shown=0;
+   char when[32];
+   time_t now = time(NULL);
+   FILE *f = fopen(stats_log_name, "a");
+   if (f == NULL) return;
+   stats_snapshot(&s);
+   for (b=0; b < STATS_BUCKETS; ++b)
+      all[b] = 0;
+   for (i=0; i < NAV__num; ++i) {
+      steps += s.steps[i];
+      shown += s.shown[i];
+      for (b=0; b < STATS_BUCKETS; ++b)
+         all[b] += s.ttfp[i][b];
    }
-   if (!locked) stb_mutex_end(cache_mutex);
-   o(("Reduced to %d megabytes\n", total >> 20));
+   strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&now));
+   fprintf(f, "%s steps %d (cached %d, in flight %d, cold %d, skipped %d, errors %d)", when,
+              steps, s.steps[NAV_cached], s.steps[NAV_in_flight], s.steps[NAV_cold], s.skipped, s.errors);
+   fprintf(f, " ttfp p50 <%dms p95 <%dms", stats_percentile(all, 0.50f), stats_percentile(all, 0.95f));
+   for (i=0; i < NAV__num; ++i)
+      fprintf(f, " %s %.0fms", i == NAV_cached ? "cached" : i == NAV_in_flight ? "in-flight" : "cold",
+                 s.shown[i] ? s.ttfp_ms[i] / s.shown[i] : 0);
+   fprintf(f, " | cache hit %d%% evicted %d decoded + %d undecoded | prefetch %d used %d wasted %d",
+              steps ? s.steps[NAV_cached] * 100 / steps : 0, s.evicted_images, s.evicted_data,
+              s.prefetched, s.prefetch_used, s.prefetch_wasted);
+   fprintf(f, " | read %ld files %ldMB | decode %ld p50 <%dms p95 <%dms\n",
+              s.files_read, s.kb_read >> 10, s.decodes,
+              stats_percentile((long *) s.decode, 0.50f), stats_percentile((long *) s.decode, 0.95f));
+   fclose(f);
 }
 
-// keep an index within the 'fileinfo' array
-int wrap(int z)
+void stats_init(void)
 {
-   int n = stb_arr_len(fileinfo);
-   if (z < 0) return z + n;
-   while (z >= n) z = z - n;
-   return z;
+   char *name = getenv("IMV_STATS");
+   if (name && *name) {
+      stats_log_name = name;
+      SetTimer(win, STATS_TIMER, STATS_PERIOD, NULL);
+      atexit(stats_log);
+   }
 }
 
-// consider adding a file-load command to the disk-load command
-// if make_current is true, if it's already loaded, make it current
-// (maybe that should be done in advance() instead?)
-void queue_disk_command(DiskCommand *dc, int which, int make_current)
-{
-   char *filename;
-   volatile ImageFile *z;
-
-   // check if we already have it cached
-   filename = fileinfo[which].filename;
-   z = stb_sdict_get(file_cache, filename);
-   if (z) {
-      // we already have a cache slot for this entry.
-      z->lru = fileinfo[which].lru;
-      if (!MAIN_OWNS(z)) {
-         // it's being loaded/decoded
-         return;
-      }
-
-      // it's waiting to be decoded, so doesn't need queueing
-      if (z->status == LOAD_reading_done)
-         return;
-
-      // it's already loaded
-      if (z->status == LOAD_available) {
-         if (make_current) {
-            o(("Hey look, make_currentdisk request for %s and it's ready to show!\n", z->filename));
-            update_source((ImageFile *) z);
-         }
-         return;
-      }
+// IMV_RECORD names a file to record how they browse to: every step, and
+// every change of zoom or window size, with when it happened. replay.c
+// plays it back against a folder without a window, so changes to what
+// we load and flush can be compared on the same browsing. one line per
+// event, in milliseconds since we started:
+//
+//    imv-nav 1 <monitor width> <monitor height>
+//    <ms> a <dir>                  advance(dir)
+//    <ms> v <w> <h> <display_mode> window size (with frame) and mode
+FILE *record_file;
+double record_start;
 
-      // if it's not inactive and none of the above, it's an error
-      if (z->status != LOAD_inactive) {
-         if (make_current) {
-            set_error(z);
-         }
-         return;
-      }
-      
-      // z->status == LOAD_inactive
-      // "fall through" to after the if, below
+void record_view(void)
+{
+   static int last_w, last_h, last_mode = -1;
+   int w,h;
+   if (record_file == NULL) return;
+   if (qs.w) {
+      // they've asked for a size that's still waiting to be resized to
+      w = qs.w;
+      h = qs.h;
    } else {
-      int i,tried_again=FALSE;
-
-      // didn't already have a cache slot, so find one; we called
-      // flush_cache() before calling this so a slot should be free
-      for (i=0; i < MAX_CACHED_IMAGES; ++i)
-         if (cache[i].status == LOAD_unused)
-            break;
-      if (i == MAX_CACHED_IMAGES) {
-         stb_fatal("Internal logic error: no free cache slots, but flush_cache() should free a few");
-         return;
-      }
-
-      // allocate this slot and fill in the info
-      z = &cache[i];
-      free(z->filename);
-      assert(z->filedata == NULL);
-      z->filename = strdup(filename);
-      z->lru = 0;
-      z->status = LOAD_inactive;
-      stb_sdict_add(file_cache, filename, (void *) z);
+      RECT rect;
+      GetAdjustedWindowRect(win, &rect);
+      w = rect.right - rect.left;
+      h = rect.bottom - rect.top;
    }
+   if (w == last_w && h == last_h && display_mode == last_mode) return;
+   last_w = w;
+   last_h = h;
+   last_mode = display_mode;
+   fprintf(record_file, "%.0f v %d %d %d\n", stats_now() - record_start, w, h, display_mode);
+   fflush(record_file);
+}
 
-   // now, take the z we already had, or just allocated, prep it for loading
-   assert(z->status == LOAD_inactive);
-
-   o(("MAIN: proposing %s\n", z->filename));
-   z->status = LOAD_inactive;     // we still own it for now
-   z->image = NULL;
-   z->bail = 0;
-   z->lru = fileinfo[which].lru;  // pass lru value through
-
-   // and now really put it on the command list
-   dc->files[dc->num_files++] = (ImageFile *) z;
+void record_advance(int dir)
+{
+   if (record_file == NULL) return;
+   fprintf(record_file, "%.0f a %d\n", stats_now() - record_start, dir);
+   fflush(record_file);
 }
 
+void record_init(void)
+{
+   HMONITOR mon = MonitorFromWindow(win, MONITOR_DEFAULTTONEAREST);
+   MONITORINFO minfo = { sizeof(minfo) };
+   char *name = getenv("IMV_RECORD");
+   if (name == NULL || !*name) return;
+   record_file = fopen(name, "w");
+   if (record_file == NULL) return;
+   GetMonitorInfo(mon, &minfo);
+   record_start = stats_now();
+   fprintf(record_file, "imv-nav 1 %d %d\n", (int) (minfo.rcMonitor.right - minfo.rcMonitor.left),
+                                              (int) (minfo.rcMonitor.bottom - minfo.rcMonitor.top));
+   record_view();
+}
 
 // step through the current file list
 void advance(int dir)
 {
-   DiskCommand dc;
-   int i;
-   if (fileinfo == NULL)
-      init_filelist();
-
-   cur_loc = wrap(cur_loc + dir);
-
-   // set adjacent files to previous lru value, so they're 2nd-highest priority
-   fileinfo[wrap(cur_loc-1)].lru = lru_stamp;
-   fileinfo[wrap(cur_loc+1)].lru = lru_stamp;
-   // set this file to new value
-   fileinfo[cur_loc].lru = ++lru_stamp;
-
-   // make sure there's room for new images
-   flush_cache(FALSE);
-
-   // we're mucking with the cache like mad, so grab the mutex; it doubles
-   // as a mutex on dc_shared, so don't release until we're done with dc_shared
-   stb_mutex_begin(cache_mutex);
-   {
-      dc.num_files = 0;
-      queue_disk_command(&dc, cur_loc, 1);           // first thing to load: this file
-      if (dir) {
-         queue_disk_command(&dc, wrap(cur_loc+dir), 0); // second thing to load: the next file (preload)
-         queue_disk_command(&dc, wrap(cur_loc-dir), 0); // last thing to load: the previous file (in case it got skipped when they went fast)
-      }
-      filename = fileinfo[cur_loc].filename;
-
-      if (dc.num_files) {
-         dc_shared = dc;
-         for (i=0; i < dc.num_files; ++i)
-            assert(dc.files[i]->filedata == NULL);
-         // wake up the disk thread if needed
-         stb_sem_release(disk_command_queue);
-      }
+   if (fileinfo == NULL || (filelist_provisional && dir)) {
+      // use the background scan if we started one (waiting if need be)
+      if (!finish_filelist_scan(TRUE) && fileinfo == NULL)
+         init_filelist();
    }
-   stb_mutex_end(cache_mutex);
 
-   // tell disk loader not to bother with older files
-   for (i=0; i < MAX_CACHED_IMAGES; ++i)
-      if (cache[i].lru < lru_stamp-1)
-         cache[i].bail = 1;
+   record_advance(dir);
+   advance_cache(dir);
+   filename = file_path(curfile_path, sizeof(curfile_path), cur_loc);
 
    if (do_show)
       SetTimer(win, 0, (int)(delay_time*1000), NULL);
@@ -1631,26 +1825,358 @@ void stb_from_utf8_multi(stb__wchar *out, char *in, int max_out)
    }
 }
 
-void open_file(void)
+void open_file(void)
+{
+   stb__wchar buf1[1024], buf2[4096];
+   OPENFILENAMEW o = { sizeof(o) };
+
+   stb_from_utf8_multi(buf1, open_filter, sizeof(buf1));
+   o.lpstrFilter = buf1;
+   o.lpstrFile = buf2;
+   buf2[0] = 0;
+   o.nMaxFile = sizeof(buf2);
+   o.Flags = OFN_HIDEREADONLY;
+   if (!GetOpenFileNameW(&o))
+      return;
+   stb_to_utf8(filenamebuffer, buf2, sizeof(filenamebuffer));
+   filename = filenamebuffer;
+   stb_fixpath(filename);
+   stb_splitpath(path_to_file, filename, STB_PATH);
+
+   // start loading it right away from a list of just this file, and read
+   // the rest of the directory in the background
+   abandon_filelist_scan();
+   free_fileinfo();
+   {
+      char **one = NULL;
+      stb_arr_push(one, strdup(filename));
+      install_filelist(one, 0);
+   }
+   filelist_provisional = TRUE;
+   start_filelist_scan();
+   advance(0);
+}
+
+// live folder updates: when files land in the folder (say, from a camera
+// tethering app or a renderer), patch them into the filelist rather than
+// rereading and resorting the whole thing. a thread waits on
+// ReadDirectoryChangesW() and hands each change to the main thread, which
+// binary-searches it into place.
+enum
+{
+   FOLDER_add,
+   FOLDER_remove,
+   FOLDER_modify,
+   FOLDER_remove_other,  // something not an image went away; maybe a directory
+   FOLDER_rescan,        // too much changed to say what; reread it all
+};
+
+typedef struct
+{
+   int action;
+   char path[1];      // full path, allocated longer
+} FolderChange;
+
+stb_ring *folder_queue;       // FolderChange *, watcher -> main
+volatile int folder_overflow; // the watcher couldn't queue a change
+char watch_path[4096];        // what it's watching, with trailing slash
+int watch_recursive;
+HANDLE watch_stop;            // set to tell the watcher to quit
+stb_semaphore watch_done;     // released when it has
+int watching;
+
+static void folder_change(int action, char *path)
+{
+   FolderChange *c = malloc(sizeof(*c) + strlen(path));
+   if (c) {
+      c->action = action;
+      strcpy(c->path, path);
+      if (stb_ring_put(folder_queue, c))
+         return;
+      free(c);
+   }
+   folder_overflow = TRUE;
+}
+
+void *folder_task(void *p)
+{
+   static DWORD buffer[16384]; // 64KB, the most it can return from a network drive
+   stb__wchar wpath[4096], wname[1024];
+   char name[4096], path[8192];
+   char *mask = open_filter + 12;
+   OVERLAPPED ov = { 0 };
+   HANDLE dir, events[2];
+
+   dir = CreateFileW(stb_from_utf8(wpath, watch_path, 4096), FILE_LIST_DIRECTORY,
+                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                     OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+   if (dir == INVALID_HANDLE_VALUE)
+      return NULL;
+   ov.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+   events[0] = ov.hEvent;
+   events[1] = watch_stop;
+
+   for(;;) {
+      FILE_NOTIFY_INFORMATION *f;
+      DWORD n;
+      if (!ReadDirectoryChangesW(dir, buffer, sizeof(buffer), watch_recursive,
+                                 FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME
+                                   | FILE_NOTIFY_CHANGE_LAST_WRITE, NULL, &ov, NULL))
+         break;
+      if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0) {
+         // told to stop; the read has to finish cancelling before
+         // 'buffer' can go to the next watcher
+         CancelIo(dir);
+         GetOverlappedResult(dir, &ov, &n, TRUE);
+         break;
+      }
+      if (!GetOverlappedResult(dir, &ov, &n, FALSE))
+         break;
+
+      if (n == 0) {
+         // more changed than fit in the buffer
+         folder_change(FOLDER_rescan, "");
+      } else {
+         f = (FILE_NOTIFY_INFORMATION *) buffer;
+         for(;;) {
+            int len = stb_min(f->FileNameLength / sizeof(WCHAR), 1023);
+            int image;
+            memcpy(wname, f->FileName, len * sizeof(WCHAR));
+            wname[len] = 0;
+            stb_to_utf8(name, wname, sizeof(name));
+            sprintf(path, "%s%s", watch_path, name);
+            stb_fixpath(path);
+            image = stb_wildmatchi(mask, name);
+
+            switch (f->Action) {
+               case FILE_ACTION_ADDED:
+               case FILE_ACTION_RENAMED_NEW_NAME:
+                  if (image)
+                     folder_change(FOLDER_add, path);
+                  else if (watch_recursive) {
+                     // a directory moved in might be full of images
+                     DWORD attr = GetFileAttributesW(stb_from_utf8(wpath, path, 4096));
+                     if (attr != 0xffffffff && (attr & FILE_ATTRIBUTE_DIRECTORY))
+                        folder_change(FOLDER_rescan, "");
+                  }
+                  break;
+               case FILE_ACTION_REMOVED:
+               case FILE_ACTION_RENAMED_OLD_NAME:
+                  if (image)
+                     folder_change(FOLDER_remove, path);
+                  else if (watch_recursive)
+                     folder_change(FOLDER_remove_other, path);
+                  break;
+               case FILE_ACTION_MODIFIED:
+                  if (image)
+                     folder_change(FOLDER_modify, path);
+                  break;
+            }
+            if (f->NextEntryOffset == 0) break;
+            f = (FILE_NOTIFY_INFORMATION *) ((char *) f + f->NextEntryOffset);
+         }
+      }
+      PostMessage(win, WM_APP_FOLDER, 0, 0);
+   }
+   CloseHandle(ov.hEvent);
+   CloseHandle(dir);
+   return NULL;
+}
+
+void stop_watching(void)
+{
+   void *p;
+   if (!watching) return;
+   SetEvent(watch_stop);
+   stb_sem_waitfor(watch_done);
+   watching = FALSE;
+   // anything it found is for the old folder
+   while (stb_ring_get(folder_queue, &p))
+      free(p);
+   folder_overflow = FALSE;
+}
+
+// watch path_to_file for changes, if we aren't already
+void watch_folder(void)
+{
+   char want[4096];
+   int n;
+   stb_strncpy(want, path_to_file, sizeof(want)-1);
+   n = strlen(want);
+   if (n && want[n-1] != '/')
+      strcpy(want+n, "/");
+   if (watching && watch_recursive == recursive && !strcmp(watch_path, want))
+      return;
+   stop_watching();
+   if (folder_queue == NULL) {
+      folder_queue = stb_ring_new(1024, FALSE, FALSE);
+      watch_stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+      watch_done = stb_sem_new(1);
+   }
+   strcpy(watch_path, want);
+   watch_recursive = recursive;
+   ResetEvent(watch_stop);
+   watching = TRUE;
+   stb_create_thread2(folder_task, NULL, NULL, watch_done);
+}
+
+// binary search for 'path' in the filelist; returns where it is (and sets
+// *found), or where it would go
+static int filelist_find(char *path, int *found)
+{
+   char buf[4096];
+   int lo=0, hi=stb_arr_len(fileinfo);
+   *found = FALSE;
+   while (lo < hi) {
+      int mid = (lo+hi) >> 1;
+      int z = StringCompare(path, file_path(buf, sizeof(buf), mid));
+      if (z == 0) {
+         *found = TRUE;
+         return mid;
+      }
+      if (z < 0) hi = mid;
+      else lo = mid+1;
+   }
+   return lo;
+}
+
+// after inserting (delta=1) or deleting (delta=-1) at k, move the links
+// from cache slots to the entries that moved
+static void relink_cache(int k, int delta)
+{
+   int i, n = stb_arr_len(fileinfo);
+   for (i=0; i < MAX_CACHED_IMAGES; ++i) {
+      volatile ImageFile *z = &cache[i];
+      int j = z->file + delta;
+      if (z->file >= k && j >= 0 && j < n && fileinfo[j].cached == z)
+         z->file = j;
+   }
+}
+
+// what's cached for this file is out of date, so unlink it (so it's
+// reloaded next time) and make it the first thing to flush, unless
+// we're showing it
+static int forget_cached(int k)
+{
+   volatile ImageFile *z = fileinfo[k].cached;
+   if (z == NULL) return FALSE;
+   fileinfo[k].cached = NULL;
+   if (z != source_c)
+      z->lru = 0;
+   return TRUE;
+}
+
+static void filelist_insert(char *path)
+{
+   int found, k = filelist_find(path, &found);
+   char *name = strrchr(path, '/') + 1;
+   int j, len = name - path;
+   uint32 dir = 0xffffffff;
+   if (found) return;
+
+   // its directory is probably a neighbor's
+   for (j=k-1; j <= k; ++j) {
+      if (j >= 0 && j < stb_arr_len(fileinfo)) {
+         char *d = filenames + fileinfo[j].dir;
+         if (!memcmp(d, path, len) && d[len] == 0)
+            dir = fileinfo[j].dir;
+      }
+   }
+   if (dir == 0xffffffff)
+      dir = add_filename(path, len);
+
+   stb_arr_insertn(fileinfo, k, 1);
+   fileinfo[k].dir = dir;
+   fileinfo[k].name = add_filename(name, strlen(name));
+   fileinfo[k].lru = 0;
+   fileinfo[k].cached = NULL;
+   relink_cache(k, 1);
+   if (cur_loc >= k) ++cur_loc;
+}
+
+static void filelist_remove(char *path)
+{
+   int found, k = filelist_find(path, &found);
+   // its name stays in 'filenames' until the next full rescan
+   if (!found || stb_arr_len(fileinfo) == 1) return;
+   forget_cached(k);
+   stb_arr_deleten(fileinfo, k, 1);
+   relink_cache(k, -1);
+   // if it was the current one, stepping forward goes to the one after it
+   if (cur_loc >= k) cur_loc = wrap(cur_loc-1);
+}
+
+// returns TRUE if any file in the list is in directory 'path' (or under it)
+static int filelist_has_dir(char *path)
+{
+   int i, n = strlen(path);
+   uint32 last = 0xffffffff;
+   for (i=0; i < stb_arr_len(fileinfo); ++i) {
+      if (fileinfo[i].dir != last) {
+         char *d = filenames + fileinfo[i].dir;
+         last = fileinfo[i].dir;
+         if (stb_prefixi(d, path) && d[n] == '/')
+            return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+void apply_folder_changes(void)
+{
+   void *p;
+   int rescan = folder_overflow, reload = FALSE;
+   folder_overflow = FALSE;
+   while (stb_ring_get(folder_queue, &p)) {
+      FolderChange *c = p;
+      // while there's no real list yet, the scan that's coming will see it
+      if (fileinfo && !filelist_provisional && !rescan) {
+         int found, k;
+         switch (c->action) {
+            case FOLDER_add:    filelist_insert(c->path); break;
+            case FOLDER_remove: filelist_remove(c->path); break;
+            case FOLDER_modify:
+               k = filelist_find(c->path, &found);
+               if (found && forget_cached(k) && k == cur_loc)
+                  reload = TRUE;
+               break;
+            case FOLDER_remove_other:
+               if (filelist_has_dir(c->path))
+                  rescan = TRUE;
+               break;
+            case FOLDER_rescan:
+               rescan = TRUE;
+               break;
+         }
+      }
+      // a rescan that's running may have read the folder before this
+      // happened, so it gets done again on its list when it's installed
+      if (pending_scan && pending_scan->replace && (c->action == FOLDER_add || c->action == FOLDER_remove))
+         stb_arr_push(pending_scan->changes, c);
+      else
+         free(c);
+   }
+   if (rescan && fileinfo && !filelist_provisional)
+      rescan_filelist(FALSE);
+   else if (reload)
+      // the file we're showing changed, so show the new version
+      advance(0);
+}
+
+// after installing a rescan, catch it up with what the watcher saw while
+// it ran; inserting what's there or removing what isn't does nothing.
+// (modified files were already forgotten, and install_filelist() relinks
+// the newer copy)
+void apply_scan_changes(FileScan *s)
 {
-   stb__wchar buf1[1024], buf2[4096];
-   OPENFILENAMEW o = { sizeof(o) };
-
-   stb_from_utf8_multi(buf1, open_filter, sizeof(buf1));
-   o.lpstrFilter = buf1;
-   o.lpstrFile = buf2;
-   buf2[0] = 0;
-   o.nMaxFile = sizeof(buf2);
-   o.Flags = OFN_HIDEREADONLY;
-   if (!GetOpenFileNameW(&o))
-      return;
-   stb_to_utf8(filenamebuffer, buf2, sizeof(filenamebuffer));
-   filename = filenamebuffer;
-   stb_fixpath(filename);
-   stb_splitpath(path_to_file, filename, STB_PATH);
-   free_fileinfo();
-   init_filelist();
-   advance(0);
+   int i;
+   for (i=0; i < stb_arr_len(s->changes); ++i) {
+      FolderChange *c = s->changes[i];
+      if (c->action == FOLDER_add)
+         filelist_insert(c->path);
+      else
+         filelist_remove(c->path);
+   }
 }
 
 // cleaner casting in C--remember, C macros of the form "foo()" don't
@@ -1730,6 +2256,7 @@ void resize(int step)
    }
 
    display_mode = zoom==0 ? DISPLAY_actual : DISPLAY_current;
+   record_view();
 }
 
 // when mouse button is down, what mode are we in?
@@ -1867,6 +2394,7 @@ void mouse(UINT ev, int x, int y)
 
                // then force the window to resize to the new rect
                enqueue_resize(rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top);
+               record_view();
                break;
             }
          }
@@ -2012,27 +2540,6 @@ static void dialog_clampf(int id, float low, float high)
 
 extern unsigned char *rom_images[]; // preference images
 
-void clear_cache(int had_alpha)
-{
-   int i;
-   stb_mutex_begin(cache_mutex);
-   for (i=0; i < MAX_CACHED_IMAGES; ++i) {
-      if (cache[i].status == LOAD_available) {
-         if (had_alpha ? cache[i].image->had_alpha : TRUE) {
-            stb_sdict_remove(file_cache, cache[i].filename, NULL);
-            free(cache[i].filename);
-            imfree(cache[i].image);
-            cache[i].status = LOAD_unused;
-            cache[i].image = NULL;
-            cache[i].filename = NULL;
-         }
-      }
-   }
-   stb_mutex_end(cache_mutex);
-   free(cur_filename);
-   cur_filename = NULL;
-}
-
 // preferences dialog windows procedure
 BOOL CALLBACK PrefDlgProc(HWND hdlg, UINT imsg, WPARAM wparam, LPARAM lparam)
 {
@@ -2142,12 +2649,11 @@ BOOL CALLBACK PrefDlgProc(HWND hdlg, UINT imsg, WPARAM wparam, LPARAM lparam)
 #endif //USE_STBI
                new_border     = BST_CHECKED == SendMessage(GetDlgItem(hdlg,DIALOG_showborder),BM_GETCHECK,0,0);
 
-               // if alpha_background changed, clear the cache of any images that used it                
+               // if alpha_background changed, just repaint; it's only applied for display
                if (memcmp(alpha_background, curc, 6)) {
-                  clear_cache(1);
-                  // force a reload of the current image
-                  advance(0);
-               } else if (old_cubic != upsample_cubic) {
+                  adjustments_changed();
+               }
+               if (old_cubic != upsample_cubic) {
                   free(cur_filename);
                   cur_filename = NULL;
                   advance(0);
@@ -2157,7 +2663,7 @@ BOOL CALLBACK PrefDlgProc(HWND hdlg, UINT imsg, WPARAM wparam, LPARAM lparam)
                if (new_border != show_frame) {
                   toggle_frame();
                   extra_border = show_frame;
-                  if (cur) frame(cur);
+                  if (cur) { frame(cur); ++cur_version; }
                }
 
                // save the data out to the registry
@@ -2187,32 +2693,6 @@ BOOL CALLBACK PrefDlgProc(HWND hdlg, UINT imsg, WPARAM wparam, LPARAM lparam)
    return FALSE;
 }
 
-#ifdef PERFTEST
-void performance_test(void)
-{
-   int t1,t2;
-   int len,i;
-   uint8 *buffer = stb_file(cur_filename, &len);
-   if (buffer == NULL) return;
-   
-   t1 = timeGetTime();
-
-   for (i=0; i < 50; ++i) {
-      int x,y,n;
-      uint8 *result = imv_decode_from_memory(buffer, len, &x, &y, &n, 4, cur_filename);
-      free(result);
-   }
-
-   t2 = timeGetTime();
-   free(buffer);
-
-   {
-      char buffer[512];
-      sprintf(buffer, "Decode time: %f ms\n", (t2-t1)/50.0);
-      error(buffer);
-   }
-}
-#endif
 
 // missing VK definitions in old compiler
 #ifndef VK_OEM_PLUS
@@ -2240,7 +2720,6 @@ void performance_test(void)
 // or some such to tell you what instance a thread came from. But the
 // HINSTANCE is needed to launch the preferences dialog. Oh well!
 HINSTANCE inst;
-int sharpen=0;
 int dummy_window=1;
 
 int WINAPI MainWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
@@ -2255,58 +2734,38 @@ int WINAPI MainWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
       case WM_APP_LOAD_ERROR:
       case WM_APP_DECODE_ERROR:
-      {
-         // if the load/decode threads get an error, they send this message
-         // to make sure the main thread gets woken up. then we have to decide
-         // whether to show it or not; we do that by scanning the whole cache
-         // to see what the most recently-browsed-and-displayable image is,
-         // and store that in 'best'.
-         int i;
-         // int best_lru=0;
-         volatile ImageFile *best = NULL;
-         for (i=0; i < MAX_CACHED_IMAGES; ++i) {
-            if (cache[i].lru > best_lru) {
-               if (MAIN_OWNS(&cache[i])) {
-                  if (cache[i].status >= LOAD_error_reading) {
-                     best_lru = cache[i].lru;
-                     best = &cache[i];
-                  }
-               }
+      case WM_APP_DECODED:
+         // the load/decode threads send one of these whenever they finish
+         // with a file, to make sure the main thread gets woken up
+         collect_finished(uMsg == WM_APP_DECODED);
+         break;
+
+      case WM_APP_FILELIST:
+         // the background directory scan finished; if nothing's superseded
+         // it, install it and start prefetching. either way (even if it was
+         // abandoned, or advance() already waited for it) it's done with now
+         {
+            FileScan *s = (FileScan *) lParam;
+            if (s == pending_scan && finish_filelist_scan(TRUE)) {
+               if (s->jump)
+                  advance(0);
+               else
+                  prefetch_neighbors();
             }
+            free_filelist_scan(s);
          }
-         // if the most recently-browsed and displayable image is an error, show it
-         if (best && (best->status == LOAD_error_reading || best->status == LOAD_error_decoding))
-            set_error(best);
+         break;
 
+      case WM_APP_FOLDER:
+         // the folder watcher saw something change
+         apply_folder_changes();
          break;
-      }
 
-      case WM_APP_DECODED: {
-         // if the decode thread finishes, it sends us this message. note that
-         // we skip files that had an error; but we use a global variable for 'best_lru'
-         // so we won't ever retreat. I'm not sure how this really interacts with
-         // the above loop, though. maybe they should be combined.
-         int i;
-         ImageFile *best = NULL;
-         for (i=0; i < stb_arr_len(fileinfo); ++i) {
-            if (fileinfo[i].lru > best_lru) {
-               ImageFile *z = stb_sdict_get(file_cache, fileinfo[i].filename);
-               if (z && z->status == LOAD_available) {
-                  assert(z->image != NULL);
-                  best = z;
-                  best_lru = fileinfo[i].lru;
-               }
-            }
-         }
-         if (best) {
-            o(("Post-decode, found a best image, better than any before.\n"));
-            update_source(best);
-         }
-         // since we've decoded a new image, our cache might be too big,
-         // so try flushing it
-         flush_cache(FALSE);
+      case WM_APP_RESIZED:
+         // a background resize finished; the main loop will start the
+         // next one, if there's a request waiting
+         finish_resizes();
          break;
-      }
 
       case WM_MOUSEWHEEL: {
          int zdelta = (short) HIWORD(wParam);
@@ -2345,7 +2804,10 @@ int WINAPI MainWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
       }
 
       case WM_TIMER: {
-         advance(1);
+         if (wParam == STATS_TIMER)
+            stats_log();
+         else
+            advance(1);
          return 0;
       }
 
@@ -2411,17 +2873,17 @@ int WINAPI MainWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                   buffer[strlen(buffer)-1] = 0;
                stb_splitpath(path_to_file, buffer, STB_PATH);
                if (recursive)
-                  init_filelist();
+                  rescan_filelist(FALSE);
                break;
             }
 
             #if ALLOW_RECOLORING
-            case ']': lmax = stb_clamp(lmax-1.0f/32, 0,2); clear_cache(0); advance(0); break;
-            case '[': lmax = stb_clamp(lmax+1.0f/32, 0,2); clear_cache(0); advance(0); break;
-            case '}': lmin = stb_clamp(lmin-1.0f/32, -1,1); clear_cache(0); advance(0); break;
-            case '{': lmin = stb_clamp(lmin+1.0f/32, -1,1); clear_cache(0); advance(0); break;
-            case 'Z': lmin = 0; lmax = 1.0; clear_cache(0); advance(0); break;
-            case 'm': mono = !mono; clear_cache(0); advance(0); break;
+            case ']': lmax = stb_clamp(lmax-1.0f/32, 0,2); adjustments_changed(); break;
+            case '[': lmax = stb_clamp(lmax+1.0f/32, 0,2); adjustments_changed(); break;
+            case '}': lmin = stb_clamp(lmin-1.0f/32, -1,1); adjustments_changed(); break;
+            case '{': lmin = stb_clamp(lmin+1.0f/32, -1,1); adjustments_changed(); break;
+            case 'Z': lmin = 0; lmax = 1.0; adjustments_changed(); break;
+            case 'm': mono = !mono; adjustments_changed(); break;
             #endif
 
             default:
@@ -2459,8 +2921,9 @@ int WINAPI MainWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             case 'T' | MY_CTRL | MY_ALT | MY_SHIFT:
             {
                extern Image *make_mono_thumb(Image *src);
-               while (pending_resize.size.w && !pending_resize.image)
-                  Sleep(10);
+               while (pending_resize.size.w)
+                  if (!finish_resizes())
+                     Sleep(10);
                source = make_mono_thumb(source);
                imfree(source_c->image);
                source_c->image = source;
@@ -2471,7 +2934,7 @@ int WINAPI MainWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
             case 'B' | MY_CTRL:
                extra_border = !extra_border;
-               if (cur) frame(cur);
+               if (cur) { frame(cur); ++cur_version; }
                InvalidateRect(win, NULL, FALSE);
                break;
 
@@ -2482,8 +2945,20 @@ int WINAPI MainWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             case 'B':
                toggle_frame();
                extra_border = show_frame;
-               if (cur) frame(cur);
+               if (cur) { frame(cur); ++cur_version; }
+               break;
+
+            #if USE_TRACE
+            case 'T' | MY_CTRL: {
+               char buffer[MAX_PATH+32], *name = trace_filename(buffer, sizeof(buffer));
+               if (!trace_dump(name)) {
+                  char msg[MAX_PATH+64];
+                  sprintf(msg, "Couldn't write trace to %s", name);
+                  error(msg);
+               }
                break;
+            }
+            #endif
 
             case 'M' | MY_CTRL: {
                FILE *f = fopen("c:/imv(stb)_marked.txt", "a");
@@ -2513,7 +2988,7 @@ int WINAPI MainWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
             case 'R' | MY_CTRL: {
                recursive = !recursive;
-               init_filelist();
+               rescan_filelist(FALSE);
                break;
             }
 
@@ -2534,8 +3009,8 @@ int WINAPI MainWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                n = stb_rand() % stb_arr_len(subdir);
                strcpy(path_to_file, subdir[n]);
                stb_readdir_free(subdir);
-               init_filelist();
-               advance(0);
+               // WM_APP_FILELIST shows its first file
+               rescan_filelist(TRUE);
                break;
             }
 
@@ -2561,12 +3036,6 @@ int WINAPI MainWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                break;
             }
 
-#ifdef PERFTEST
-            case 'D' | MY_CTRL:
-               performance_test();
-               break;
-#endif
-
             case 'P':
             case 'P' | MY_CTRL:
                DialogBox(inst, MAKEINTRESOURCE(IDD_pref), hWnd, PrefDlgProc);
@@ -2619,9 +3088,6 @@ int WINAPI MainWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
    return 1;
 }
 
-// number of threads to use in resizer
-int resize_threads;
-
 // whether 'cur' (the resized image currently displayed) actually comes from 'source'
 int cur_is_current(void)
 {
@@ -2732,6 +3198,11 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
    build_label_font();
 
    srand(time(NULL));
+   spk_lock = stb_mutex_new();
+   scan_lock = stb_mutex_new();
+   #if USE_TRACE
+   trace_init();
+   #endif
 
    if (argc < 2) {
       stb__wchar buf1[1024], buf2[4096];
@@ -2754,7 +3225,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
          stb_to_utf8(path_to_file, argv[1], sizeof(path_to_file));
          init_filelist();
          if (stb_arr_len(fileinfo))
-            filename = fileinfo[0].filename;
+            filename = file_path(curfile_path, sizeof(curfile_path), 0);
          else {
             error("No image files in folder.");
          }
@@ -2767,17 +3238,27 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
    }
    
    // allocate worker threads
-   resize_workers = stb_workq_new(resize_threads, resize_threads * 4);
+   resize_workers = stb_workq_new(resize_threads, STB_THREADQ_DYNAMIC);
+   make_merge = stb_sync_new(); // make_image runs on them too, from the decoder
+   adjust_merge = stb_sync_new(); // ...and display adjustments, from the main thread
+   readdir_merge = stb_sync_new(); // ...and recursive directory scans
+   sort_merge = stb_sync_new(); // ...and sorting the filelist
+   spk_merge = stb_sync_new();  // ...and .spk tiles, from the decoder
 
    // load initial image
    {
       char *why=NULL;
       int len;
-      uint8 *data = stb_file(filename, &len);
+      uint8 *data;
+      trace(TRACE_read_begin, filename, 0);
+      data = stb_file(filename, &len);
+      trace(TRACE_read_end, filename, data ? len : -1);
       if (!data)
          why = "Couldn't open file";
       else {
+         trace(TRACE_decode_begin, filename, 0);
          image_data = imv_decode_from_memory(data, len, &image_x, &image_y, &image_loaded_as_rgb, &image_n, BPP, filename);
+         trace(TRACE_decode_end, filename, image_data != NULL);
          if (image_data == NULL)
             why = imv_failure_reason();
       }
@@ -2798,19 +3279,13 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
    // extract just the path
    stb_splitpath(path_to_file, filename, STB_PATH);
 
-   // allocate semaphores / mutexes
-   cache_mutex  = stb_mutex_new();
-   decode_mutex = stb_mutex_new();
-   decode_queue       = stb_sem_new(1);
-   disk_command_queue = stb_sem_new(1);
+   // allocate the queues between the threads, and start the loader and decoder
+   start_cache();
+   resized_queue = stb_ring_new(64, TRUE, FALSE);  // any resize worker may finish a job
    resize_merge = stb_sync_new();
 
-   // go ahead and start the other tasks
-   stb_create_thread(diskload_task, NULL);
-   stb_create_thread(decode_task, NULL);
-
    // create the source image by converting the image data to BGR,
-   // pre-blending alpha
+   // and premultiplying alpha
    source = malloc(sizeof(*source));
    make_image(source, image_x, image_y, image_data, image_loaded_as_rgb, image_n);
 
@@ -2819,828 +3294,135 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
    cache[0].image = source;
    cache[0].lru = lru_stamp++;
    cache[0].filename = strdup(filename);
-   file_cache = stb_sdict_new(1);
-   stb_sdict_add(file_cache, filename, (void *) &cache[0]);
-   source_c = (ImageFile *) &cache[0];
-
-   {
-      int x,y;
-      int w2 = source->x+FRAME*2, h2 = source->y+FRAME*2;
-      int w,h;
-      int cx,cy;
-      HMONITOR mon;
-      MONITORINFO minfo = { sizeof(minfo) };
-
-      // we have to create a window first to find out the correct monitor
-      // because i can't find any other way to discover this
-      hWnd = CreateWindow(szAppName, displayName,
-                        WS_OVERLAPPEDWINDOW,
-                        CW_USEDEFAULT,CW_USEDEFAULT,1,1,
-                        //x,y, w, h,
-                        NULL, NULL, hInstance, NULL);
-
-      if (!hWnd)
-         return FALSE;
-
-      // get the monitor it's on
-
-      mon = MonitorFromWindow(hWnd, MONITOR_DEFAULTTONEAREST);
-      GetMonitorInfo(mon, &minfo);
-
-      DestroyWindow(hWnd);
-
-      cx = minfo.rcMonitor.right - minfo.rcMonitor.left;
-      cy = minfo.rcMonitor.bottom - minfo.rcMonitor.top;
-
-      //cx = GetSystemMetrics(SM_CXSCREEN);
-      //cy = GetSystemMetrics(SM_CYSCREEN);
-
-      // determine an initial window size, and resize 
-      ideal_window_size(w2,h2, &w,&h, &x,&y, cx,cy);
-
-      // if the size exactly matches, don't resize, just copy
-      if (w == source->x+FRAME*2 && h == source->y+FRAME*2) {
-         display_error[0] = 0;
-         cur = bmp_alloc(image_x + FRAME*2, image_y + FRAME*2);
-         frame(cur);
-         {
-            int j;
-            unsigned char *p = image_data;
-            for (j=0; j < image_y; ++j) {
-               unsigned char *q = cur->pixels + (j+FRAME)*cur->stride + FRAME*BPP;
-               memcpy(q, p, image_x*BPP);
-               p += image_x*BPP;
-            }
-         }
-         w=w;
-      } else {
-         // size is not an exact match
-         queue_resize(w,h, (ImageFile *) &cache[0], TRUE);
-         display_error[0] = 0;
-         cur = pending_resize.image;
-         pending_resize.image = NULL;
-      }
-      cur_filename = strdup(filename);
-      if (!show_frame) {
-         x += FRAME;
-         y += FRAME;
-         w -= FRAME*2;
-         h -= FRAME*2;
-      }
-
-      x += minfo.rcMonitor.left;
-      y += minfo.rcMonitor.top;
-
-      // now create the real window
-      dummy_window = 0;
-      hWnd = CreateWindow(szAppName, displayName,
-                        WS_POPUP,
-                        x,y, w, h,
-                        NULL, NULL, hInstance, NULL);
-   } // open brace for defining some temporary variables
-
-   // display the window
-   ShowWindow(hWnd, nCmdShow);
-   UpdateWindow(hWnd);
-   InvalidateRect(hWnd, NULL, TRUE);
-
-   for(;;) {
-      // if we're not currently resizing, and there's a resize request
-      if (qs.w && pending_resize.size.w == 0) {
-         if (source) {
-            // is the image we're showing the image to resize, and does the size match?
-            if (cur_is_current() && (!cur || (qs.w == cur->x && qs.h >= cur->y) || (qs.h == cur->y && qs.w >= cur->x))) {
-               // no resize necessary, just a variant of the current shape
-               if (!show_frame) qs.x += FRAME, qs.y += FRAME, qs.w -= 2*FRAME, qs.h -= 2*FRAME;
-               MoveWindow(win, qs.x,qs.y,qs.w,qs.h, TRUE);
-               InvalidateRect(win, NULL, FALSE);
-            } else {
-               o(("Enqueueing resize\n"));
-               pending_resize.size = qs;
-               queue_resize(qs.w, qs.h, source_c, FALSE);
-            }
-            //flush = FALSE;
-         }
-         qs.w = 0;
-      }
-
-      // this is currently done in a stupid way--we should have the resizer
-      // post us a message to wake us up, but I wrote this before I had
-      // that infrastructure worked out
-
-      if (!PeekMessage(&msg, NULL, 0,0, PM_NOREMOVE)) {
-         // no messages, so check for a resize completing
-         if (pending_resize.size.w) {
-            // there's a resize pending, so don't block
-            if (!pending_resize.image) {
-               // @TODO: use a message instead!
-               // resize isn't done, so sleep for a bit and try again
-               Sleep(10);
-               continue;
-            } else {
-               // resize is done
-               HDC hdc;
-               o(("Finished resize\n"));
-
-               // reclaim ownership of the image from the resizer
-               pending_resize.image_c->status = LOAD_available;
-
-               // free the current image we're about to write over
-               imfree(cur);
-               cur = pending_resize.image;
-               // pending_resize.filename was strdup()ed, so just take ownership of it
-               cur_filename = pending_resize.filename;
-               pending_resize.filename = NULL;
-
-               // clear error messages
-               display_error[0] = 0;
-
-               if (!show_frame) {
-                  pending_resize.size.x += FRAME;
-                  pending_resize.size.y += FRAME;
-                  pending_resize.size.w -= FRAME*2;
-                  pending_resize.size.h -= FRAME*2;
-               }
-
-               // resize the window
-               SetWindowPos(hWnd,NULL,pending_resize.size.x, pending_resize.size.y, pending_resize.size.w, pending_resize.size.h, SWP_NOZORDER|SWP_NOCOPYBITS);
-               //MoveWindow(hWnd,pending_resize.size.x, pending_resize.size.y, pending_resize.size.w, pending_resize.size.h, FALSE);
-
-               // clear the resize request info
-               barrier();
-               pending_resize.size.w = 0;
-
-               // paint the window              
-               hdc = GetDC(win);
-               display(hWnd, hdc);
-               ReleaseDC(win, hdc);
-
-               // restart from the top
-               continue;
-            }
-         }
-      }
-
-      // we can get rid of this with peek-with-remove, surely?
-      if (!GetMessage(&msg, NULL, 0, 0))
-         return msg.wParam;
-
-      TranslateMessage(&msg);
-      DispatchMessage(&msg);
-   }
-}
-
-/////////////////////////////////////////////////////////////////////////////
-//
-//    Everything from here on down just does image resizing
-//
-
-typedef struct {
-   short i;
-   unsigned char f;
-} SplitPoint;
-
-SplitPoint point_buffer[3200];
-
-typedef struct
-{
-   double temp;
-   Image *dest;
-   Image *src;
-   SplitPoint *p;
-   int j0,j1;
-   float dy;
-} ImageProcess;
-
-#define CACHE_REBLOCK  64
-void *image_resize_work(ImageProcess *q)
-{
-   int i,j,k,n=0;
-   Image *dest = q->dest, *src = q->src;
-   SplitPoint *p = q->p;
-   float y, y0 = q->dy * q->j0;
-   for (k=0; k < dest->x; k += CACHE_REBLOCK) {
-      int k2 = stb_min(k + CACHE_REBLOCK, dest->x);
-      y = y0;
-      for (j=q->j0; j < q->j1; ++j) {
-         int iy;
-         int fy;
-         y = q->dy * j;
-         iy = (int) floor(y);
-         fy = (int) floor(255.9f*(y - iy));
-         if (nearest_neighbor) fy = 0; else
-         if (iy >= src->y-1) {
-            iy = src->y-2;
-            fy = 255;
-         }
-         {
-            unsigned char *d = &dest->pixels[j*dest->stride + k*BPP];
-            unsigned char *s0 = src->pixels + src->stride*iy;
-            unsigned char *s1 = s0 + src->stride;
-            for (i=k; i < k2; ++i) {
-               s0 += p[i].i;
-               s1 += p[i].i;
-               {
-                  unsigned char x = p[i].f;
-
-                  #if BPP == 4
-                  uint32 c00,c01,c10,c11,rb0,rb1,rb00,rb01,rb10,rb11,rb,g;
-                  if (nearest_neighbor) x = 0;
-                  c00 = *(uint32 *) s0;
-                  c01 = *(uint32 *) (s0+4);
-                  c10 = *(uint32 *) s1;
-                  c11 = *(uint32 *) (s1+4);
-
-                  rb00 = c00 & 0xff00ff;
-                  rb01 = c01 & 0xff00ff;
-                  rb0 = (rb00 + (((rb01 - rb00) * x) >> 8)) & 0xff00ff;
-                  rb10 = c10 & 0xff00ff;
-                  rb11 = c11 & 0xff00ff;
-                  rb1 = (rb10 + (((rb11 - rb10) * x) >> 8)) & 0xff00ff;
-                  rb = (rb0 + (((rb1 - rb0) * fy) >> 8)) & 0xff00ff;
-
-                  rb00 = c00 & 0xff00;
-                  rb01 = c01 & 0xff00;
-                  rb0 = (rb00 + (((rb01 - rb00) * x) >> 8)) & 0xff00;
-                  rb10 = c10 & 0xff00;
-                  rb11 = c11 & 0xff00;
-                  rb1 = (rb10 + (((rb11 - rb10) * x) >> 8)) & 0xff00;
-                  g = (rb0 + (((rb1 - rb0) * fy) >> 8)) & 0xff00;
-
-                  *(uint32 *)d = rb + g;
-                  #else
-                  unsigned char v00,v01,v10,v11;
-                  int v0,v1;
-
-                  if (nearest_neighbor) x = 0;
-                  v00 = s0[0]; v01 = s0[BPP+0]; v10 = s1[0]; v11 = s1[BPP+0];
-                  v0 = (v00<<8) + x * (v01 - v00);
-                  v1 = (v10<<8) + x * (v11 - v10);
-                  v0 = (v0<<8) + fy * (v1 - v0);
-                  d[0] = v0 >> 16;
-
-                  v00 = s0[1]; v01 = s0[BPP+1]; v10 = s1[1]; v11 = s1[BPP+1];
-                  v0 = (v00<<8) + x * (v01 - v00);
-                  v1 = (v10<<8) + x * (v11 - v10);
-                  v0 = (v0<<8) + fy * (v1 - v0);
-                  d[1] = v0 >> 16;
-
-                  v00 = s0[2]; v01 = s0[BPP+2]; v10 = s1[2]; v11 = s1[BPP+2];
-                  v0 = (v00<<8) + x * (v01 - v00);
-                  v1 = (v10<<8) + x * (v11 - v10);
-                  v0 = (v0<<8) + fy * (v1 - v0);
-                  d[2] = v0 >> 16;
-                  #endif
-
-                  d += BPP;
-               }
-            }
-         }
-         y += q->dy;
-      }
-   }
-   return NULL;
-}
-
-void image_resize_bilinear(Image *dest, Image *src)
-{
-   ImageProcess proc_buffer[16], *q = stb_temp(proc_buffer, resize_threads * sizeof(*q));
-   SplitPoint *p = stb_temp(point_buffer, dest->x * sizeof(*p));
-   int i,j0,j1,k;
-   float x,dx,dy;
-   assert(src->frame == 0);
-   dx = (float) (src->x - 1) / (dest->x - 1);
-   dy = (float) (src->y - 1) / (dest->y - 1);
-   x=0;
-   for (i=0; i < dest->x; ++i) {
-      p[i].i = (int) floor(x);
-      p[i].f = (int) floor(255.9f*(x - p[i].i));
-      if (p[i].i >= src->x-1) {
-         p[i].i = src->x-2;
-         p[i].f = 255;
-      }
-      x += dx;
-      p[i].i *= BPP;
-   }
-   for (k=0; k < dest->x; k += CACHE_REBLOCK) {
-      int k2 = stb_min(k+CACHE_REBLOCK, dest->x);
-      for (i=k2-1; i > k; --i) {
-         p[i].i -= p[i-1].i;
-      }
-   }
-   j0 = 0;
-   for (i=0; i < resize_threads; ++i) {
-      j1 = dest->y * (i+1) / resize_threads;
-      q[i].dest = dest;
-      q[i].src = src;
-      q[i].j0 = j0;
-      q[i].j1 = j1;
-      q[i].dy = dy;
-      q[i].p = p;
-      j1 = j0;
-   }
-
-   if (resize_threads == 1) {
-      image_resize_work(q);
-   } else {
-      stb_sync_set_target(resize_merge, resize_threads);
-      for (i=1; i < resize_threads; ++i)
-         stb_workq_reach(resize_workers, image_resize_work, q+i, NULL, resize_merge);
-      image_resize_work(q);
-      stb_sync_reach_and_wait(resize_merge);
-   }
-
-   stb_tempfree(point_buffer, p);
-   stb_tempfree(proc_buffer , q);
-}
-
-#if BPP==4
-//
-
-#undef R
-#undef G
-#undef B
-#undef A
-#undef RGB
-#undef RGBA
-
-#define R(x) ( (x)        & 0xff)
-#define G(x) (((x) >>  8) & 0xff)
-#define B(x) (((x) >> 16) & 0xff)
-#define A(x) (((x) >> 24) & 0xff)
-#define RGBA(r,g,b,a) (((a) << 24) + ((b) << 16) + ((g) << 8) + (r))
-#define RGB(r,g,b)    RGBA(r,g,b,0)
-
-typedef uint32 Color;
-
-// lerp() is just blend() that also "blends" alpha
-// put a/256 of src over dest, including alpha
-;// again, cannot be used for a=256
-static Color lerp(Color dest, Color src, uint8 a)
-{
-   int rb_src  = src  & 0xff00ff;
-   int rb_dest = dest & 0xff00ff;
-   int rb      = rb_dest + ((rb_src - rb_dest) * a >> 8);
-   int ga_src  = (src  & 0xff00ff00) >> 8;
-   int ga_dest = (dest & 0xff00ff00) >> 8;
-   int ga      = (ga_dest<<8) + (ga_src - ga_dest) * a;
-   return (rb & 0xff00ff) + (ga & 0xff00ff00);
-}
-
-#if 1
-
-
-#define SSE __declspec(align(16))
-#define MMX __declspec(align(8))
-
-//   out = a * t^3 + b*t^2 + c*t + d
-//   out = (a*t+b)*t^2 + (c*t+d)*1
-
-MMX int16 three[4] = { 3,3,3,3 };
-MMX int16 round[4] = { 128,128,128,128 };
-
-static void cubic_interpolate_span(uint32 *dest,
-                                   uint32 *x0, uint32 *x1, uint32 *x2, uint32 *x3,
-                                   int lerp8, int step_dest, int step_src, int len)
-{
-   if (len <= 0) return;
-   __asm {
-      // these save/restores shouldn't be necessary... but they seem to be needed
-      // in VC6 opt builds; either a buggy compiler, or I'm doing something wrong
-      push eax
-      push ebx
-      push ecx
-      push edx
-      push esi
-      push edi
-      mov   edi,dest
-      mov   eax,x0
-      mov   ebx,x1
-      mov   ecx,x2
-      mov   edx,x3
-      pxor  mm0,mm0
-      movd  mm7,lerp8
-      mov   esi,len
-      punpcklbw mm7,mm7   // 0,0,0,0,0,0,lerp,lerp
-      punpcklbw mm7,mm7   // 0,0,0,0,lerp,lerp,lerp,lerp
-      punpcklbw mm7,mm7   // 8xlerp. (This meakes each unsigned lerp value 0..15)
-      psrlw     mm7,1     // slide away from the sign bit; 1.15 lerp
-      // clearer way to thinkg of this: mm7 contains t/2
-   } looptop: __asm {
-
-      movd  mm1,[eax]
-      movd  mm4,[edx]
-      movd  mm2,[ebx]
-      movd  mm3,[ecx]
-      add       eax,step_src
-      add       ebx,step_src
-      punpcklbw mm1,mm0   // mm1 = x0
-      punpcklbw mm4,mm0   // mm4 = x3
-      punpcklbw mm2,mm0   // mm2 = x1
-      punpcklbw mm3,mm0   // mm3 = x2
-
-      // extra precision
-      psllw     mm1,2
-      psllw     mm2,2
-      psllw     mm3,2
-      psllw     mm4,2
-
-      add       ecx,step_src
-      add       edx,step_src
-#if 1
-      // catmull-rom cubic
-      // "scheduled" to try to spread stuff out early
-      // also the final shift by two has been optimized up earlier
-      // (which means we really only get 6-7 good bits)
-      psubw     mm4,mm1   // mm4 = x3-x0
-      movq      mm5,mm2   // mm5 = x1
-      movq      mm6,mm3   // mm6 = x2
-      psubw     mm5,mm3   // mm5 = x1-x2
-      paddw     mm3,mm1   // mm3 = x0+x2
-      psubw     mm6,mm1   // mm6 = x2-x0 = c
-      psubw     mm3,mm2   // mm3 = x0+x2-d/2
-      pmullw    mm5,three // mm5 = 3*(x1-x2)
-      psubw     mm3,mm2   // mm3 = x0+x2-d
-      pmulhw    mm6,mm7   // mm6 = c*t/2
-      paddw     mm5,mm4   // mm5 = a
-      psubw     mm3,mm5   // mm3 = b
-
-      psllw     mm5,2     // mm5 = a*4
-      psllw     mm3,1     // mm3 = b*2
-      pmulhw    mm5,mm7   // mm5 = a*t*2
-      paddw     mm6,mm2   // mm6 = (c*t+d)/2
-      paddw     mm5,mm3   // mm5 = (a*t + b)*2
-      pmulhw    mm5,mm7   // mm5 = a*t^2+b*t
-      pmulhw    mm5,mm7   // mm5 = (a*t^3+b*t^2)/2
-      paddw     mm5,mm6
-      psraw     mm5,2
-      packuswb  mm5,mm5
-      movd      [edi],mm5
-#else
-      // unknown spline type from: http://local.wasp.uwa.edu.au/~pbourke/other/interpolation/
-      psubw     mm4,mm3   // mm4 = x3-x2
-      psubw     mm4,mm1   // mm4 = x3-x2-x0
-      paddw     mm4,mm2   // mm4 = a0 = x3-x2-x0+x1
-      psubw     mm3,mm1   // mm3 = a2 = x2-x0
-      psubw     mm1,mm2   // mm1 = x0-x1
-      psubw     mm1,mm4   // mm1 = a1 = x0-x1-a0
-      // mm2 = a3 = y1
-      psllw     mm4,3
-      pmulhw    mm4,mm7
-      pmulhw    mm4,mm7
-      pmulhw    mm4,mm7
-      psllw     mm1,2
-      pmulhw    mm1,mm7
-      pmulhw    mm1,mm7
-      psllw     mm3,1
-      pmulhw    mm3,mm7
-      paddw     mm1,mm2
-      paddw     mm1,mm3
-      paddw     mm1,mm4
-      packuswb  mm1,mm1
-      movd      [edi],mm1
-#endif
-      add       edi,step_dest
-      dec       esi
-      jnz       looptop
-      emms
-      pop edi
-      pop esi
-      pop edx
-      pop ecx
-      pop ebx
-      pop eax
-   }
-}
-
-#else
-static int cubic(int x0, int x1, int x2, int x3, int lerp8)
-{
-   int a = 3*(x1-x2) + (x3-x0);
-   int d = x1+x1;
-   int c = x2 - x0;
-   int b = -a-d + x0+x2;
-
-   int res = a * lerp8 + (b << 8);
-   res = (res * lerp8);
-   res = ((res >> 16) + c) * lerp8;
-   res = ((res >> 8) + d) >> 1;
-   if (res < 0) res = 0; else if (res > 255) res = 255;
-   return res;
-}
-
-static void cubic_interpolate_span(Color *dest, Color *x0, Color *x1, Color *x2, Color *x3, int lerp8, int step_dest, int step_src, int len)
-{
-   int i;
-   for (i=0; i < len; ++i) {
-      int r,g,b,a;
-      r = cubic(R(*x0),R(*x1),R(*x2),R(*x3),lerp8);
-      g = cubic(G(*x0),G(*x1),G(*x2),G(*x3),lerp8);
-      b = cubic(B(*x0),B(*x1),B(*x2),B(*x3),lerp8);
-      a = cubic(A(*x0),A(*x1),A(*x2),A(*x3),lerp8);
-      *dest = RGBA(r,g,b,a);
-      x0 += step_src>>2;
-      x1 += step_src>>2;
-      x2 += step_src>>2;
-      x3 += step_src>>2;
-      dest += step_dest>>2;
-   }
-}
-#endif
+   source_c = (ImageFile *) &cache[0];
 
-#define PLUS(x,y)   ((uint32 *) ((uint8 *) (x) + (y)))
+   {
+      int x,y;
+      int w2 = source->x+FRAME*2, h2 = source->y+FRAME*2;
+      int w,h;
+      int cx,cy;
+      HMONITOR mon;
+      MONITORINFO minfo = { sizeof(minfo) };
 
-struct
-{
-   Image *src;
-   Image *out;
-   int out_len;
-   int delta;
-} cubic_work;
-
-#define CUBIC_BLOCK  32
-void * cubic_interp_1d_x_work(int n)
-{
-   int out_w = cubic_work.out_len;
-   int x,dx,i,j,k,k_start, k_end;
-   Image *out = cubic_work.out;
-   Image *src = cubic_work.src;
-   dx = cubic_work.delta;
-   k_start = out->y *   n   / resize_threads;
-   k_end   = out->y * (n+1) / resize_threads;
-   for (k=k_start; k < k_end; k += CUBIC_BLOCK) {
-      int k2 = stb_min(k+CUBIC_BLOCK, k_end);
-      x = 0;
-      for (i=0; i < out_w; ++i) {
-         uint32 *data = (uint32 *) (src->pixels + k*src->stride);
-         uint32 *dest = (uint32 *) (out->pixels + k*out->stride) + i;
-         int xp = (x >> 16);
-         int xw = (x >> 8) & 255;
-         if (xp == 0) {
-            cubic_interpolate_span(dest, data+xp,data+xp,data+xp+1,data+xp+2,xw,out->stride,src->stride,k2-k);
-         } else if (xp >= src->x - 2) {
-            if (xp == src->x-1) {
-               for (j=k; j < k2; ++j) {
-                  dest[0] = data[xp];
-                  data = PLUS(data, src->stride);
-                  dest = PLUS(dest , out->stride);
-               }
-            } else {
-               cubic_interpolate_span(dest, data+xp-1,data+xp,data+xp+1,data+xp+1,xw,out->stride,src->stride,k2-k);
-            }
-         } else {
-            cubic_interpolate_span(dest, data+xp-1,data+xp,data+xp+1,data+xp+2,xw,out->stride,src->stride,k2-k);
-         }
-         x += dx;
-      }
-   }
-   return NULL;
-}
+      // we have to create a window first to find out the correct monitor
+      // because i can't find any other way to discover this
+      hWnd = CreateWindow(szAppName, displayName,
+                        WS_OVERLAPPEDWINDOW,
+                        CW_USEDEFAULT,CW_USEDEFAULT,1,1,
+                        //x,y, w, h,
+                        NULL, NULL, hInstance, NULL);
 
-Image *cubic_interp_1d_x(Image *src, int out_w)
-{
-   int i;
-   cubic_work.out = bmp_alloc(out_w, src->y);
-   cubic_work.delta = (src->x-1)*65536 / (out_w-1);
-   cubic_work.src = src;
-   cubic_work.out_len = out_w;
-   barrier();
+      if (!hWnd)
+         return FALSE;
 
-   if (resize_threads == 1) {
-      cubic_interp_1d_x_work(0);
-   } else {
-      stb_sync_set_target(resize_merge, resize_threads);
-      for (i=1; i < resize_threads; ++i)
-         stb_workq_reach(resize_workers, (stb_thread_func) cubic_interp_1d_x_work, (void *) i, NULL, resize_merge);
-      cubic_interp_1d_x_work(0);
-      stb_sync_reach_and_wait(resize_merge);
-   }
-   return cubic_work.out;
-}
+      // get the monitor it's on
 
-Image *cubic_interp_1d_y_work(int n)
-{
-   int y,dy,j,j_end;
-   int out_h = cubic_work.out_len;
-   Image *src = cubic_work.src;
-   Image *out = cubic_work.out;
-   dy = cubic_work.delta;
-
-   j = out_h * n / resize_threads;
-   j_end = out_h * (n+1) / resize_threads;
-   y = j * dy;
-   for (; j < j_end; ++j,y+=dy) {
-      uint32 *dest  = (uint32 *) (out->pixels + j*out->stride);
-      int yp = (y >> 16);
-      uint8 yw = (y >> 8);
-      uint32 *data1 = (uint32 *) (src->pixels + yp*src->stride);
-      uint32 *data2 = PLUS(data1,src->stride);
-      uint32 *data0 = (yp > 0) ? PLUS(data1, - src->stride) : data1;
-      uint32 *data3 = (yp < src->y-2) ? PLUS(data2, src->stride) : data2;
-      cubic_interpolate_span(dest, data0, data1, data2, data3, yw, 4,4,out->x);
-   }
-   return NULL;
-}
+      mon = MonitorFromWindow(hWnd, MONITOR_DEFAULTTONEAREST);
+      GetMonitorInfo(mon, &minfo);
 
-Image *cubic_interp_1d_y(Image *src, int out_h)
-{
-   int i;
-   cubic_work.src = src;
-   cubic_work.out = bmp_alloc(src->x, out_h);
-   cubic_work.delta = ((src->y-1)*65536-1) / (out_h-1);
-   cubic_work.out_len = out_h;
+      DestroyWindow(hWnd);
 
-   if (resize_threads == 1) {
-      cubic_interp_1d_y_work(0);
-   } else {
-      barrier();
-      stb_sync_set_target(resize_merge, resize_threads);
-      for (i=1; i < resize_threads; ++i)
-         stb_workq_reach(resize_workers, (stb_thread_func) cubic_interp_1d_y_work, (void *) i, NULL, resize_merge);
-      cubic_interp_1d_y_work(0);
-      stb_sync_reach_and_wait(resize_merge);
-   }
-   return cubic_work.out;
-}
+      cx = minfo.rcMonitor.right - minfo.rcMonitor.left;
+      cy = minfo.rcMonitor.bottom - minfo.rcMonitor.top;
 
-// downsampling
-Image *downsample_half(Image *src)
-{
-   int i,j, w,h;
-   Image *res;
-
-   w = src->x>>1;
-   h = src->y>>1;
-
-   res = bmp_alloc(w,h);
-   for (j=0; j < h; j += 1) {
-      Color *src0 = (uint32*)(src->pixels + 2*j * src->stride);
-      Color *src1 = PLUS(src0, src->stride);
-      for (i=0; i < w; i += 1) {
-         Color *dest = (uint32*)(res->pixels + j * res->stride + i*BPP);
-         // this will cause quantization of flat-colored regions, thus can
-         // cause banding in very slow gradients
-         *dest = ((src0[0] >> 2) & 0x3f3f3f3f) +
-                 ((src0[1] >> 2) & 0x3f3f3f3f) +
-                 ((src1[0] >> 2) & 0x3f3f3f3f) +
-                 ((src1[1] >> 2) & 0x3f3f3f3f);
-         src0 += 2;
-         src1 += 2;
-      }
-   }
+      //cx = GetSystemMetrics(SM_CXSCREEN);
+      //cy = GetSystemMetrics(SM_CYSCREEN);
 
-   return res;
-}
+      // determine an initial window size, and resize 
+      ideal_window_size(w2,h2, &w,&h, &x,&y, cx,cy);
 
-Image *downsample_two_thirds(Image *src)
-{
-   int i,j, w,h;
-   Image *res;
-
-   w = src->x/3 * 2;
-   h = src->y/3 * 2;
-
-   res = bmp_alloc(w, h);
-   for (j=0; j+1 < h; j += 2) {
-      Color *src0 = (uint32*)(src->pixels + 3*(j>>1) * src->stride);
-      Color *src1 = PLUS(src0, src->stride);
-      Color *src2 = PLUS(src1, src->stride);
-      // use (2/3,1/3) and (1/3,2/3), which amounts to:
-      //    A B C     W  X
-      //    D E F  -> 
-      //    G H I     Y  Z
-
-      // W = A*4/9 + B * 2/9 + D * 2/9 + E * 1/9
-      // for speed, approximate as A*3/8 + B*2/8 + D*2/8 + E*1/8
-      for (i=0; i+1 < w; i += 2) {
-         Color *dest = (uint32*)(res->pixels + j * res->stride + i*BPP);
-         dest[0] = ((src0[0] >> 1) & 0x7f7f7f7f) - ((src0[0] >> 3) & 0x1f1f1f1f)
-                 + ((src0[1] >> 2) & 0x3f3f3f3f) + ((src1[0] >> 2) & 0x3f3f3f3f)
-                 + ((src1[1] >> 3) & 0x1f1f1f1f);
-         dest[1] = ((src0[2] >> 1) & 0x7f7f7f7f) - ((src0[2] >> 3) & 0x1f1f1f1f)
-                 + ((src0[1] >> 2) & 0x3f3f3f3f) + ((src1[2] >> 2) & 0x3f3f3f3f)
-                 + ((src1[1] >> 3) & 0x1f1f1f1f);
-         dest = PLUS(dest,res->stride);
-         dest[0] = ((src2[0] >> 1) & 0x7f7f7f7f) - ((src2[0] >> 3) & 0x1f1f1f1f)
-                 + ((src2[1] >> 2) & 0x3f3f3f3f) + ((src1[0] >> 2) & 0x3f3f3f3f)
-                 + ((src1[1] >> 3) & 0x1f1f1f1f);
-         dest[1] = ((src2[2] >> 1) & 0x7f7f7f7f) - ((src2[2] >> 3) & 0x1f1f1f1f)
-                 + ((src2[1] >> 2) & 0x3f3f3f3f) + ((src1[2] >> 2) & 0x3f3f3f3f)
-                 + ((src1[1] >> 3) & 0x1f1f1f1f);
-         src0 += 3;
-         src1 += 3;
-         src2 += 3;         
+      // if the size exactly matches, don't resize, just copy
+      if (w == source->x+FRAME*2 && h == source->y+FRAME*2) {
+         display_error[0] = 0;
+         cur = bmp_alloc(image_x + FRAME*2, image_y + FRAME*2);
+         frame(cur);
+         cur->had_alpha = source->had_alpha;
+         {
+            int j;
+            unsigned char *p = image_data;
+            for (j=0; j < image_y; ++j) {
+               unsigned char *q = cur->pixels + (j+FRAME)*cur->stride + FRAME*BPP;
+               memcpy(q, p, image_x*BPP);
+               p += image_x*BPP;
+            }
+         }
+         w=w;
+      } else {
+         // size is not an exact match
+         queue_resize(w,h, (ImageFile *) &cache[0], TRUE);
+         display_error[0] = 0;
+         cur = pending_resize.image;
+         pending_resize.image = NULL;
+      }
+      cur_filename = strdup(filename);
+      if (!show_frame) {
+         x += FRAME;
+         y += FRAME;
+         w -= FRAME*2;
+         h -= FRAME*2;
       }
-   }
 
-   return res;
-}
+      x += minfo.rcMonitor.left;
+      y += minfo.rcMonitor.top;
 
-void do_sharpen(uint8 *data, int stride, int x, int y)
-{
-   int i,j,k;
-   uint8 prev[3200*4];
-   if (x > 3200) return;
-   memcpy(prev, data, x*BPP);
-   for (j=1; j < y-1; ++j) {
-      uint8 *next = data + stride*(j+1);
-      unsigned char left[4];
-      memcpy(left, data+stride*j+BPP, BPP);
-      for (i=1; i < x-1; ++i) {
-         unsigned char temp[4];
-         memcpy(temp, data+stride*j+i*BPP,BPP);
-         for (k=0; k < BPP; ++k) {
-            int v = data[stride*j+i*BPP+k] * 16;
-            v -= (prev[i*BPP+k-4] + prev[i*BPP+k] + prev[i*BPP+k+4]);
-            v -= (next[i*BPP+k-4] + next[i*BPP+k] + next[i*BPP+k+4]);
-            v -= (left[k] + data[stride*j+i*BPP+4+k]);
-            v >>= 3;
-            if (v < 0) v = 0; else if (v > 255) v = 255;
-            data[stride*j+i*BPP+k] = v;
-         }
-         // now temp becomes the new left
-         // but first:
-         memcpy(prev+(i-1)*BPP, left, BPP);
-         memcpy(left, temp, BPP);
-      }
-   }
-}
+      // now create the real window
+      dummy_window = 0;
+      hWnd = CreateWindow(szAppName, displayName,
+                        WS_POPUP,
+                        x,y, w, h,
+                        NULL, NULL, hInstance, NULL);
+   } // open brace for defining some temporary variables
 
-Image *grScaleBitmap(Image *src, int gx, int gy, Image *dest)
-{
-   Image *to_free, *res;
-   int upsample=FALSE;
-   to_free = NULL;
+   // display the window
+   ShowWindow(hWnd, nCmdShow);
+   UpdateWindow(hWnd);
+   InvalidateRect(hWnd, NULL, TRUE);
 
-   // check if we're scaling up
-   if (gx > src->x || gy > src->y)  {
-      upsample = TRUE;
-   } else {
-      // current biggest problem perf-wise is on scaling down, we don't
-      // use threads
-
-      // maybe should do something smarter here, like find the
-      // nearest box size, instead of repetitive powers of two
-      while (gx <= (src->x >> 1) && gy <= (src->y >> 1)) {
-         src = downsample_half(src);
-         if (to_free) imfree(to_free);
-         to_free = src;
-      }
+   // now that there's a window for it to report to, read the directory
+   start_filelist_scan();
+   stats_init();
+   record_init();
 
-      if (gx < src->x * 0.666666f && gy < src->y * 0.666666f) {
-         src = downsample_two_thirds(src);
-         if (to_free) imfree(to_free);
-         to_free = src;
+   for(;;) {
+      // if they've moved on to another image or another size while we're
+      // still resizing, the result will be stale when it's done; give up
+      // on it so the newest request gets resized as soon as possible.
+      // a new image needn't have asked for a resize (it might be shown
+      // 1:1, or be an error), so don't wait for one to notice
+      if (pending_resize.size.w && !resize_abandon) {
+         if (pending_resize.image_c != source_c || (qs.w && memcmp(&qs, &pending_resize.size, sizeof(qs)))) {
+            trace(TRACE_bail, pending_resize.image_c->filename, TRACE_resize_begin);
+            resize_abandon = TRUE;
+         }
       }
-   }
 
-   if (gx == src->x && gy == src->y) {
-      if (to_free)
-         res = src;
-      else {
-         res = bmp_alloc(src->x, src->y);
-         memcpy(res->pixels, src->pixels, res->y * res->stride);
-         return res;
+      // if we're not currently resizing, and there's a resize request
+      if (qs.w && pending_resize.size.w == 0) {
+         if (source) {
+            // is the image we're showing the image to resize, and does the size match?
+            if (cur_is_current() && (!cur || (qs.w == cur->x && qs.h >= cur->y) || (qs.h == cur->y && qs.w >= cur->x))) {
+               // no resize necessary, just a variant of the current shape
+               if (!show_frame) qs.x += FRAME, qs.y += FRAME, qs.w -= 2*FRAME, qs.h -= 2*FRAME;
+               MoveWindow(win, qs.x,qs.y,qs.w,qs.h, TRUE);
+               InvalidateRect(win, NULL, FALSE);
+            } else {
+               pending_resize.size = qs;
+               queue_resize(qs.w, qs.h, source_c, FALSE);
+            }
+            //flush = FALSE;
+         }
+         qs.w = 0;
       }
-   } else if (upsample ? upsample_cubic : downsample_cubic) {
-      res = cubic_interp_1d_y(src, gy);
-      if (to_free) imfree(to_free);
-      to_free = res;
-      res = cubic_interp_1d_x(res, gx);
-      imfree(to_free);
-    } else {
-      #if 1
-      image_resize_bilinear(dest, src);
-      if (to_free) imfree(to_free);
-      res = NULL;
-      #else
-      res = grScaleBitmapX(src, gx);
-      if (to_free) imfree(to_free);
-      to_free = res;
-      res = grScaleBitmapY(res, gy);
-      imfree(to_free);
-      #endif
-   }
-   if (upsample && sharpen)
-      do_sharpen(res->pixels, res->stride, res->x, res->y);
-   return res;
-}
-#endif // BPP==4
 
-void image_resize(Image *dest, Image *src)
-{
-#if BPP==3
-   image_resize_bilinear(dest, src);
-#else
-   int j;
-   Image *temp;
-   temp = grScaleBitmap(src, dest->x, dest->y, dest);
-   if (temp) {
-      for (j=0; j < dest->y; ++j)
-         memcpy(dest->pixels + j*dest->stride, temp->pixels + j*temp->stride, BPP*dest->x);
-      imfree(temp);
+      // the resizer posts WM_APP_RESIZED when it's done, so we can
+      // just block here; any message brings us back to the top to
+      // start the next resize
+      if (!GetMessage(&msg, NULL, 0, 0))
+         return msg.wParam;
+
+      TranslateMessage(&msg);
+      DispatchMessage(&msg);
    }
-#endif
 }
 
 char imv_failure_buffer[1024];
@@ -4024,6 +3806,364 @@ uint8 *LoadImageWithFreeImage(FIMEMORY *fi, int *x, int *y, int *n, int n_req)
 } 
 #endif
 
+#if USE_STBI
+// .spk delta images: a base image plus the pixels that differ from it,
+// e.g. for a render sequence where most of each frame is the same.
+//
+// v1 ('s' or 'x') is a flat list of runs:
+//    [s|x] "PIC-delta-image\0"
+//    int namelen, char name[namelen]   base image, relative to the .spk
+//    int x, y, c                       size, and components per run pixel
+//    { int start, count; uint8 pixels[count*c]; } ...
+//
+// v2 ('2') splits the image into tiles and only stores the ones that
+// changed, each compressed on its own, so they can be decoded in parallel:
+//    '2' "PIC-delta-image\0"
+//    int namelen, char name[namelen]   base image; can be another .spk
+//    int x, y, c                       as above
+//    int tile_w, tile_h                at most SPK_MAX_TILE
+//    int num_tiles                     number of tiles stored
+//    uint32 crc                        stb_crc32() of the index
+//    { int tile; uint32 offset, length; } index[num_tiles]
+//       tile is y*tiles_across+x, in increasing order; offset (from the
+//       start of the file) and length locate its stb_compress()ed data
+// each tile's data is its pixels (c components, clipped to the image)
+// XORed with the base, so unchanged pixels are zero and cost almost
+// nothing compressed. stb_decompress() checks each tile's adler32.
+//
+// a sequence of them usually shares one base, so we keep the last few
+// decoded bases around instead of decoding the base for every frame. the
+// cached pixels are never written; each delta gets its own copy. a base
+// that's a delta itself is only good while every file under it is the
+// same, so we keep the whole chain's timestamps, not just its own. the
+// bases count against max_cache_bytes through decoder_cache_bytes, but
+// flush_cache() can't free them; there are only SPK_BASES of them
+#define SPK_BASES      2
+#define SPK_MAX_TILE   256
+#define SPK_MAX_CHAIN  16   // deltas of deltas of...; also stops loops
+
+typedef struct
+{
+   char **path;      // stb_arr: a base, then its base, and so on down to a plain image
+   FILETIME *time;   // stb_arr: the timestamp each had when we decoded it
+} SpkChain;
+
+static struct
+{
+   SpkChain chain;   // chain.path[0] is the resolved path of this base
+   uint8 *pixels;
+   int x,y,n,n_req;
+   int lru;
+} spk_base[SPK_BASES];
+static int spk_lru;
+
+static void spk_chain_add(SpkChain *c, char *path, FILETIME time)
+{
+   stb_arr_push(c->path, strdup(path));
+   stb_arr_push(c->time, time);
+}
+
+static void spk_chain_append(SpkChain *c, SpkChain *more)
+{
+   int i;
+   for (i=0; i < stb_arr_len(more->path); ++i)
+      spk_chain_add(c, more->path[i], more->time[i]);
+}
+
+static void spk_chain_free(SpkChain *c)
+{
+   int i;
+   for (i=0; i < stb_arr_len(c->path); ++i)
+      free(c->path[i]);
+   stb_arr_free(c->path);
+   stb_arr_free(c->time);
+   c->path = NULL;
+   c->time = NULL;
+}
+
+static int spk_file_time(char *path, FILETIME *time)
+{
+   WIN32_FILE_ATTRIBUTE_DATA info;
+   stb__wchar wpath[1024];
+   if (!GetFileAttributesExW(stb_from_utf8(wpath, path, 1024), GetFileExInfoStandard, &info))
+      return FALSE;
+   *time = info.ftLastWriteTime;
+   return TRUE;
+}
+
+// has any file in the chain been rewritten (or gone away) since?
+static int spk_chain_current(SpkChain *c)
+{
+   int i;
+   for (i=0; i < stb_arr_len(c->path); ++i) {
+      FILETIME t;
+      if (!spk_file_time(c->path[i], &t) || memcmp(&t, &c->time[i], sizeof(t)))
+         return FALSE;
+   }
+   return TRUE;
+}
+
+static int spk_is_delta(uint8 *mem, int len)
+{
+   return len >= 21 && (mem[0] == 's' || mem[0] == 'x' || mem[0] == '2')
+          && memcmp(mem+1, "PIC-delta-image", 16) == 0;
+}
+
+static uint8 *spk_decode(uint8 *mem, int len, int *x, int *y, int *n, int n_req, char *filename, int depth, SpkChain *chain);
+
+// returns a copy of the decoded base image, decoding it if it's not cached.
+// if 'chain' isn't NULL, adds this base and everything under it to it
+static uint8 *spk_load_base(char *path, int *x, int *y, int *n, int n_req, int depth, SpkChain *chain)
+{
+   SpkChain mine = { NULL, NULL };
+   FILETIME time;
+   uint8 *res = NULL, *pixels = NULL, *data;
+   size_t len;
+   int i, slot, bx,by,bn;
+
+   // take a copy of a cached one, and its chain, under the lock; checking
+   // the chain's timestamps can be slow on a network drive, so do it after
+   stb_mutex_begin(spk_lock);
+   for (i=0; i < SPK_BASES; ++i) {
+      if (spk_base[i].pixels && !stricmp(spk_base[i].chain.path[0], path) && spk_base[i].n_req == n_req) {
+         spk_base[i].lru = ++spk_lru;
+         *x = spk_base[i].x;
+         *y = spk_base[i].y;
+         *n = spk_base[i].n;
+         res = malloc(*x * *y * n_req);
+         if (res)
+            memcpy(res, spk_base[i].pixels, *x * *y * n_req);
+         spk_chain_append(&mine, &spk_base[i].chain);
+         break;
+      }
+   }
+   stb_mutex_end(spk_lock);
+   if (res) {
+      if (spk_chain_current(&mine)) {
+         if (chain) spk_chain_append(chain, &mine);
+         spk_chain_free(&mine);
+         return res;
+      }
+      // something under it was rewritten, so decode it all again
+      free(res);
+      res = NULL;
+   }
+   spk_chain_free(&mine);
+
+   // not cached, so decode it (without the lock, since it might be a
+   // delta itself, which adds its own bases to the chain) and then keep
+   // it in the least recently used slot
+   if (!spk_file_time(path, &time))
+      return NULL;
+   data = stb_file(path, &len);
+   if (data == NULL)
+      return NULL;
+   spk_chain_add(&mine, path, time);
+   if (spk_is_delta(data, len))
+      pixels = spk_decode(data, len, &bx, &by, &bn, n_req, path, depth+1, &mine);
+   else
+      pixels = stbi_load_from_memory(data, len, &bx, &by, &bn, n_req);
+   free(data);
+   if (pixels == NULL) {
+      spk_chain_free(&mine);
+      return NULL;
+   }
+   res = malloc(bx * by * n_req);
+   if (res)
+      memcpy(res, pixels, bx * by * n_req);
+   *x = bx;
+   *y = by;
+   *n = bn;
+   if (chain) spk_chain_append(chain, &mine);
+
+   stb_mutex_begin(spk_lock);
+   for (i=1, slot=0; i < SPK_BASES; ++i)
+      if (spk_base[i].lru < spk_base[slot].lru)
+         slot = i;
+   i = slot;
+   if (spk_base[i].pixels)
+      stb_atomic_add(&decoder_cache_bytes, -(long) (spk_base[i].x * spk_base[i].y * spk_base[i].n_req));
+   spk_chain_free(&spk_base[i].chain);
+   free(spk_base[i].pixels);
+   spk_base[i].chain = mine;
+   spk_base[i].pixels = pixels;
+   spk_base[i].x = bx;
+   spk_base[i].y = by;
+   spk_base[i].n = bn;
+   spk_base[i].n_req = n_req;
+   spk_base[i].lru = ++spk_lru;
+   stb_atomic_add(&decoder_cache_bytes, bx * by * n_req);
+   stb_mutex_end(spk_lock);
+   return res;
+}
+
+// v1: copy each run over the base
+static void spk_apply_runs(uint8 *res, int total, int c, int n_req, uint8 *mem, int offset, int len)
+{
+   while (offset + 8 <= len) {
+      int start = *(int *) (mem+offset);
+      int count = *(int *) (mem+offset+4);
+      offset += 8;
+      if (start < 0 || start >= total || count < 0 || count > total - start || count > (len - offset) / c)
+         break;
+      if (c == n_req) {
+         // same layout, so the whole run is one copy
+         memcpy(res + start * n_req, mem+offset, count * c);
+      } else {
+         // copy what fits of each pixel; the rest comes from the base
+         int i,j, m = stb_min(c, n_req);
+         uint8 *p = res + start * n_req, *q = mem+offset;
+         for (i=0; i < count; ++i, p += n_req, q += c)
+            for (j=0; j < m; ++j)
+               p[j] = q[j];
+      }
+      offset += count * c;
+   }
+}
+
+// v2: decompress each tile and XOR it onto the base, one tile per task
+struct
+{
+   uint8 *mem, *index, *res;
+   int len, x, y, c, n_req;
+   int tile_w, tile_h, tiles_across;
+   volatile int bad;
+} spk_work;
+
+static void *spk_work_tile(int t)
+{
+   uint8 *e = spk_work.index + t*12;
+   int tile = *(int *) e;
+   uint32 offset = *(uint32 *) (e+4), length = *(uint32 *) (e+8);
+   int c = spk_work.c, n_req = spk_work.n_req;
+   int x0 = (tile % spk_work.tiles_across) * spk_work.tile_w;
+   int y0 = (tile / spk_work.tiles_across) * spk_work.tile_h;
+   int w = stb_min(spk_work.tile_w, spk_work.x - x0);
+   int h = stb_min(spk_work.tile_h, spk_work.y - y0);
+   uint32 size = w*h*c;
+   uint8 *buf;
+   int i,j,k;
+
+   if (offset > (uint32) spk_work.len || length > spk_work.len - offset || length < 16
+       || stb_decompress_length(spk_work.mem + offset) != size) {
+      spk_work.bad = TRUE;
+      return NULL;
+   }
+   buf = malloc(size);
+   if (buf == NULL || stb_decompress(buf, spk_work.mem + offset, length) != size) {
+      spk_work.bad = TRUE;
+      free(buf);
+      return NULL;
+   }
+   for (j=0; j < h; ++j) {
+      uint8 *p = spk_work.res + ((y0+j) * spk_work.x + x0) * n_req;
+      uint8 *q = buf + j*w*c;
+      if (c == n_req) {
+         for (i=0; i < w*c; ++i)
+            p[i] ^= q[i];
+      } else {
+         int m = stb_min(c, n_req);
+         for (i=0; i < w; ++i, p += n_req, q += c)
+            for (k=0; k < m; ++k)
+               p[k] ^= q[k];
+      }
+   }
+   free(buf);
+   return NULL;
+}
+
+// returns FALSE if the tiles are damaged
+static int spk_apply_tiles(uint8 *res, int x, int y, int c, int n_req, uint8 *mem, int offset, int len)
+{
+   int tile_w = *(int *) (mem+offset);
+   int tile_h = *(int *) (mem+offset+4);
+   int num    = *(int *) (mem+offset+8);
+   uint32 crc = *(uint32 *) (mem+offset+12);
+   int i, across, down, last = -1, ok;
+   uint8 *index = mem + offset + 16;
+
+   if (tile_w < 1 || tile_w > SPK_MAX_TILE || tile_h < 1 || tile_h > SPK_MAX_TILE)
+      return FALSE;
+   across = (x + tile_w-1) / tile_w;
+   down   = (y + tile_h-1) / tile_h;
+   if (num < 0 || num > across*down || num > (len - offset - 16) / 12)
+      return FALSE;
+   if (stb_crc32(index, num*12) != crc)
+      return FALSE;
+   // increasing order means every tile is stored once, so no two tasks
+   // ever write the same pixels
+   for (i=0; i < num; ++i) {
+      int tile = *(int *) (index + i*12);
+      if (tile <= last || tile >= across*down)
+         return FALSE;
+      last = tile;
+   }
+   if (num == 0)
+      return TRUE;
+
+   stb_mutex_begin(spk_lock);
+   spk_work.mem = mem;
+   spk_work.len = len;
+   spk_work.index = index;
+   spk_work.res = res;
+   spk_work.x = x;
+   spk_work.y = y;
+   spk_work.c = c;
+   spk_work.n_req = n_req;
+   spk_work.tile_w = tile_w;
+   spk_work.tile_h = tile_h;
+   spk_work.tiles_across = across;
+   spk_work.bad = FALSE;
+   run_tiles(spk_merge, (stb_thread_func) spk_work_tile, num);
+   ok = !spk_work.bad;
+   stb_mutex_end(spk_lock);
+   return ok;
+}
+
+// 'chain', if it isn't NULL, collects the bases it was built from
+static uint8 *spk_decode(uint8 *mem, int len, int *x, int *y, int *n, int n_req, char *filename, int depth, SpkChain *chain)
+{
+   char full_filename[1024];
+   uint8 *res;
+   int offset, namelen, c, pathlen;
+
+   if (depth > SPK_MAX_CHAIN)
+      return NULL;
+
+   namelen = *(int *) (mem+17);
+   offset = 21;
+   stb_splitpath(full_filename, filename, STB_PATH);
+   pathlen = strlen(full_filename);
+   if (namelen <= 0 || namelen > len - offset - 12 || pathlen + namelen >= sizeof(full_filename))
+      return NULL;
+   memcpy(full_filename + pathlen, mem+offset, namelen);
+   full_filename[pathlen + namelen] = 0;
+   offset += namelen;
+   // v2 has four more ints of header
+   if (mem[0] == '2' && offset + 12 + 16 > len)
+      return NULL;
+
+   res = spk_load_base(full_filename, x, y, n, n_req, depth, chain);
+   if (res == NULL)
+      return NULL;
+   c = *(int *) (mem+offset+8);
+   if (*x != *(int *) (mem+offset) || *y != *(int *) (mem+offset+4) || c < 1 || c > 4) {
+      free(res);
+      return NULL;
+   }
+   offset += 12;
+
+   if (mem[0] == '2') {
+      if (!spk_apply_tiles(res, *x, *y, c, n_req, mem, offset, len)) {
+         free(res);
+         return NULL;
+      }
+   } else
+      spk_apply_runs(res, *x * *y, c, n_req, mem, offset, len);
+   return res;
+}
+#endif
+
 static uint8 *imv_decode_from_memory(uint8 *mem, int len, int *x, int *y, Bool* loaded_as_rgb, int *n, int n_req, char *filename)
 {
    uint8 *res = NULL;
@@ -4039,57 +4179,15 @@ static uint8 *imv_decode_from_memory(uint8 *mem, int len, int *x, int *y, Bool*
        return res;
    }
    imv_failure_string = stbi_failure_reason();
+   if (decode_was_cancelled && GetCurrentThreadId() == decode_thread_id)
+      return NULL; // don't let the other decoders have a go at it
 
-   if ((mem[0] == 's' || mem[0] == 'x') && memcmp(mem+1, "PIC-delta-image", 16) == 0) {
-      char full_filename[1024];
-      int len2;
-      uint8 *mem2;
-      FILE *f;
-      stb_splitpath(full_filename, filename, STB_PATH);
-      strcat(full_filename, mem+17+4);
-      f = fopen(full_filename, "rb");
-      if (f && (len2 = stb_filelen(f), mem2 = malloc(len2)) != NULL) {
-         fread(mem2, 1, len2, f);
-         fclose(f); f = NULL;
-         res = stbi_load_from_memory(mem2, len2, x, y, n, n_req);
-         if (res) {
-            int i,offset,c;
-            *loaded_as_rgb = TRUE;
-            offset = 17;
-            offset += 4 + *(int *) (mem+offset);
-            if (  *x != *(int *) (mem+offset  )
-               || *y != *(int *) (mem+offset+4) )
-            {
-               free(res);
-               free(mem2);
-               return NULL;
-            }
-            offset += 8; // skip x,y
-            c = *(int *) (mem+offset);
-            assert(c >= 1 && c <= 4);
-            offset += 4;
-            while (offset < len) {
-               int start = *(int *) (mem+offset);
-               int count = *(int *) (mem+offset+4);
-               assert(start < *x* *y);
-               assert(count <= *x * *y - start);
-               if (start < 0 || start >= *x * *y)
-                  break;
-               if (start+count < start || start+count > *x * *y)
-                  break;
-               offset += 8;
-               for (i=0; i < count; ++i) {
-                  memcpy(res + start * n_req, mem+offset, c);
-                  ++start;
-                  offset += c;
-               }
-            }
-            free(mem2);
-            return res;
-         }
-         free(mem2);
+   if (spk_is_delta(mem, len)) {
+      res = spk_decode(mem, len, x, y, n, n_req, filename, 0, NULL);
+      if (res) {
+         *loaded_as_rgb = TRUE;
+         return res;
       }
-      if (f) fclose(f);
    }
 
    if (only_stbi)
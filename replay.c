@@ -0,0 +1,610 @@
+/*  replay -- plays back browsing recorded by imv, to compare cache policies
+ *
+ *  usage: replay [options] recording folder
+ *
+ *  Run imv with IMV_RECORD set to a filename and it records every step
+ *  through the folder, and every zoom and change of window size, as it
+ *  happens (the format is described above record_view() in imv.c). This
+ *  plays the recording back on the images in 'folder', without a window,
+ *  through the same cache, loader, decoder and prefetching imv uses
+ *  (cache.c) and the same resizers (resize.c). Steps are replayed by
+ *  direction, so any folder of images will do, not just the one it was
+ *  recorded in; zooms and window sizes are replayed as the window size
+ *  they asked for.
+ *
+ *  When it's done it writes, as JSON, the time to first paint of every
+ *  step, by whether its image was already cached, in flight or cold when
+ *  they stepped to it, and how the cache and prefetching did, so a change
+ *  to advance_cache(), queue_disk_command() or flush_cache() can be
+ *  compared with and without it on the same browsing.
+ *
+ *    -x speed    play it back this many times faster (default 1)
+ *    -m MB       cache size (default 256, like imv)
+ *    -j n        resize threads (default one per processor, like imv)
+ *    -o file     write the JSON to file instead of stdout
+ *
+ *  It doesn't use any of imv's Win32 code, so it builds on Linux too:
+ *     gcc -O2 replay.c -o replay -lm -lpthread
+ *     cl /O2 /MT replay.c
+ *
+ *  It only decodes with stb_image; imv's GDI+ and FreeImage fallbacks,
+ *  and .spk, aren't there, so those files come out as errors.
+ */
+
+#ifdef _WIN32
+#include <windows.h>  // Sleep, QueryPerformanceCounter
+#else
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#define STB_DEFINE
+#include "stb.h"          /*     http://nothings.org/stb.h         */
+
+#define STBI_NO_WRITE
+#include "stb_image.c"    /*     http://nothings.org/stb_image.c   */
+
+#define BPP 4
+#include "resize.c"
+
+#ifndef _WIN32
+typedef unsigned long DWORD;
+#define Sleep(ms)              usleep((ms) * 1000)
+#define GetCurrentThreadId()   ((DWORD) pthread_self())
+#endif
+
+// what wakes the main thread up; imv gets these as window messages
+enum
+{
+   WM_APP_DECODED = 1,
+   WM_APP_LOAD_ERROR,
+   WM_APP_DECODE_ERROR,
+   WM_APP_RESIZED,
+   PLAY_event,        // it's time for the next event in the recording
+   PLAY_end,          // ...and there aren't any more
+};
+
+stb_ring *messages;
+
+void wake(int message)
+{
+   // if it's full, there's plenty there to wake us already
+   stb_ring_put(messages, (void *) (size_t) message);
+}
+
+void barrier(void)
+{
+   stb_barrier();
+}
+
+#define trace(type,filename,arg)
+#define trace_thread(name)
+
+#include "cache.c"
+
+static uint8 *imv_decode_from_memory(uint8 *mem, int len, int *x, int *y, int *loaded_as_rgb, int *n, int n_req, char *filename)
+{
+   *loaded_as_rgb = TRUE;
+   return stbi_load_from_memory(mem, len, x, y, n, n_req);
+}
+
+static char *imv_failure_reason(void)
+{
+   return (char *) stbi_failure_reason();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//   the window we're pretending to show things in
+//
+
+#define FRAME  3           // imv's border, which it resizes around
+
+// as imv: if resizing would touch more pixels than this, show a quick
+// preview first and then swap in the real thing when it's done
+#define PREVIEW_PIXELS  (3 << 20)
+
+enum
+{
+   DISPLAY_actual,   // 1:1, or shrunk to the monitor if it's bigger
+   DISPLAY_current,  // in the window's size
+};
+
+int monitor_w = 1920, monitor_h = 1080;
+int window_w, window_h;  // with frame
+int display_mode;
+
+ImageFile *source_c;     // what we're trying to show (may be waiting on a resize)
+Image *source;           // ...and its image, or NULL if it's an error
+Image *cur;              // what's on screen
+ImageFile *cur_c;        // ...and where it came from
+
+// time to first paint of every step, by NAV_*
+double *ttfp[NAV__num];  // stb_arr
+
+typedef struct
+{
+   int w,h;
+} queued_size;
+
+queued_size qs;          // most recent unsatisfied resize request
+struct
+{
+   queued_size size;     // size.w is non-zero while a resize is in flight
+   ImageFile *image_c;
+} pending_resize;
+
+typedef struct
+{
+   ImageFile *src;
+   Image dest;
+   Image *result;
+} Resize;
+
+stb_ring *resized_queue;
+
+// stand-in for imv's display(): 'z' is on screen now, which ends the
+// step if it's what they stepped to
+static void paint(ImageFile *z, int error)
+{
+   int kind = nav_kind;
+   double ms;
+   if (z != source_c) return;
+   ms = stats_painted(z, error);
+   if (ms >= 0)
+      stb_arr_push(ttfp[kind], ms);
+}
+
+static void present(Image *image, ImageFile *z)
+{
+   imfree(cur);
+   cur = image;
+   cur_c = z;
+   paint(z, FALSE);
+}
+
+// the part of z inside its frame
+static Image inside_frame(Image *z)
+{
+   Image q = *z;
+   q.x -= FRAME*2;
+   q.y -= FRAME*2;
+   q.pixels += FRAME*z->stride + FRAME*BPP;
+   return q;
+}
+
+// as imv: fit (sw,sh) into (gw,gh), both with frames
+static void compute_size(int gw, int gh, int sw, int sh, int *ox, int *oy)
+{
+   gw -= FRAME*2;
+   gh -= FRAME*2;
+   sw -= FRAME*2;
+   sh -= FRAME*2;
+   if (gw*sh > gh*sw) {
+      *oy = gh;
+      *ox = gh * sw/sh;
+   } else {
+      *ox = gw;
+      *oy = gw * sh/sw;
+   }
+}
+
+void *work_resize(void *p)
+{
+   Resize *r = (Resize *) p;
+   image_resize(&r->dest, r->src->image);
+   while (!stb_ring_put(resized_queue, r))
+      Sleep(1);
+   wake(WM_APP_RESIZED);
+   return NULL;
+}
+
+// start resizing src_c to fit (w,h) in the background, as imv does;
+// FALSE if it couldn't
+static int queue_resize(int w, int h, ImageFile *src_c)
+{
+   Image *src = src_c->image;
+   Resize *res;
+   int w2,h2;
+
+   // nothing to resize if it's an error, or isn't ours right now
+   if (src == NULL || src_c->status != LOAD_available)
+      return FALSE;
+   compute_size(w,h, src->x+FRAME*2, src->y+FRAME*2, &w2,&h2);
+   res = (Resize *) malloc(sizeof(*res));
+   if (res == NULL) return FALSE;
+   res->result = bmp_alloc(w2+FRAME*2, h2+FRAME*2);
+   if (res->result == NULL) { free(res); return FALSE; }
+   res->result->had_alpha = src->had_alpha;
+   res->dest = inside_frame(res->result);
+   res->src = src_c;
+   resize_abandon = FALSE;
+
+   if (src->x*src->y + w2*h2 > PREVIEW_PIXELS) {
+      Image *preview = bmp_alloc(w2+FRAME*2, h2+FRAME*2);
+      if (preview) {
+         Image region = inside_frame(preview);
+         image_resize_preview(&region, src);
+         present(preview, src_c);
+      }
+   }
+   src_c->status = LOAD_resizing;
+   pending_resize.image_c = src_c;
+   stb_workq(resize_workers, work_resize, res, NULL);
+   return TRUE;
+}
+
+static void finish_resizes(void)
+{
+   void *p;
+   while (stb_ring_get(resized_queue, &p)) {
+      Resize *r = (Resize *) p;
+      r->src->status = LOAD_available;
+      if (resize_abandon || r->src != source_c)
+         imfree(r->result);
+      else
+         present(r->result, r->src);
+      free(r);
+      resize_abandon = FALSE;
+      pending_resize.size.w = 0;
+   }
+}
+
+// as imv's size_to_current(): show it 1:1 if we can, otherwise ask for
+// a resize
+static void size_to_current(void)
+{
+   int w2 = source->x+FRAME*2, h2 = source->y+FRAME*2;
+   int w,h;
+
+   if (display_mode == DISPLAY_current) {
+      w = window_w;
+      h = window_h;
+   } else if (source->x <= monitor_w && source->y <= monitor_h) {
+      w = w2;
+      h = h2;
+   } else {
+      compute_size(monitor_w+FRAME*2, monitor_h+FRAME*2, w2,h2, &w,&h);
+      w += FRAME*2;
+      h += FRAME*2;
+   }
+
+   if (w == w2 && h == h2) {
+      // imv copies it into a framed bitmap
+      Image *z = bmp_alloc(w2,h2);
+      int j;
+      if (z) {
+         Image region = inside_frame(z);
+         for (j=0; j < source->y; ++j)
+            memcpy(region.pixels + j*region.stride, source->pixels + j*source->stride, source->x*BPP);
+         z->had_alpha = source->had_alpha;
+      }
+      present(z, source_c);
+   } else {
+      qs.w = w;
+      qs.h = h;
+   }
+}
+
+// cur_c only names where cur came from, but it's compared against
+// source_c, so keep its slot from being reused for something else too
+int showing(volatile ImageFile *z)
+{
+   return z == source_c || z == cur_c;
+}
+
+void update_source(ImageFile *q)
+{
+   source = q->image;
+   source_c = q;
+   q->prefetched = FALSE;  // it's being shown, so it wasn't wasted
+   if (q->lru > best_lru)
+      best_lru = q->lru;
+
+   if (source)
+      size_to_current();
+}
+
+void set_error(volatile ImageFile *z)
+{
+   imfree(cur);
+   cur = NULL;
+   cur_c = (ImageFile *) z;
+   source_c = (ImageFile *) z;
+   source = NULL;
+   paint(source_c, TRUE);
+}
+
+// imv's main loop does this before it waits for the next message
+static void start_resize(void)
+{
+   // give up on a resize that's been superseded, even if what superseded
+   // it didn't ask for a resize of its own
+   if (pending_resize.size.w && !resize_abandon)
+      if (pending_resize.image_c != source_c || (qs.w && memcmp(&qs, &pending_resize.size, sizeof(qs))))
+         resize_abandon = TRUE;
+
+   if (qs.w && pending_resize.size.w == 0) {
+      if (source && source_c->image == source) {
+         if (cur_c == source_c && cur && ((qs.w == cur->x && qs.h >= cur->y) || (qs.h == cur->y && qs.w >= cur->x)))
+            // just a different window around the same image
+            paint(source_c, FALSE);
+         else if (queue_resize(qs.w, qs.h, source_c))
+            pending_resize.size = qs;
+      }
+      qs.w = 0;
+   }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//   the recording
+//
+
+typedef struct
+{
+   double time;      // milliseconds after imv started
+   char type;        // 'a'dvance or 'v'iew
+   int a,b,c;        // dir; or w, h, display_mode
+} Event;
+
+Event *events;       // stb_arr
+float speed = 1;
+
+// they get two seconds to see the last step before we stop
+#define END_GRACE  2000
+
+static int load_recording(char *name)
+{
+   char line[256];
+   FILE *f = fopen(name, "r");
+   if (f == NULL) return FALSE;
+   if (!fgets(line, sizeof(line), f) || sscanf(line, "imv-nav 1 %d %d", &monitor_w, &monitor_h) != 2) {
+      fclose(f);
+      return FALSE;
+   }
+   while (fgets(line, sizeof(line), f)) {
+      Event e = { 0 };
+      if (sscanf(line, "%lf %c %d %d %d", &e.time, &e.type, &e.a, &e.b, &e.c) < 3)
+         continue;
+      if (e.type == 'a' || e.type == 'v')
+         stb_arr_push(events, e);
+   }
+   fclose(f);
+   return TRUE;
+}
+
+// sleeps until each event is due, and tells the main thread
+static void *player_task(void *p)
+{
+   double start = stats_now();
+   int i;
+   for (i=0; i < stb_arr_len(events); ++i) {
+      double when = start + events[i].time / speed, now;
+      while ((now = stats_now()) < when)
+         Sleep((int) (when - now));
+      while (!stb_ring_put(messages, (void *) (size_t) PLAY_event))
+         Sleep(1);
+   }
+   Sleep(END_GRACE);
+   while (!stb_ring_put(messages, (void *) (size_t) PLAY_end))
+      Sleep(1);
+   return NULL;
+}
+
+static void play(Event *e)
+{
+   if (e->type == 'a')
+      advance_cache(e->a);
+   else {
+      window_w = e->a;
+      window_h = e->b;
+      display_mode = e->c;
+      if (source) {
+         qs.w = window_w;
+         qs.h = window_h;
+      }
+   }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//   results
+//
+
+static int compare_double(const void *p, const void *q)
+{
+   double a = *(double *) p, b = *(double *) q;
+   return a < b ? -1 : a > b;
+}
+
+static void json_string(FILE *f, char *s)
+{
+   fputc('"', f);
+   for (; *s; ++s) {
+      if (*s == '"' || *s == '\\')
+         fprintf(f, "\\%c", *s);
+      else if ((unsigned char) *s < 32)
+         fprintf(f, "\\u%04x", *s);
+      else
+         fputc(*s, f);
+   }
+   fputc('"', f);
+}
+
+// nearest-rank percentile of sorted times
+static double percentile(double *t, int n, double p)
+{
+   int k = (int) ceil(p * n) - 1;
+   return t[stb_clamp(k, 0, n-1)];
+}
+
+// the distribution of the times in t, which this sorts
+static void json_ttfp(FILE *f, char *name, double *t)
+{
+   int n = stb_arr_len(t), i;
+   double total = 0;
+   fprintf(f, "    \"%s\": { \"steps\": %d", name, n);
+   if (n) {
+      qsort(t, n, sizeof(*t), compare_double);
+      for (i=0; i < n; ++i)
+         total += t[i];
+      fprintf(f, ", \"mean_ms\": %.1f, \"p50_ms\": %.1f, \"p95_ms\": %.1f, \"p99_ms\": %.1f, \"max_ms\": %.1f",
+                 total / n, percentile(t, n, 0.50), percentile(t, n, 0.95), percentile(t, n, 0.99), t[n-1]);
+   }
+   fprintf(f, " }");
+}
+
+static void write_results(FILE *f, char *recording, char *folder)
+{
+   NavStats s;
+   double *all = NULL;
+   int i,j, steps=0;
+   stats_snapshot(&s);
+   for (i=0; i < NAV__num; ++i) {
+      steps += s.steps[i];
+      for (j=0; j < stb_arr_len(ttfp[i]); ++j)
+         stb_arr_push(all, ttfp[i][j]);
+   }
+
+   fprintf(f, "{\n  \"recording\": ");
+   json_string(f, recording);
+   fprintf(f, ",\n  \"folder\": ");
+   json_string(f, folder);
+   fprintf(f, ",\n  \"files\": %d,\n  \"speed\": %g,\n  \"cache_mb\": %d,\n", stb_arr_len(fileinfo), speed, max_cache_bytes >> 20);
+   fprintf(f, "  \"steps\": { \"total\": %d, \"cached\": %d, \"in_flight\": %d, \"cold\": %d, \"skipped\": %d, \"errors\": %d },\n",
+              steps, s.steps[NAV_cached], s.steps[NAV_in_flight], s.steps[NAV_cold], s.skipped, s.errors);
+   fprintf(f, "  \"ttfp\": {\n");
+   json_ttfp(f, "all", all);             fprintf(f, ",\n");
+   json_ttfp(f, "cached", ttfp[NAV_cached]);    fprintf(f, ",\n");
+   json_ttfp(f, "in_flight", ttfp[NAV_in_flight]); fprintf(f, ",\n");
+   json_ttfp(f, "cold", ttfp[NAV_cold]);        fprintf(f, "\n  },\n");
+   fprintf(f, "  \"cache\": { \"hit_rate\": %.3f, \"evicted_decoded\": %d, \"evicted_undecoded\": %d },\n",
+              steps ? (double) s.steps[NAV_cached] / steps : 0, s.evicted_images, s.evicted_data);
+   fprintf(f, "  \"prefetch\": { \"files\": %d, \"used\": %d, \"wasted\": %d },\n",
+              s.prefetched, s.prefetch_used, s.prefetch_wasted);
+   fprintf(f, "  \"read\": { \"files\": %ld, \"mb\": %.1f },\n", s.files_read, s.kb_read / 1024.0);
+   fprintf(f, "  \"decode\": { \"images\": %ld, \"p50_ms_under\": %d, \"p95_ms_under\": %d }\n}\n",
+              s.decodes, stats_percentile((long *) s.decode, 0.50f), stats_percentile((long *) s.decode, 0.95f));
+   stb_arr_free(all);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//   main thread
+//
+
+// the first image, read and decoded before anything else starts, as
+// imv does with the one it's opened on
+static void load_first(char *name)
+{
+   volatile ImageFile *z = &cache[0];
+   size_t len;
+   int x,y,n;
+   uint8 *data = stb_file(name, &len), *pixels = NULL;
+   if (data) {
+      pixels = stbi_load_from_memory(data, (int) len, &x, &y, &n, BPP);
+      free(data);
+   }
+   z->filename = strdup(name);
+   z->lru = lru_stamp++;
+   if (pixels) {
+      z->image = (Image *) malloc(sizeof(*z->image));
+      make_image(z->image, x, y, pixels, TRUE, n);
+      z->status = LOAD_available;
+   } else {
+      z->error = strdup(data ? stbi_failure_reason() : "can't open");
+      z->status = LOAD_error_decoding;
+   }
+}
+
+static void usage(void)
+{
+   fprintf(stderr, "usage: replay [-x speed] [-m cache_mb] [-j threads] [-o file.json] recording folder\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   FILE *f = stdout;
+   char **files;
+   int i, played=0;
+
+   resize_threads = stb_min(stb_processor_count(), 16);
+   for (i=1; i < argc && argv[i][0] == '-'; ++i) {
+      if (!strcmp(argv[i], "-x") && i+1 < argc)
+         speed = (float) atof(argv[++i]);
+      else if (!strcmp(argv[i], "-m") && i+1 < argc)
+         max_cache_bytes = atoi(argv[++i]) << 20;
+      else if (!strcmp(argv[i], "-j") && i+1 < argc)
+         resize_threads = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-o") && i+1 < argc) {
+         f = fopen(argv[++i], "w");
+         if (f == NULL) { fprintf(stderr, "Couldn't write %s\n", argv[i]); return 1; }
+      } else
+         usage();
+   }
+   if (i+2 != argc || speed <= 0 || max_cache_bytes <= 0 || resize_threads < 1)
+      usage();
+
+   if (!load_recording(argv[i])) {
+      fprintf(stderr, "Couldn't read recording %s\n", argv[i]);
+      return 1;
+   }
+   // the files imv would list, in the order it would list them, so the
+   // recorded steps walk the same sequence
+   files = stb_readdir_files_mask(argv[i+1], open_filter + 12);
+   if (files == NULL || stb_arr_len(files) == 0) {
+      fprintf(stderr, "No images in %s\n", argv[i+1]);
+      return 1;
+   }
+   sort_filelist(files, NULL);
+
+   // the same workers and syncs imv sets up in WinMain
+   resize_workers = stb_workq_new(resize_threads, STB_THREADQ_DYNAMIC);
+   make_merge = stb_sync_new();
+   resize_merge = stb_sync_new();
+   sort_merge = stb_sync_new();
+   messages = stb_ring_new(4096, TRUE, FALSE);
+   resized_queue = stb_ring_new(64, TRUE, FALSE);
+   start_cache();
+
+   // imv starts out showing the file it was opened on, and once it's read
+   // the folder, it starts loading the files on either side of it
+   load_first(files[0]);
+   install_filelist(files, 0);
+   if (cache[0].status == LOAD_available)
+      update_source((ImageFile *) &cache[0]);
+   else
+      set_error(&cache[0]);
+   prefetch_neighbors();
+
+   stb_create_thread(player_task, NULL);
+   for(;;) {
+      int message;
+      start_resize();
+      message = (int) (size_t) stb_ring_get_block(messages);
+      switch (message) {
+         case WM_APP_LOAD_ERROR:
+         case WM_APP_DECODE_ERROR:
+         case WM_APP_DECODED:
+            collect_finished(message == WM_APP_DECODED);
+            break;
+         case WM_APP_RESIZED:
+            finish_resizes();
+            break;
+         case PLAY_event:
+            play(&events[played++]);
+            break;
+         case PLAY_end:
+            write_results(f, argv[i], argv[i+1]);
+            if (f != stdout) fclose(f);
+            return 0;
+      }
+   }
+}
@@ -0,0 +1,1046 @@
+// resize.c -- imv's Image, make_image() and the resizers
+//
+// imv.c #includes this, and so does bench.c, to time it; it isn't compiled
+// on its own, and BPP has to be defined first. It only needs stb.h, so it
+// builds anywhere stb.h has threads.
+
+// the cubic and sharpen inner loops are MMX inline assembly, which only
+// 32-bit MSVC can build; everything else gets the C versions
+#if defined(_MSC_VER) && defined(_M_IX86)
+#define RESIZE_MMX 1
+#else
+#define RESIZE_MMX 0
+#endif
+
+typedef struct
+{
+   int x,y;         // size of the image
+   int stride;      // distance between rows in bytes  
+   int frame;       // does this image have a frame (border)?
+   uint8 *pixels;   // pointer to (0,0)th pixel
+   int had_alpha;   // does it have alpha, to composite onto the checkerboard when displayed? (premultiplied)
+} Image;
+
+// allocate an image in windows-friendly format
+Image *bmp_alloc(int x, int y)
+{
+   Image *i = malloc(sizeof(*i));
+   if (!i) return NULL;
+   i->x = x;
+   i->y = y;
+   i->stride = x*BPP;
+   i->stride += (-i->stride) & 3;
+   i->pixels = malloc(i->stride * i->y);
+   i->frame = 0;
+   i->had_alpha = 0;
+   if (i->pixels == NULL) { free(i); return NULL; }
+   return i;
+}
+
+// free an image and its contents
+void imfree(Image *x)
+{
+   if (x) {
+      free(x->pixels);
+      free(x);
+   }
+}
+
+// dedicate workqueue workers for resizing
+stb_workqueue *resize_workers;
+
+// number of threads to use in resizer
+int resize_threads;
+
+stb_sync resize_merge;
+
+// set by the main thread when it no longer wants the resize in progress
+// (they've moved on to another image, or asked for a different size);
+// the resizer skips whatever tiles it has left, and we throw away the
+// result and start on the newest request
+volatile int resize_abandon;
+
+// quality settings, from the preferences
+int downsample_cubic = TRUE;
+int upsample_cubic = TRUE;
+int sharpen=0;
+int nearest_neighbor = 0; // internal use
+
+// given raw decoded data from stbi_load, make it into a proper Image (e.g. creating a
+// windows-compatible bitmap with 4-byte aligned rows and BGR color order)
+
+// run num_tiles calls of f, on resize_workers and the current thread
+void run_tiles(stb_sync merge, stb_thread_func f, int num_tiles);
+
+// make_image works on bands of this many rows, in parallel; everything it
+// might do to a pixel is decided once per image, so each band just runs
+// the few row loops that apply
+#define MAKE_BAND  64
+
+struct
+{
+   uint8 *data;
+   int x,y;
+   int swap;                // convert RGB to BGR
+   int alpha;               // look for a non-zero alpha
+   volatile int saw_alpha;  // some band has found a non-zero alpha
+   int premultiply;         // second pass, once we know the alpha is real
+} make_work;
+stb_sync make_merge;
+
+static void swap_row(uint8 *p, int n)
+{
+   int i;
+   #if BPP==4
+   // swap R and B, a whole pixel at a time
+   uint32 *q = (uint32 *) p;
+   for (i=0; i < n; ++i) {
+      uint32 c = q[i];
+      q[i] = (c & 0xff00ff00) + ((c >> 16) & 0xff) + ((c & 0xff) << 16);
+   }
+   #else
+   for (i=0; i < n; ++i, p += BPP) {
+      unsigned char t = p[0];
+      p[0] = p[2];
+      p[2] = t;
+   }
+   #endif
+}
+
+#if BPP==4
+static int row_has_alpha(uint8 *p, int n)
+{
+   int i;
+   for (i=0; i < n; ++i)
+      if (p[i*4+3])
+         return TRUE;
+   return FALSE;
+}
+
+// scale the color by alpha. the resizers filter all four channels the
+// same way, and with straight alpha, the color of invisible pixels would
+// get blended into the visible ones next to them as dark fringes
+static void premultiply_row(uint8 *p, int n)
+{
+   int i;
+   for (i=0; i < n; ++i, p += 4) {
+      int a = p[3];
+      if (a != 255) {
+         p[0] = (p[0]*a + 127) / 255;
+         p[1] = (p[1]*a + 127) / 255;
+         p[2] = (p[2]*a + 127) / 255;
+      }
+   }
+}
+#endif
+
+void *make_image_work(int n)
+{
+   int j  = n * MAKE_BAND;
+   int j1 = stb_min(j + MAKE_BAND, make_work.y);
+   int x  = make_work.x;
+   for (; j < j1; ++j) {
+      uint8 *p = make_work.data + j*x*BPP;
+      #if BPP==4
+      if (make_work.premultiply) {
+         premultiply_row(p, x);
+         continue;
+      }
+      #endif
+      if (make_work.swap)
+         swap_row(p, x);
+      #if BPP==4
+      // if the alpha is all 0, we're supposed to ignore it; once anybody
+      // has seen a non-zero one, nobody needs to look any more
+      if (make_work.alpha && !make_work.saw_alpha && row_has_alpha(p, x))
+         make_work.saw_alpha = TRUE;
+      #endif
+   }
+   return NULL;
+}
+
+void make_image(Image *z, int image_x, int image_y, uint8 *image_data, int image_loaded_as_rgb, int image_n)
+{
+   int n,num_bands;
+   z->pixels = image_data;
+   z->x = image_x;
+   z->y = image_y;
+   z->stride = image_x*BPP;
+   z->frame = 0;
+   z->had_alpha = (image_n==4);
+
+   num_bands = (image_y + MAKE_BAND-1) / MAKE_BAND;
+   make_work.data = image_data;
+   make_work.x = image_x;
+   make_work.y = image_y;
+   make_work.swap = image_loaded_as_rgb;
+   make_work.alpha = (BPP==4 && image_n == 4);
+   make_work.saw_alpha = FALSE;
+   make_work.premultiply = FALSE;
+
+   run_tiles(make_merge, (stb_thread_func) make_image_work, num_bands);
+
+   #if BPP==4
+   if (make_work.alpha && !make_work.saw_alpha) {
+      // all alpha is 0, so force to 255, and don't bother compositing it
+      for (n=0; n < image_x * image_y; ++n)
+         image_data[n*4+3] = 255;
+      z->had_alpha = FALSE;
+   } else if (make_work.alpha) {
+      make_work.premultiply = TRUE;
+      run_tiles(make_merge, (stb_thread_func) make_image_work, num_bands);
+   }
+   #endif
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+//    Everything from here on down just does image resizing
+//
+
+typedef struct {
+   short i;
+   unsigned char f;
+} SplitPoint;
+
+SplitPoint point_buffer[3200];
+
+// The resizers cut their output into lots of small tiles of rows, rather
+// than one band per thread. With one band per thread, if any core was busy
+// (say, decoding the next image) the whole resize waited on that one band;
+// now idle workers steal the tiles that thread hasn't gotten to, and the
+// thread that asked for the resize runs tiles too instead of just sleeping.
+#define RESIZE_TILE  16
+
+int resize_num_tiles(int rows)
+{
+   return (rows + RESIZE_TILE-1) / RESIZE_TILE;
+}
+
+// only one resize runs tiles at a time, so this can be global
+static stb_thread_func resize_tile_func;
+
+// every tile goes through here, so an abandoned resize drains quickly
+static void *resize_tile(void *p)
+{
+   if (!resize_abandon)
+      resize_tile_func(p);
+   return NULL;
+}
+
+void run_tiles(stb_sync merge, stb_thread_func f, int num_tiles)
+{
+   int i;
+   // before the workers exist (e.g. scanning a folder from the command
+   // line), just do it all ourselves
+   if (resize_threads == 1 || num_tiles == 1 || resize_workers == NULL) {
+      for (i=0; i < num_tiles; ++i)
+         f((void *) (size_t) i);
+      return;
+   }
+   stb_barrier();
+   stb_sync_set_target(merge, num_tiles+1);
+   for (i=0; i < num_tiles; ++i) {
+      if (!stb_workq_reach(resize_workers, f, (void *) (size_t) i, NULL, merge)) {
+         // queue is full, so just do it ourselves
+         f((void *) (size_t) i);
+         stb_sync_reach(merge);
+      }
+   }
+   stb_sync_reach_and_help(merge, resize_workers);
+}
+
+void resize_run_tiles(stb_thread_func f, int num_tiles)
+{
+   resize_tile_func = f;
+   run_tiles(resize_merge, resize_tile, num_tiles);
+}
+
+typedef struct
+{
+   double temp;
+   Image *dest;
+   Image *src;
+   SplitPoint *p;
+   float dy;
+   int alpha;     // resample alpha too (otherwise it's left 0)
+} ImageProcess;
+
+ImageProcess bilinear_work;
+
+#define CACHE_REBLOCK  64
+void *image_resize_work(int n)
+{
+   int i,j,k;
+   ImageProcess *q = &bilinear_work;
+   Image *dest = q->dest, *src = q->src;
+   SplitPoint *p = q->p;
+   int j0 = n * RESIZE_TILE;
+   int j1 = stb_min(j0 + RESIZE_TILE, dest->y);
+   float y, y0 = q->dy * j0;
+   for (k=0; k < dest->x; k += CACHE_REBLOCK) {
+      int k2 = stb_min(k + CACHE_REBLOCK, dest->x);
+      y = y0;
+      for (j=j0; j < j1; ++j) {
+         int iy;
+         int fy;
+         y = q->dy * j;
+         iy = (int) floor(y);
+         fy = (int) floor(255.9f*(y - iy));
+         if (nearest_neighbor) fy = 0; else
+         if (iy >= src->y-1) {
+            iy = src->y-2;
+            fy = 255;
+         }
+         {
+            unsigned char *d = &dest->pixels[j*dest->stride + k*BPP];
+            unsigned char *s0 = src->pixels + src->stride*iy;
+            unsigned char *s1 = s0 + src->stride;
+            for (i=k; i < k2; ++i) {
+               s0 += p[i].i;
+               s1 += p[i].i;
+               {
+                  unsigned char x = p[i].f;
+
+                  #if BPP == 4
+                  uint32 c00,c01,c10,c11,rb0,rb1,rb00,rb01,rb10,rb11,rb,g;
+                  if (nearest_neighbor) x = 0;
+                  c00 = *(uint32 *) s0;
+                  c01 = *(uint32 *) (s0+4);
+                  c10 = *(uint32 *) s1;
+                  c11 = *(uint32 *) (s1+4);
+
+                  rb00 = c00 & 0xff00ff;
+                  rb01 = c01 & 0xff00ff;
+                  rb0 = (rb00 + (((rb01 - rb00) * x) >> 8)) & 0xff00ff;
+                  rb10 = c10 & 0xff00ff;
+                  rb11 = c11 & 0xff00ff;
+                  rb1 = (rb10 + (((rb11 - rb10) * x) >> 8)) & 0xff00ff;
+                  rb = (rb0 + (((rb1 - rb0) * fy) >> 8)) & 0xff00ff;
+
+                  rb00 = c00 & 0xff00;
+                  rb01 = c01 & 0xff00;
+                  rb0 = (rb00 + (((rb01 - rb00) * x) >> 8)) & 0xff00;
+                  rb10 = c10 & 0xff00;
+                  rb11 = c11 & 0xff00;
+                  rb1 = (rb10 + (((rb11 - rb10) * x) >> 8)) & 0xff00;
+                  g = (rb0 + (((rb1 - rb0) * fy) >> 8)) & 0xff00;
+
+                  if (q->alpha) {
+                     int a00 = c00 >> 24, a01 = c01 >> 24, a10 = c10 >> 24, a11 = c11 >> 24;
+                     int a0 = a00 + (((a01 - a00) * x) >> 8);
+                     int a1 = a10 + (((a11 - a10) * x) >> 8);
+                     g += (a0 + (((a1 - a0) * fy) >> 8)) << 24;
+                  }
+
+                  *(uint32 *)d = rb + g;
+                  #else
+                  unsigned char v00,v01,v10,v11;
+                  int v0,v1;
+
+                  if (nearest_neighbor) x = 0;
+                  v00 = s0[0]; v01 = s0[BPP+0]; v10 = s1[0]; v11 = s1[BPP+0];
+                  v0 = (v00<<8) + x * (v01 - v00);
+                  v1 = (v10<<8) + x * (v11 - v10);
+                  v0 = (v0<<8) + fy * (v1 - v0);
+                  d[0] = v0 >> 16;
+
+                  v00 = s0[1]; v01 = s0[BPP+1]; v10 = s1[1]; v11 = s1[BPP+1];
+                  v0 = (v00<<8) + x * (v01 - v00);
+                  v1 = (v10<<8) + x * (v11 - v10);
+                  v0 = (v0<<8) + fy * (v1 - v0);
+                  d[1] = v0 >> 16;
+
+                  v00 = s0[2]; v01 = s0[BPP+2]; v10 = s1[2]; v11 = s1[BPP+2];
+                  v0 = (v00<<8) + x * (v01 - v00);
+                  v1 = (v10<<8) + x * (v11 - v10);
+                  v0 = (v0<<8) + fy * (v1 - v0);
+                  d[2] = v0 >> 16;
+                  #endif
+
+                  d += BPP;
+               }
+            }
+         }
+         y += q->dy;
+      }
+   }
+   return NULL;
+}
+
+void image_resize_bilinear(Image *dest, Image *src)
+{
+   SplitPoint *p = stb_temp(point_buffer, dest->x * sizeof(*p));
+   int i,k;
+   float x,dx,dy;
+   assert(src->frame == 0);
+   dx = (float) (src->x - 1) / (dest->x - 1);
+   dy = (float) (src->y - 1) / (dest->y - 1);
+   x=0;
+   for (i=0; i < dest->x; ++i) {
+      p[i].i = (int) floor(x);
+      p[i].f = (int) floor(255.9f*(x - p[i].i));
+      if (p[i].i >= src->x-1) {
+         p[i].i = src->x-2;
+         p[i].f = 255;
+      }
+      x += dx;
+      p[i].i *= BPP;
+   }
+   for (k=0; k < dest->x; k += CACHE_REBLOCK) {
+      int k2 = stb_min(k+CACHE_REBLOCK, dest->x);
+      for (i=k2-1; i > k; --i) {
+         p[i].i -= p[i-1].i;
+      }
+   }
+   bilinear_work.dest = dest;
+   bilinear_work.src = src;
+   bilinear_work.alpha = src->had_alpha;
+   bilinear_work.dy = dy;
+   bilinear_work.p = p;
+
+   resize_run_tiles((stb_thread_func) image_resize_work, resize_num_tiles(dest->y));
+
+   stb_tempfree(point_buffer, p);
+}
+
+struct
+{
+   Image *dest;
+   Image *src;
+   int *x_offset;   // byte offset in a source row for each output column
+} preview_work;
+
+void *image_resize_preview_work(int n)
+{
+   Image *dest = preview_work.dest, *src = preview_work.src;
+   int *x_offset = preview_work.x_offset;
+   int i,j, j1 = stb_min((n+1)*RESIZE_TILE, dest->y);
+   for (j=n*RESIZE_TILE; j < j1; ++j) {
+      uint8 *s = src->pixels + src->stride * (int) ((j + 0.5f) * src->y / dest->y);
+      uint8 *d = dest->pixels + dest->stride * j;
+      for (i=0; i < dest->x; ++i, d += BPP)
+         memcpy(d, s + x_offset[i], BPP);
+   }
+   return NULL;
+}
+
+// nearest-neighbor resize: it looks bad, but it only has to look at
+// each output pixel once, so it's fast enough to show immediately
+void image_resize_preview(Image *dest, Image *src)
+{
+   int i;
+   int *x_offset = (int *) malloc(dest->x * sizeof(*x_offset));
+   if (!x_offset) return;
+   for (i=0; i < dest->x; ++i)
+      x_offset[i] = (int) ((i + 0.5f) * src->x / dest->x) * BPP;
+   preview_work.dest = dest;
+   preview_work.src = src;
+   preview_work.x_offset = x_offset;
+   resize_run_tiles((stb_thread_func) image_resize_preview_work, resize_num_tiles(dest->y));
+   free(x_offset);
+}
+
+#if BPP==4
+//
+
+#undef R
+#undef G
+#undef B
+#undef A
+#undef RGB
+#undef RGBA
+
+#define R(x) ( (x)        & 0xff)
+#define G(x) (((x) >>  8) & 0xff)
+#define B(x) (((x) >> 16) & 0xff)
+#define A(x) (((x) >> 24) & 0xff)
+#define RGBA(r,g,b,a) (((a) << 24) + ((b) << 16) + ((g) << 8) + (r))
+#define RGB(r,g,b)    RGBA(r,g,b,0)
+
+typedef uint32 Color;
+
+// lerp() is just blend() that also "blends" alpha
+// put a/256 of src over dest, including alpha
+;// again, cannot be used for a=256
+static Color lerp(Color dest, Color src, uint8 a)
+{
+   int rb_src  = src  & 0xff00ff;
+   int rb_dest = dest & 0xff00ff;
+   int rb      = rb_dest + ((rb_src - rb_dest) * a >> 8);
+   int ga_src  = (src  & 0xff00ff00) >> 8;
+   int ga_dest = (dest & 0xff00ff00) >> 8;
+   int ga      = (ga_dest<<8) + (ga_src - ga_dest) * a;
+   return (rb & 0xff00ff) + (ga & 0xff00ff00);
+}
+
+#if RESIZE_MMX
+
+
+#define SSE __declspec(align(16))
+#define MMX __declspec(align(8))
+
+//   out = a * t^3 + b*t^2 + c*t + d
+//   out = (a*t+b)*t^2 + (c*t+d)*1
+
+MMX int16 three[4] = { 3,3,3,3 };
+MMX int16 round[4] = { 128,128,128,128 };
+
+static void cubic_interpolate_span(uint32 *dest,
+                                   uint32 *x0, uint32 *x1, uint32 *x2, uint32 *x3,
+                                   int lerp8, int step_dest, int step_src, int len)
+{
+   if (len <= 0) return;
+   __asm {
+      // these save/restores shouldn't be necessary... but they seem to be needed
+      // in VC6 opt builds; either a buggy compiler, or I'm doing something wrong
+      push eax
+      push ebx
+      push ecx
+      push edx
+      push esi
+      push edi
+      mov   edi,dest
+      mov   eax,x0
+      mov   ebx,x1
+      mov   ecx,x2
+      mov   edx,x3
+      pxor  mm0,mm0
+      movd  mm7,lerp8
+      mov   esi,len
+      punpcklbw mm7,mm7   // 0,0,0,0,0,0,lerp,lerp
+      punpcklbw mm7,mm7   // 0,0,0,0,lerp,lerp,lerp,lerp
+      punpcklbw mm7,mm7   // 8xlerp. (This meakes each unsigned lerp value 0..15)
+      psrlw     mm7,1     // slide away from the sign bit; 1.15 lerp
+      // clearer way to thinkg of this: mm7 contains t/2
+   } looptop: __asm {
+
+      movd  mm1,[eax]
+      movd  mm4,[edx]
+      movd  mm2,[ebx]
+      movd  mm3,[ecx]
+      add       eax,step_src
+      add       ebx,step_src
+      punpcklbw mm1,mm0   // mm1 = x0
+      punpcklbw mm4,mm0   // mm4 = x3
+      punpcklbw mm2,mm0   // mm2 = x1
+      punpcklbw mm3,mm0   // mm3 = x2
+
+      // extra precision
+      psllw     mm1,2
+      psllw     mm2,2
+      psllw     mm3,2
+      psllw     mm4,2
+
+      add       ecx,step_src
+      add       edx,step_src
+#if 1
+      // catmull-rom cubic
+      // "scheduled" to try to spread stuff out early
+      // also the final shift by two has been optimized up earlier
+      // (which means we really only get 6-7 good bits)
+      psubw     mm4,mm1   // mm4 = x3-x0
+      movq      mm5,mm2   // mm5 = x1
+      movq      mm6,mm3   // mm6 = x2
+      psubw     mm5,mm3   // mm5 = x1-x2
+      paddw     mm3,mm1   // mm3 = x0+x2
+      psubw     mm6,mm1   // mm6 = x2-x0 = c
+      psubw     mm3,mm2   // mm3 = x0+x2-d/2
+      pmullw    mm5,three // mm5 = 3*(x1-x2)
+      psubw     mm3,mm2   // mm3 = x0+x2-d
+      pmulhw    mm6,mm7   // mm6 = c*t/2
+      paddw     mm5,mm4   // mm5 = a
+      psubw     mm3,mm5   // mm3 = b
+
+      psllw     mm5,2     // mm5 = a*4
+      psllw     mm3,1     // mm3 = b*2
+      pmulhw    mm5,mm7   // mm5 = a*t*2
+      paddw     mm6,mm2   // mm6 = (c*t+d)/2
+      paddw     mm5,mm3   // mm5 = (a*t + b)*2
+      pmulhw    mm5,mm7   // mm5 = a*t^2+b*t
+      pmulhw    mm5,mm7   // mm5 = (a*t^3+b*t^2)/2
+      paddw     mm5,mm6
+      psraw     mm5,2
+      packuswb  mm5,mm5
+      movd      [edi],mm5
+#else
+      // unknown spline type from: http://local.wasp.uwa.edu.au/~pbourke/other/interpolation/
+      psubw     mm4,mm3   // mm4 = x3-x2
+      psubw     mm4,mm1   // mm4 = x3-x2-x0
+      paddw     mm4,mm2   // mm4 = a0 = x3-x2-x0+x1
+      psubw     mm3,mm1   // mm3 = a2 = x2-x0
+      psubw     mm1,mm2   // mm1 = x0-x1
+      psubw     mm1,mm4   // mm1 = a1 = x0-x1-a0
+      // mm2 = a3 = y1
+      psllw     mm4,3
+      pmulhw    mm4,mm7
+      pmulhw    mm4,mm7
+      pmulhw    mm4,mm7
+      psllw     mm1,2
+      pmulhw    mm1,mm7
+      pmulhw    mm1,mm7
+      psllw     mm3,1
+      pmulhw    mm3,mm7
+      paddw     mm1,mm2
+      paddw     mm1,mm3
+      paddw     mm1,mm4
+      packuswb  mm1,mm1
+      movd      [edi],mm1
+#endif
+      add       edi,step_dest
+      dec       esi
+      jnz       looptop
+      emms
+      pop edi
+      pop esi
+      pop edx
+      pop ecx
+      pop ebx
+      pop eax
+   }
+}
+
+#else
+static int cubic(int x0, int x1, int x2, int x3, int lerp8)
+{
+   int a = 3*(x1-x2) + (x3-x0);
+   int d = x1+x1;
+   int c = x2 - x0;
+   int b = -a-d + x0+x2;
+
+   int res = a * lerp8 + (b << 8);
+   res = (res * lerp8);
+   res = ((res >> 16) + c) * lerp8;
+   res = ((res >> 8) + d) >> 1;
+   if (res < 0) res = 0; else if (res > 255) res = 255;
+   return res;
+}
+
+static void cubic_interpolate_span(Color *dest, Color *x0, Color *x1, Color *x2, Color *x3, int lerp8, int step_dest, int step_src, int len)
+{
+   int i;
+   for (i=0; i < len; ++i) {
+      int r,g,b,a;
+      r = cubic(R(*x0),R(*x1),R(*x2),R(*x3),lerp8);
+      g = cubic(G(*x0),G(*x1),G(*x2),G(*x3),lerp8);
+      b = cubic(B(*x0),B(*x1),B(*x2),B(*x3),lerp8);
+      a = cubic(A(*x0),A(*x1),A(*x2),A(*x3),lerp8);
+      *dest = RGBA(r,g,b,a);
+      x0 += step_src>>2;
+      x1 += step_src>>2;
+      x2 += step_src>>2;
+      x3 += step_src>>2;
+      dest += step_dest>>2;
+   }
+}
+#endif
+
+#define PLUS(x,y)   ((uint32 *) ((uint8 *) (x) + (y)))
+
+struct
+{
+   Image *src;
+   Image *out;
+   int dx,dy;
+   uint8 *rows;            // a block of rows for each tile that can be running...
+   int rows_size;          // ...this many bytes each
+   volatile long *busy;    // which blocks tiles have claimed
+   int slots;
+} cubic_work;
+
+// horizontally resample source rows [row, row+rows) into 'out', which is
+// cubic_work.out->x wide with stride out_stride. we walk down columns
+// rather than across rows, because the lerp is constant per column
+#define CUBIC_BLOCK  32
+static void cubic_x_rows(uint32 *out, int out_stride, int row, int rows)
+{
+   Image *src = cubic_work.src;
+   int out_w = cubic_work.out->x;
+   int x,i,j,k;
+   for (k=0; k < rows; k += CUBIC_BLOCK) {
+      int k2 = stb_min(k+CUBIC_BLOCK, rows);
+      x = 0;
+      for (i=0; i < out_w; ++i) {
+         uint32 *data = (uint32 *) (src->pixels + (row+k)*src->stride);
+         uint32 *dest = PLUS(out, k*out_stride) + i;
+         int xp = (x >> 16);
+         int xw = (x >> 8) & 255;
+         if (xp == 0) {
+            cubic_interpolate_span(dest, data+xp,data+xp,data+xp+1,data+xp+2,xw,out_stride,src->stride,k2-k);
+         } else if (xp >= src->x - 2) {
+            if (xp == src->x-1) {
+               for (j=k; j < k2; ++j) {
+                  dest[0] = data[xp];
+                  data = PLUS(data, src->stride);
+                  dest = PLUS(dest, out_stride);
+               }
+            } else {
+               cubic_interpolate_span(dest, data+xp-1,data+xp,data+xp+1,data+xp+1,xw,out_stride,src->stride,k2-k);
+            }
+         } else {
+            cubic_interpolate_span(dest, data+xp-1,data+xp,data+xp+1,data+xp+2,xw,out_stride,src->stride,k2-k);
+         }
+         x += cubic_work.dx;
+      }
+   }
+}
+
+// a worker runs one tile at a time, so as long as there's a block for
+// every worker and the thread that asked, one is always free
+static int cubic_claim_rows(void)
+{
+   int i;
+   for(;;)
+      for (i=0; i < cubic_work.slots; ++i)
+         if (stb_atomic_cas(&cubic_work.busy[i], 1, 0) == 0)
+            return i;
+}
+
+// Each tile horizontally resamples just the source rows its output rows
+// need (a few more than RESIZE_TILE/scale) into a small private buffer,
+// and then resamples those vertically straight into the output. This
+// used to be two full passes with a whole src->x by out->y intermediate
+// image between them, which was the most memory traffic of any stage.
+void * cubic_resize_work(int n)
+{
+   Image *src = cubic_work.src;
+   Image *out = cubic_work.out;
+   int dy = cubic_work.dy;
+   int j   = n * RESIZE_TILE;
+   int j1  = stb_min(j + RESIZE_TILE, out->y);
+   int r0  = stb_max(((j*dy) >> 16) - 1, 0);
+   int r1  = stb_min((((j1-1)*dy) >> 16) + 2, src->y-1);
+   int stride = out->x * 4;
+   int slot = cubic_claim_rows();
+   uint32 *rows = (uint32 *) (cubic_work.rows + slot * cubic_work.rows_size);
+   assert((r1-r0+1) * stride <= cubic_work.rows_size);
+
+   cubic_x_rows(rows, stride, r0, r1-r0+1);
+
+   for (; j < j1; ++j) {
+      int y  = j * dy;
+      int yp = (y >> 16);
+      uint8 yw = (y >> 8);
+      uint32 *dest  = (uint32 *) (out->pixels + j*out->stride);
+      uint32 *data1 = PLUS(rows, (yp - r0) * stride);
+      uint32 *data2 = PLUS(data1, stride);
+      uint32 *data0 = (yp > 0) ? PLUS(data1, - stride) : data1;
+      uint32 *data3 = (yp < src->y-2) ? PLUS(data2, stride) : data2;
+      cubic_interpolate_span(dest, data0, data1, data2, data3, yw, 4,4,out->x);
+   }
+   stb_atomic_cas(&cubic_work.busy[slot], 0, 1);
+   return NULL;
+}
+
+// bicubic resize of all of src into all of out. returns FALSE, without
+// touching out, if there isn't memory for the tiles' row blocks
+int cubic_resize(Image *out, Image *src)
+{
+   int dy = ((src->y-1)*65536-1) / (out->y-1);
+   // the most source rows any tile needs; see cubic_resize_work()
+   int rows = (((RESIZE_TILE-1) * dy) >> 16) + 5;
+
+   cubic_work.src = src;
+   cubic_work.out = out;
+   cubic_work.dx = (src->x-1)*65536 / (out->x-1);
+   cubic_work.dy = dy;
+
+   // allocated once per resize rather than once per tile
+   cubic_work.slots = resize_threads + 1;
+   cubic_work.rows_size = rows * out->x * 4;
+   cubic_work.rows = (uint8 *) malloc(cubic_work.slots * cubic_work.rows_size);
+   cubic_work.busy = (volatile long *) calloc(cubic_work.slots, sizeof(long));
+   if (cubic_work.rows == NULL || cubic_work.busy == NULL) {
+      free(cubic_work.rows);
+      free((void *) cubic_work.busy);
+      return FALSE;
+   }
+
+   resize_run_tiles((stb_thread_func) cubic_resize_work, resize_num_tiles(out->y));
+
+   free(cubic_work.rows);
+   free((void *) cubic_work.busy);
+   return TRUE;
+}
+
+// downsampling
+Image *downsample_half(Image *src)
+{
+   int i,j, w,h;
+   Image *res;
+
+   w = src->x>>1;
+   h = src->y>>1;
+
+   res = bmp_alloc(w,h);
+   res->had_alpha = src->had_alpha;
+   for (j=0; j < h; j += 1) {
+      Color *src0 = (uint32*)(src->pixels + 2*j * src->stride);
+      Color *src1 = PLUS(src0, src->stride);
+      for (i=0; i < w; i += 1) {
+         Color *dest = (uint32*)(res->pixels + j * res->stride + i*BPP);
+         // this will cause quantization of flat-colored regions, thus can
+         // cause banding in very slow gradients
+         *dest = ((src0[0] >> 2) & 0x3f3f3f3f) +
+                 ((src0[1] >> 2) & 0x3f3f3f3f) +
+                 ((src1[0] >> 2) & 0x3f3f3f3f) +
+                 ((src1[1] >> 2) & 0x3f3f3f3f);
+         src0 += 2;
+         src1 += 2;
+      }
+   }
+
+   return res;
+}
+
+Image *downsample_two_thirds(Image *src)
+{
+   int i,j, w,h;
+   Image *res;
+
+   w = src->x/3 * 2;
+   h = src->y/3 * 2;
+
+   res = bmp_alloc(w, h);
+   res->had_alpha = src->had_alpha;
+   for (j=0; j+1 < h; j += 2) {
+      Color *src0 = (uint32*)(src->pixels + 3*(j>>1) * src->stride);
+      Color *src1 = PLUS(src0, src->stride);
+      Color *src2 = PLUS(src1, src->stride);
+      // use (2/3,1/3) and (1/3,2/3), which amounts to:
+      //    A B C     W  X
+      //    D E F  -> 
+      //    G H I     Y  Z
+
+      // W = A*4/9 + B * 2/9 + D * 2/9 + E * 1/9
+      // for speed, approximate as A*3/8 + B*2/8 + D*2/8 + E*1/8
+      for (i=0; i+1 < w; i += 2) {
+         Color *dest = (uint32*)(res->pixels + j * res->stride + i*BPP);
+         dest[0] = ((src0[0] >> 1) & 0x7f7f7f7f) - ((src0[0] >> 3) & 0x1f1f1f1f)
+                 + ((src0[1] >> 2) & 0x3f3f3f3f) + ((src1[0] >> 2) & 0x3f3f3f3f)
+                 + ((src1[1] >> 3) & 0x1f1f1f1f);
+         dest[1] = ((src0[2] >> 1) & 0x7f7f7f7f) - ((src0[2] >> 3) & 0x1f1f1f1f)
+                 + ((src0[1] >> 2) & 0x3f3f3f3f) + ((src1[2] >> 2) & 0x3f3f3f3f)
+                 + ((src1[1] >> 3) & 0x1f1f1f1f);
+         dest = PLUS(dest,res->stride);
+         dest[0] = ((src2[0] >> 1) & 0x7f7f7f7f) - ((src2[0] >> 3) & 0x1f1f1f1f)
+                 + ((src2[1] >> 2) & 0x3f3f3f3f) + ((src1[0] >> 2) & 0x3f3f3f3f)
+                 + ((src1[1] >> 3) & 0x1f1f1f1f);
+         dest[1] = ((src2[2] >> 1) & 0x7f7f7f7f) - ((src2[2] >> 3) & 0x1f1f1f1f)
+                 + ((src2[1] >> 2) & 0x3f3f3f3f) + ((src1[2] >> 2) & 0x3f3f3f3f)
+                 + ((src1[1] >> 3) & 0x1f1f1f1f);
+         src0 += 3;
+         src1 += 3;
+         src2 += 3;         
+      }
+   }
+
+   return res;
+}
+
+// sharpen one row: out = (16*center - the 8 neighbors) / 8, on all four
+// channels at once. 'above' and 'below' are the neighboring source rows,
+// and all of the pointers are at the first pixel to write, which must
+// have a pixel on either side
+#if RESIZE_MMX
+static void sharpen_span(uint8 *out, uint8 *above, uint8 *row, uint8 *below, int len)
+{
+   if (len <= 0) return;
+   __asm {
+      push eax
+      push ebx
+      push ecx
+      push esi
+      push edi
+      mov   edi,out
+      mov   eax,above
+      mov   esi,row
+      mov   ebx,below
+      mov   ecx,len
+      pxor  mm7,mm7
+   } sharpen_top: __asm {
+      movd  mm0,[esi]
+      movd  mm1,[esi-4]
+      movd  mm2,[esi+4]
+      movd  mm3,[eax-4]
+      movd  mm4,[eax]
+      movd  mm5,[eax+4]
+      punpcklbw mm0,mm7
+      punpcklbw mm1,mm7
+      punpcklbw mm2,mm7
+      punpcklbw mm3,mm7
+      punpcklbw mm4,mm7
+      punpcklbw mm5,mm7
+      psllw     mm0,4     // mm0 = 16*center
+      paddw     mm1,mm2   // mm1 = left+right
+      paddw     mm3,mm4
+      movd  mm2,[ebx-4]
+      movd  mm4,[ebx]
+      movd  mm6,[ebx+4]
+      paddw     mm3,mm5   // mm3 = sum of above
+      punpcklbw mm2,mm7
+      punpcklbw mm4,mm7
+      punpcklbw mm6,mm7
+      paddw     mm2,mm4
+      paddw     mm1,mm3
+      paddw     mm2,mm6   // mm2 = sum of below
+      add       eax,4
+      add       esi,4
+      paddw     mm1,mm2   // mm1 = sum of all 8 neighbors (max 2040)
+      add       ebx,4
+      psubw     mm0,mm1   // fits in 16 bits signed
+      psraw     mm0,3
+      packuswb  mm0,mm0   // clamp to 0..255
+      movd      [edi],mm0
+      add       edi,4
+      dec       ecx
+      jnz       sharpen_top
+      emms
+      pop edi
+      pop esi
+      pop ecx
+      pop ebx
+      pop eax
+   }
+}
+#else
+static void sharpen_span(uint8 *out, uint8 *above, uint8 *row, uint8 *below, int len)
+{
+   int i,k;
+   for (i=0; i < len*BPP; i += BPP) {
+      for (k=0; k < BPP; ++k) {
+         int v = row[i+k] * 16;
+         v -= above[i+k-BPP] + above[i+k] + above[i+k+BPP];
+         v -= below[i+k-BPP] + below[i+k] + below[i+k+BPP];
+         v -= row[i+k-BPP] + row[i+k+BPP];
+         v >>= 3;
+         if (v < 0) v = 0; else if (v > 255) v = 255;
+         out[i+k] = v;
+      }
+   }
+}
+#endif
+
+struct
+{
+   Image *dest;
+   Image *src;
+} sharpen_work;
+
+void *do_sharpen_work(int n)
+{
+   Image *dest = sharpen_work.dest, *src = sharpen_work.src;
+   int j, j1 = stb_min((n+1)*RESIZE_TILE, src->y);
+   for (j=n*RESIZE_TILE; j < j1; ++j) {
+      uint8 *s = src->pixels + src->stride*j;
+      uint8 *d = dest->pixels + dest->stride*j;
+      if (j == 0 || j == src->y-1 || src->x < 3) {
+         // the outermost pixels don't have all their neighbors; leave them alone
+         memcpy(d, s, src->x*BPP);
+      } else {
+         memcpy(d, s, BPP);
+         sharpen_span(d+BPP, s+BPP-src->stride, s+BPP, s+BPP+src->stride, src->x-2);
+         memcpy(d+(src->x-1)*BPP, s+(src->x-1)*BPP, BPP);
+      }
+   }
+   return NULL;
+}
+
+// sharpen 'src' into 'dest' (which must be the same size). this is the
+// last step of upsampling, so it writes straight into the final image
+// rather than sharpening in place and then copying it there. it works
+// from an untouched source, so it can be split into tiles for any width.
+void do_sharpen(Image *dest, Image *src)
+{
+   sharpen_work.dest = dest;
+   sharpen_work.src  = src;
+   resize_run_tiles((stb_thread_func) do_sharpen_work, resize_num_tiles(src->y));
+}
+
+Image *grScaleBitmap(Image *src, int gx, int gy, Image *dest)
+{
+   Image *to_free, *res;
+   int upsample=FALSE;
+   to_free = NULL;
+
+   // check if we're scaling up
+   if (gx > src->x || gy > src->y)  {
+      upsample = TRUE;
+   } else {
+      // current biggest problem perf-wise is on scaling down, we don't
+      // use threads
+
+      // maybe should do something smarter here, like find the
+      // nearest box size, instead of repetitive powers of two
+      while (gx <= (src->x >> 1) && gy <= (src->y >> 1)) {
+         src = downsample_half(src);
+         if (to_free) imfree(to_free);
+         to_free = src;
+         if (resize_abandon) {
+            imfree(to_free);
+            return NULL;
+         }
+      }
+
+      if (gx < src->x * 0.666666f && gy < src->y * 0.666666f) {
+         src = downsample_two_thirds(src);
+         if (to_free) imfree(to_free);
+         to_free = src;
+      }
+   }
+
+   if (gx == src->x && gy == src->y) {
+      if (to_free)
+         res = src;
+      else {
+         res = bmp_alloc(src->x, src->y);
+         memcpy(res->pixels, src->pixels, res->y * res->stride);
+         return res;
+      }
+   } else if (upsample ? upsample_cubic : downsample_cubic) {
+      // sharpening is done from a copy, into dest; if there's no memory
+      // for the copy, resize straight into dest and don't sharpen
+      res = (upsample && sharpen) ? bmp_alloc(gx, gy) : NULL;
+      // and if there's no memory for cubic, at least show something
+      if (!cubic_resize(res ? res : dest, src))
+         image_resize_bilinear(res ? res : dest, src);
+      if (to_free) imfree(to_free);
+    } else {
+      #if 1
+      image_resize_bilinear(dest, src);
+      if (to_free) imfree(to_free);
+      res = NULL;
+      #else
+      res = grScaleBitmapX(src, gx);
+      if (to_free) imfree(to_free);
+      to_free = res;
+      res = grScaleBitmapY(res, gy);
+      imfree(to_free);
+      #endif
+   }
+   if (res && upsample && sharpen && !resize_abandon) {
+      do_sharpen(dest, res);
+      imfree(res);
+      res = NULL;
+   }
+   return res;
+}
+#endif // BPP==4
+
+void image_resize(Image *dest, Image *src)
+{
+#if BPP==3
+   image_resize_bilinear(dest, src);
+#else
+   int j;
+   Image *temp;
+   temp = grScaleBitmap(src, dest->x, dest->y, dest);
+   if (temp && resize_abandon) {
+      imfree(temp);
+   } else if (temp) {
+      for (j=0; j < dest->y; ++j)
+         memcpy(dest->pixels + j*dest->stride, temp->pixels + j*temp->stride, BPP*dest->x);
+      imfree(temp);
+   }
+#endif
+}
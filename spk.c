@@ -0,0 +1,369 @@
+/*  spk -- writes .spk delta images for imv
+ *
+ *  usage: spk [options] base frame...
+ *
+ *  Each frame is written as a .spk which stores only the pixels that differ
+ *  from the base, e.g. for a render sequence where most of every frame is
+ *  the same. The format is described above spk_decode() in imv.c; imv
+ *  decodes what we write back to exactly the pixels stb_image gives for
+ *  the frame.
+ *
+ *    -1       write v1 (a flat list of runs) instead of v2 (compressed tiles)
+ *    -t n     v2 tile size, 1..256 (default 64)
+ *    -j n     number of threads (default one per processor)
+ *    -o dir   write the .spk files to dir instead of next to each frame
+ *
+ *  Compile it the same way as imv.c, e.g. "cl /O2 /MT spk.c"
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#define STB_DEFINE
+#include "stb.h"          /*     http://nothings.org/stb.h         */
+
+#define STBI_NO_WRITE
+#include "stb_image.c"    /*     http://nothings.org/stb_image.c   */
+
+#define SPK_MAX_TILE   256  // must match imv.c
+
+int version = 2;
+int tile_size = 64;
+char *out_dir;
+
+// the base is decoded once and shared, read-only, by every frame. frames
+// are always decoded to 4 components too, since that's what imv asks for,
+// and only stored with 4 if the alpha actually changes
+uint8 *base;
+int base_x, base_y;
+char *base_name;
+
+// stb_compress() keeps its state in globals, so only one thread at a time
+// can be in it; decoding and diffing (most of the work for a typical
+// frame) still runs in parallel
+stb_mutex compress_lock;
+
+typedef struct
+{
+   char *name;
+   volatile int ok;
+} Frame;
+
+static void error(char *name, char *fmt, ...)
+{
+   char buffer[1024];
+   va_list v;
+   va_start(v,fmt);
+   vsprintf(buffer, fmt, v);
+   va_end(v);
+   fprintf(stderr, "%s: %s\n", name, buffer);
+}
+
+static void put(uint8 **out, void *data, int len)
+{
+   memcpy(stb_arr_addn(*out, len), data, len);
+}
+
+static void put_int(uint8 **out, int v)
+{
+   put(out, &v, 4);
+}
+
+// the bits of a pixel that are stored with c components
+static uint32 pixel_mask(int c)
+{
+   uint32 mask = 0xffffffff;
+   if (c == 3) ((uint8 *) &mask)[3] = 0;
+   return mask;
+}
+
+// a word at a time, since that's a whole pixel; the usual case is
+// that nothing has changed, so this is all most rows ever do
+static int row_differs(uint32 *p, uint32 *q, int n, uint32 mask)
+{
+   int i;
+   for (i=0; i < n; ++i)
+      if ((p[i] ^ q[i]) & mask)
+         return TRUE;
+   return FALSE;
+}
+
+static int alpha_differs(uint32 *p, uint32 *q, int n)
+{
+   return row_differs(p, q, n, ~pixel_mask(3));
+}
+
+// imv looks for the base relative to the directory the .spk is in, so
+// that's how we have to name it
+static int relative_name(char *out, int size, char *path, char *spk)
+{
+   char full_path[1024], full_spk[1024];
+   int i, common = -1, n = 0;
+   if (!stb_fullpath(full_path, sizeof(full_path), path)) return FALSE;
+   if (!stb_fullpath(full_spk , sizeof(full_spk ), spk )) return FALSE;
+   stb_fixpath(full_path);
+   stb_fixpath(full_spk);
+
+   // find the last directory they have in common
+   for (i=0; full_path[i] && tolower(full_path[i]) == tolower(full_spk[i]); ++i)
+      if (full_path[i] == '/')
+         common = i;
+   if (common < 0)
+      return FALSE;  // different drives
+
+   // go up out of the rest of the .spk's directories, then down to the base
+   out[0] = 0;
+   for (i=common+1; full_spk[i]; ++i) {
+      if (full_spk[i] == '/') {
+         if (n + 3 >= size) return FALSE;
+         strcpy(out+n, "../");
+         n += 3;
+      }
+   }
+   if (n + (int) strlen(full_path+common+1) >= size) return FALSE;
+   strcpy(out+n, full_path+common+1);
+   return TRUE;
+}
+
+static void put_header(uint8 **out, char version_char, char *name, int c)
+{
+   int namelen = strlen(name)+1;
+   put(out, &version_char, 1);
+   put(out, "PIC-delta-image", 16);
+   put_int(out, namelen);
+   put(out, name, namelen);
+   put_int(out, base_x);
+   put_int(out, base_y);
+   put_int(out, c);
+}
+
+// v1: every run of changed pixels, with the frame's pixels. runs are
+// merged across short gaps, since the unchanged pixels are cheaper to
+// store than the start and count of another run
+static void encode_runs(uint8 **out, uint32 *frame, int c)
+{
+   int total = base_x * base_y;
+   int gap = 8 / c;
+   uint32 mask = pixel_mask(c);
+   uint32 *b = (uint32 *) base;
+   int i,j,s,e;
+
+   for (s=0; s < total; s = e) {
+      while (s < total && !((frame[s] ^ b[s]) & mask))
+         ++s;
+      if (s == total)
+         break;
+      for (e = s+1; e < total; ++e) {
+         if (!((frame[e] ^ b[e]) & mask)) {
+            // see if there's another change before the gap gets too long
+            for (j=e+1; j < total && j <= e+gap; ++j)
+               if ((frame[j] ^ b[j]) & mask)
+                  break;
+            if (j >= total || j > e+gap)
+               break;
+            e = j;
+         }
+      }
+      put_int(out, s);
+      put_int(out, e-s);
+      for (i=s; i < e; ++i)
+         put(out, frame+i, c);
+   }
+}
+
+// v2: XOR each changed tile with the base and compress it
+static int encode_tiles(uint8 **out, uint32 *frame, int c)
+{
+   int across = (base_x + tile_size-1) / tile_size;
+   int down   = (base_y + tile_size-1) / tile_size;
+   int maxlen = tile_size * tile_size * c;
+   uint8 *buf  = malloc(maxlen);
+   uint8 *comp = malloc(maxlen + 512 + (maxlen >> 2));  // as stb_compress_tofile()
+   uint8 *data = NULL;
+   uint32 *index = NULL, crc;
+   uint32 mask = pixel_mask(c);
+   uint32 *b = (uint32 *) base;
+   int t,i,j,k, num, header;
+
+   if (buf == NULL || comp == NULL) {
+      free(buf);
+      free(comp);
+      return FALSE;
+   }
+
+   for (t=0; t < across*down; ++t) {
+      int x0 = (t % across) * tile_size;
+      int y0 = (t / across) * tile_size;
+      int w = stb_min(tile_size, base_x - x0);
+      int h = stb_min(tile_size, base_y - y0);
+      int len;
+      uint8 *q = buf;
+      for (j=0; j < h; ++j)
+         if (row_differs(frame + (y0+j)*base_x + x0, b + (y0+j)*base_x + x0, w, mask))
+            break;
+      if (j == h)
+         continue;
+      for (j=0; j < h; ++j) {
+         uint8 *p = (uint8 *) (frame + (y0+j)*base_x + x0);
+         uint8 *r = (uint8 *) (b     + (y0+j)*base_x + x0);
+         for (i=0; i < w; ++i, p += 4, r += 4)
+            for (k=0; k < c; ++k)
+               *q++ = p[k] ^ r[k];
+      }
+      stb_mutex_begin(compress_lock);
+      len = stb_compress(comp, buf, w*h*c);
+      stb_mutex_end(compress_lock);
+      stb_arr_push(index, t);
+      stb_arr_push(index, stb_arr_len(data));  // made absolute below
+      stb_arr_push(index, len);
+      put(&data, comp, len);
+   }
+   free(buf);
+   free(comp);
+
+   num = stb_arr_len(index) / 3;
+   header = stb_arr_len(*out) + 4*4 + num*12;
+   for (i=0; i < num; ++i)
+      index[i*3+1] += header;
+   crc = stb_crc32((uint8 *) index, num*12);
+
+   put_int(out, tile_size);
+   put_int(out, tile_size);
+   put_int(out, num);
+   put(out, &crc, 4);
+   put(out, index, num*12);
+   put(out, data, stb_arr_len(data));
+   stb_arr_free(index);
+   stb_arr_free(data);
+   return TRUE;
+}
+
+static void *encode_frame(void *p)
+{
+   Frame *f = (Frame *) p;
+   char spk[1024], name[1024];
+   uint32 *frame;
+   uint8 *out = NULL;
+   int x,y,n,c;
+
+   if (out_dir) {
+      if (strlen(out_dir) + strlen(f->name) + 8 >= sizeof(spk)) {
+         error(f->name, "path too long");
+         return NULL;
+      }
+      sprintf(spk, "%s/", out_dir);
+      stb_splitpath(spk + strlen(spk), f->name, STB_FILE);
+   } else {
+      if (strlen(f->name) + 8 >= sizeof(spk)) {
+         error(f->name, "path too long");
+         return NULL;
+      }
+      stb_splitpath(spk, f->name, STB_PATH_FILE);
+   }
+   strcat(spk, ".spk");
+
+   if (!relative_name(name, sizeof(name), base_name, spk)) {
+      error(f->name, "can't name %s relative to %s", base_name, spk);
+      return NULL;
+   }
+
+   frame = (uint32 *) stbi_load(f->name, &x, &y, &n, 4);
+   if (frame == NULL) {
+      error(f->name, "%s", stbi_failure_reason());
+      return NULL;
+   }
+   if (x != base_x || y != base_y) {
+      error(f->name, "is %dx%d, but the base is %dx%d", x,y, base_x, base_y);
+      free(frame);
+      return NULL;
+   }
+
+   c = alpha_differs(frame, (uint32 *) base, x*y) ? 4 : 3;
+
+   put_header(&out, version == 2 ? '2' : 's', name, c);
+   if (version == 2) {
+      if (!encode_tiles(&out, frame, c)) {
+         error(f->name, "out of memory");
+         free(frame);
+         stb_arr_free(out);
+         return NULL;
+      }
+   } else
+      encode_runs(&out, frame, c);
+   free(frame);
+
+   if (!stb_filewrite(spk, out, stb_arr_len(out)))
+      error(spk, "couldn't write");
+   else
+      f->ok = TRUE;
+   stb_arr_free(out);
+   return NULL;
+}
+
+static void usage(void)
+{
+   fprintf(stderr, "usage: spk [-1] [-t tile_size] [-j threads] [-o dir] base frame...\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   Frame *frames;
+   int threads = stb_processor_count();
+   int i, n, failed=0;
+
+   for (i=1; i < argc && argv[i][0] == '-'; ++i) {
+      if (!strcmp(argv[i], "-1"))
+         version = 1;
+      else if (!strcmp(argv[i], "-t") && i+1 < argc)
+         tile_size = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-j") && i+1 < argc)
+         threads = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-o") && i+1 < argc)
+         out_dir = argv[++i];
+      else
+         usage();
+   }
+   if (argc - i < 2 || tile_size < 1 || tile_size > SPK_MAX_TILE)
+      usage();
+   if (threads < 1) threads = 1;
+
+   base_name = argv[i++];
+   base = stbi_load(base_name, &base_x, &base_y, &n, 4);
+   if (base == NULL) {
+      error(base_name, "%s", stbi_failure_reason());
+      return 1;
+   }
+
+   n = argc - i;
+   frames = (Frame *) malloc(sizeof(*frames) * n);
+   for (i=0; i < n; ++i) {
+      frames[i].name = argv[argc-n+i];
+      frames[i].ok = FALSE;
+   }
+
+   compress_lock = stb_mutex_new();
+   if (threads == 1 || n == 1) {
+      for (i=0; i < n; ++i)
+         encode_frame(&frames[i]);
+   } else {
+      // one task per frame; we help out while we wait for them all
+      stb_workqueue *q = stb_workq_new(threads-1, n);
+      stb_sync done = stb_sync_new();
+      stb_sync_set_target(done, n+1);
+      for (i=0; i < n; ++i) {
+         if (!stb_workq_reach(q, encode_frame, &frames[i], NULL, done)) {
+            encode_frame(&frames[i]);
+            stb_sync_reach(done);
+         }
+      }
+      stb_sync_reach_and_help(done, q);
+   }
+
+   for (i=0; i < n; ++i)
+      if (!frames[i].ok)
+         ++failed;
+   if (failed)
+      fprintf(stderr, "%d of %d frames failed\n", failed, n);
+   return failed != 0;
+}
@@ -1,4 +1,4 @@
-/* stb-2.02 - Sean's Tool Box -- public domain -- http://nothings.org/stb.h
+/* stb-2.09 - Sean's Tool Box -- public domain -- http://nothings.org/stb.h
           no warranty is offered or implied; use this code at your own risk
 
    This is a single header file with a bunch of useful utilities
@@ -28,6 +28,15 @@
 
 Version History
 
+   2.09   threads on pthreads (unix/OS X); stb_cfg builds off Windows
+   2.08   stb_fullpath: test whether 'rel' is absolute, not the output buffer
+   2.07   stb_decompress: reentrant; validates input instead of asserting
+   2.06   stb_arr_insertn/deleten: fix growing and moving the wrong count
+   2.05   stb_readdir: use d_type instead of opendir() per entry; fast
+          filtering for "*.ext;*.ext" masks; thread-safe
+   2.04   stb_ring--lock-free bounded SPSC/MPMC queue; stb_atomic_cas/add
+   2.03   stb_workq uses per-thread deques with work stealing;
+          stb_sync_reach_and_help runs pending work while waiting
    2.02   remove integrated documentation
    2.01   integrate various fixes; stb_force_uniprocessor
    2.00   revised stb_dupe to use multiple hashes
@@ -2880,7 +2889,7 @@ void *stb__arr_insertn_(void *p, int size, int i, int n  STB__PARAMS)
          return stb__arr_addlen_(p, size, n  STB__ARGS);
 
       z = stb_arr_len2(p);
-      p = stb__arr_addlen_(p, size, i  STB__ARGS);
+      p = stb__arr_addlen_(p, size, n  STB__ARGS);
       memmove((char *) p + (i+n)*size, (char *) p + i*size, size * (z-i));
    }
    return p;
@@ -2889,7 +2898,7 @@ void *stb__arr_insertn_(void *p, int size, int i, int n  STB__PARAMS)
 void *stb__arr_deleten_(void *p, int size, int i, int n  STB__PARAMS)
 {
    if (n) {
-      memmove((char *) p + i*size, (char *) p + (i+n)*size, size * (stb_arr_len2(p)-i));
+      memmove((char *) p + i*size, (char *) p + (i+n)*size, size * (stb_arr_len2(p)-i-n));
       stb_arrhead2(p)->len -= n;
    }
    return p;
@@ -4347,7 +4356,7 @@ int stb_fullpath(char *abs, int abs_size, char *rel)
    #ifdef _MSC_VER
    return _fullpath(abs, rel, abs_size) != NULL;
    #else
-   if (abs[0] == '/' || abs[0] == '~') {
+   if (rel[0] == '/' || rel[0] == '~') {
       if ((int) strlen(rel) >= abs_size)
          return 0;
       strcpy(abs,rel);
@@ -4883,6 +4892,7 @@ STB_EXTERN void stb_delete_directory_recursive(char *dir);
 #else
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #endif
 
 void stb_readdir_free(char **files)
@@ -4894,16 +4904,71 @@ void stb_readdir_free(char **files)
    stb_arr_free(f2);
 }
 
+// masks are almost always a list of extensions, like "*.jpg;*.png", and
+// running the full wildcard matcher on every name in a big directory adds
+// up, so for those we just hash the extension and look it up
+#define STB__READDIR_EXTS  32
+typedef struct
+{
+   int count;
+   unsigned int hash[STB__READDIR_EXTS];
+   char ext[STB__READDIR_EXTS][16];
+} stb__readdir_extset;
+
+// returns 0 if the mask isn't a plain list of extensions
+static int stb__readdir_extset_build(stb__readdir_extset *set, char *mask)
+{
+   set->count = 0;
+   for(;;) {
+      int n=0;
+      if (mask[0] != '*' || mask[1] != '.') return 0;
+      mask += 2;
+      while (*mask && *mask != ';') {
+         if (*mask == '*' || *mask == '?' || *mask == '.' || n == 15) return 0;
+         set->ext[set->count][n++] = tolower(*mask++);
+      }
+      if (n == 0 || set->count == STB__READDIR_EXTS) return 0;
+      set->ext[set->count][n] = 0;
+      set->hash[set->count] = stb_hash(set->ext[set->count]);
+      ++set->count;
+      if (*mask == 0) return 1;
+      ++mask;
+   }
+}
+
+static int stb__readdir_extset_match(stb__readdir_extset *set, char *name)
+{
+   char ext[16];
+   unsigned int h;
+   int i;
+   char *s = strrchr(name, '.');
+   if (s == NULL) return 0;
+   for (i=0; s[i+1]; ++i) {
+      if (i == 15) return 0;
+      ext[i] = tolower(s[i+1]);
+   }
+   ext[i] = 0;
+   h = stb_hash(ext);
+   for (i=0; i < set->count; ++i)
+      if (set->hash[i] == h && !strcmp(set->ext[i], ext))
+         return 1;
+   return 0;
+}
+
 STB_EXTERN int stb_wildmatchi(char *expr, char *candidate);
 static double stb_readdir_size;
 static char **readdir_raw(char *dir, int return_subdirs, char *mask)
 {
    STB__ARR(char *) results = NULL;
    char buffer[512], with_slash[512];
-   int n;
+   stb__readdir_extset exts;
+   int n, use_exts = mask && stb__readdir_extset_build(&exts, mask);
 
    #ifdef _MSC_VER
-      stb__wchar *ws;
+      // use our own utf8 buffers rather than the static ones in
+      // stb__from_utf8/stb__to_utf8, so we can read dirs on several threads
+      stb__wchar *ws, wbuffer[1024];
+      char name_utf8[1024];
       struct _wfinddata_t data;
       const long none = -1;
       long z;
@@ -4924,8 +4989,8 @@ static char **readdir_raw(char *dir, int return_subdirs, char *mask)
 
    #ifdef _MSC_VER
       strcpy(buffer+n, "*.*");
-      ws = stb__from_utf8(buffer);
-      z = _wfindfirst(ws, &data);
+      ws = stb_from_utf8(wbuffer, buffer, 1024);
+      z = ws ? _wfindfirst(ws, &data) : none;
    #else
       z = opendir(dir);
    #endif
@@ -4943,7 +5008,7 @@ static char **readdir_raw(char *dir, int return_subdirs, char *mask)
          do {
             int is_subdir;
             #ifdef _MSC_VER
-            char *name = stb__to_utf8(data.name);
+            char *name = stb_to_utf8(name_utf8, data.name, 1024);
             if (name == NULL) {
                printf("Unable to convert '%S' to utf8!\n", data.name);
                continue;
@@ -4951,15 +5016,27 @@ static char **readdir_raw(char *dir, int return_subdirs, char *mask)
             is_subdir = !!(data.attrib & _A_SUBDIR);
             #else
             char *name = data->d_name;
-            strcpy(buffer+n,name);
-            DIR *y = opendir(buffer);
-            is_subdir = (y != NULL);
-            if (y != NULL) closedir(y);
+            #ifdef DT_DIR
+            // the directory entry usually tells us, without touching the
+            // entry itself; symlinks (and some filesystems) need a stat
+            if (data->d_type != DT_UNKNOWN && data->d_type != DT_LNK)
+               is_subdir = (data->d_type == DT_DIR);
+            else
+            #endif
+            {
+               struct stat st;
+               #ifdef AT_FDCWD
+               is_subdir = !fstatat(dirfd(z), name, &st, 0) && S_ISDIR(st.st_mode);
+               #else
+               strcpy(buffer+n,name);
+               is_subdir = !stat(buffer, &st) && S_ISDIR(st.st_mode);
+               #endif
+            }
             #endif
         
             if (is_subdir == return_subdirs) {
                if (!is_subdir || name[0] != '.') {
-                  if (!mask || stb_wildmatchi(mask, name)) {
+                  if (!mask || (use_exts ? stb__readdir_extset_match(&exts, name) : stb_wildmatchi(mask, name))) {
                      char buffer[512],*p=buffer;
                      sprintf(buffer, "%s%s", with_slash, name);
                      if (buffer[0] == '.' && buffer[1] == '/')
@@ -5581,12 +5658,14 @@ STB_EXTERN stb_cfg * stb_cfg_open(char *config, char *mode)
    void *reg;
    if (mode[0] != 'r' && mode[0] != 'w') return NULL;
 
-   reg = stb_reg_open("rHKLM", "Software\\SilverSpaceship\\stb");
    strcpy(file, "c:/stb");
+   #ifdef _WIN32
+   reg = stb_reg_open("rHKLM", "Software\\SilverSpaceship\\stb");
    if (reg) {
       stb_reg_read_string(reg, "config_dir", file, sizeof(file));
       stb_reg_close(reg);
    }
+   #endif
 
    strcat(file, "/");
    strcat(file, config);
@@ -5646,7 +5725,7 @@ int stb_cfg_read(stb_cfg *z, char *key, void *value, int len)
 {
    int i;
    for (i=0; i < stb_arr_len(z->data); ++i) {
-      if (!stricmp(z->data[i].key, key)) {
+      if (!stb_stricmp(z->data[i].key, key)) {
          int n = stb_min(len, z->data[i].value_len);
          memcpy(value, z->data[i].value, n);
          if (n < len)
@@ -5661,7 +5740,7 @@ void stb_cfg_write(stb_cfg *z, char *key, void *value, int len)
 {
    int i;
    for (i=0; i < stb_arr_len(z->data); ++i)
-      if (!stricmp(z->data[i].key, key))
+      if (!stb_stricmp(z->data[i].key, key))
          break;
    if (i == stb_arr_len(z->data)) {
       stb__cfg_item p;
@@ -5679,7 +5758,7 @@ int stb_cfg_delete(stb_cfg *z, char *key)
 {
    int i;
    for (i=0; i < stb_arr_len(z->data); ++i)
-      if (!stricmp(z->data[i].key, key)) {   
+      if (!stb_stricmp(z->data[i].key, key)) {   
          stb_arr_fastdelete(z->data, i);
          return 1;
       }
@@ -8975,83 +9054,88 @@ stb_uint stb_decompress_length(stb_uchar *input)
 
 ////////////////////           decompressor         ///////////////////////
 
-// simple implementation that just writes whole thing into big block
+// simple implementation that just writes whole thing into big block.
+// the state lives on the stack, so several threads can decompress at once
 
-static unsigned char *stb__barrier;
-static unsigned char *stb__barrier2;
-static unsigned char *stb__barrier3;
-static unsigned char *stb__barrier4;
+typedef struct
+{
+   stb_uchar *dout;
+   stb_uchar *barrier;   // end of output
+   stb_uchar *barrier2;  // start of input
+   stb_uchar *barrier3;  // end of input
+   stb_uchar *barrier4;  // start of output
+} stb__dctx;
 
-static stb_uchar *stb__dout;
-static void stb__match(stb_uchar *data, stb_uint length)
+// on bad data, these push dout past the end, which stb_decompress() checks
+static void stb__match(stb__dctx *z, stb_uchar *data, stb_uint length)
 {
    // INVERSE of memmove... write each byte before copying the next...
-   assert (stb__dout + length <= stb__barrier);
-   if (stb__dout + length > stb__barrier) { stb__dout += length; return; }
-   if (data < stb__barrier4) { stb__dout = stb__barrier+1; return; }
-   while (length--) *stb__dout++ = *data++;
+   if (z->dout + length > z->barrier) { z->dout = z->barrier+1; return; }
+   if (data < z->barrier4) { z->dout = z->barrier+1; return; }
+   while (length--) *z->dout++ = *data++;
 }
 
-static void stb__lit(stb_uchar *data, stb_uint length)
+static void stb__lit(stb__dctx *z, stb_uchar *data, stb_uint length)
 {
-   assert (stb__dout + length <= stb__barrier);
-   if (stb__dout + length > stb__barrier) { stb__dout += length; return; }
-   if (data < stb__barrier2) { stb__dout = stb__barrier+1; return; }
-   memcpy(stb__dout, data, length);
-   stb__dout += length;
+   if (z->dout + length > z->barrier) { z->dout = z->barrier+1; return; }
+   if (data < z->barrier2 || data + length > z->barrier3) { z->dout = z->barrier+1; return; }
+   memcpy(z->dout, data, length);
+   z->dout += length;
 }
 
 #define stb__in2(x)   ((i[x] << 8) + i[(x)+1])
 #define stb__in3(x)   ((i[x] << 16) + stb__in2((x)+1))
 #define stb__in4(x)   ((i[x] << 24) + stb__in3((x)+1))
 
-static stb_uchar *stb_decompress_token(stb_uchar *i)
+static stb_uchar *stb_decompress_token(stb__dctx *z, stb_uchar *i)
 {
    if (*i >= 0x20) { // use fewer if's for cases that expand small
-      if (*i >= 0x80)       stb__match(stb__dout-i[1]-1, i[0] - 0x80 + 1), i += 2;
-      else if (*i >= 0x40)  stb__match(stb__dout-(stb__in2(0) - 0x4000 + 1), i[2]+1), i += 3;
-      else /* *i >= 0x20 */ stb__lit(i+1, i[0] - 0x20 + 1), i += 1 + (i[0] - 0x20 + 1);
+      if (*i >= 0x80)       stb__match(z, z->dout-i[1]-1, i[0] - 0x80 + 1), i += 2;
+      else if (*i >= 0x40)  stb__match(z, z->dout-(stb__in2(0) - 0x4000 + 1), i[2]+1), i += 3;
+      else /* *i >= 0x20 */ stb__lit(z, i+1, i[0] - 0x20 + 1), i += 1 + (i[0] - 0x20 + 1);
    } else { // more ifs for cases that expand large, since overhead is amortized
-      if (*i >= 0x18)       stb__match(stb__dout-(stb__in3(0) - 0x180000 + 1), i[3]+1), i += 4;
-      else if (*i >= 0x10)  stb__match(stb__dout-(stb__in3(0) - 0x100000 + 1), stb__in2(3)+1), i += 5;
-      else if (*i >= 0x08)  stb__lit(i+2, stb__in2(0) - 0x0800 + 1), i += 2 + (stb__in2(0) - 0x0800 + 1);
-      else if (*i == 0x07)  stb__lit(i+3, stb__in2(1) + 1), i += 3 + (stb__in2(1) + 1);
-      else if (*i == 0x06)  stb__match(stb__dout-(stb__in3(1)+1), i[4]+1), i += 5;
-      else if (*i == 0x04)  stb__match(stb__dout-(stb__in3(1)+1), stb__in2(4)+1), i += 6;
+      if (*i >= 0x18)       stb__match(z, z->dout-(stb__in3(0) - 0x180000 + 1), i[3]+1), i += 4;
+      else if (*i >= 0x10)  stb__match(z, z->dout-(stb__in3(0) - 0x100000 + 1), stb__in2(3)+1), i += 5;
+      else if (*i >= 0x08)  stb__lit(z, i+2, stb__in2(0) - 0x0800 + 1), i += 2 + (stb__in2(0) - 0x0800 + 1);
+      else if (*i == 0x07)  stb__lit(z, i+3, stb__in2(1) + 1), i += 3 + (stb__in2(1) + 1);
+      else if (*i == 0x06)  stb__match(z, z->dout-(stb__in3(1)+1), i[4]+1), i += 5;
+      else if (*i == 0x04)  stb__match(z, z->dout-(stb__in3(1)+1), stb__in2(4)+1), i += 6;
    }
    return i;
 }
 
 stb_uint stb_decompress(stb_uchar *output, stb_uchar *i, stb_uint length)
 {
+   stb__dctx z;
    stb_uint olen;
+   if (length < 16 + 6)           return 0;
    if (stb__in4(0) != 0x57bC0000) return 0;
    if (stb__in4(4) != 0)          return 0; // error! stream is > 4GB
    olen = stb_decompress_length(i);
-   stb__barrier2 = i;
-   stb__barrier3 = i+length;
-   stb__barrier = output + olen;
-   stb__barrier4 = output;
+   z.barrier2 = i;
+   z.barrier3 = i+length;
+   z.barrier = output + olen;
+   z.barrier4 = output;
    i += 16;
 
-   stb__dout = output;
+   z.dout = output;
    while (1) {
       stb_uchar *old_i = i;
-      i = stb_decompress_token(i);
+      // every token (and the 6-byte trailer) fits before the end
+      if (i + 6 > z.barrier3)
+         return 0;
+      i = stb_decompress_token(&z, i);
       if (i == old_i) {
          if (*i == 0x05 && i[1] == 0xfa) {
-            assert(stb__dout == output + olen);
-            if (stb__dout != output + olen) return 0;
+            if (z.dout != output + olen) return 0;
             if (stb_adler32(1, output, olen) != (stb_uint) stb__in4(2))
                return 0;
             return olen;
          } else {
-            assert(0); /* NOTREACHED */
-            return 0;
+            return 0; // bad token
          }
       }
-      assert(stb__dout <= output + olen); 
-      if (stb__dout > output + olen)
+      if (z.dout > output + olen)
          return 0;
    }
 }
@@ -9616,7 +9700,7 @@ void stb_compress_stream_end(int close)
 
 
 
-#ifndef WIN32
+#if !defined(_WIN32) && !defined(__unix__) && !defined(__APPLE__)
 #define STB_NO_THREADS
 #endif
 
@@ -9664,6 +9748,11 @@ STB_EXTERN int           stb_work_reach(stb_thread_func f, void *d, volatile voi
 // necessary to call this when using volatile to order writes/reads
 STB_EXTERN void          stb_barrier(void);
 
+// atomic operations on 32-bit values (with a full barrier); both return
+// the value *p had before the operation
+STB_EXTERN long          stb_atomic_cas(volatile long *p, long xchg, long comparand);
+STB_EXTERN long          stb_atomic_add(volatile long *p, long v);
+
 // support for independent queues with their own threads
 
 typedef struct stb__workqueue stb_workqueue;
@@ -9675,6 +9764,9 @@ STB_EXTERN void          stb_workq_numthreads(stb_workqueue *q, int n);
 STB_EXTERN int           stb_workq(stb_workqueue *q, stb_thread_func f, void *d, volatile void **return_code);
 STB_EXTERN int           stb_workq_reach(stb_workqueue *q, stb_thread_func f, void *d, volatile void **return_code, stb_sync rel);
 STB_EXTERN int           stb_workq_length(stb_workqueue *q);
+// run one queued piece of work that reaches 'rel' on this thread, if any is
+// still queued; returns FALSE if there was none
+STB_EXTERN int           stb_workq_help(stb_workqueue *q, stb_sync rel);
 
 STB_EXTERN stb_thread    stb_create_thread (stb_thread_func f, void *d);
 STB_EXTERN stb_thread    stb_create_thread2(stb_thread_func f, void *d, volatile void **return_code, stb_semaphore rel);
@@ -9696,6 +9788,9 @@ STB_EXTERN void          stb_sync_delete(stb_sync s);
 STB_EXTERN int           stb_sync_set_target(stb_sync s, int count);
 STB_EXTERN void          stb_sync_reach_and_wait(stb_sync s);    // wait for 'target' reachers
 STB_EXTERN int           stb_sync_reach(stb_sync s);
+// as stb_sync_reach_and_wait, but while waiting run any work on 'q' that
+// reaches 's' which hasn't been started yet
+STB_EXTERN void          stb_sync_reach_and_help(stb_sync s, stb_workqueue *q);
 
 typedef struct stb__threadqueue stb_threadqueue;
 #define STB_THREADQ_DYNAMIC   0
@@ -9707,6 +9802,17 @@ STB_EXTERN int              stb_threadq_add(stb_threadqueue *tq, void *input);
 // can return FALSE if STB_THREADQ_DYNAMIC and attempt to grow fails
 STB_EXTERN int              stb_threadq_add_block(stb_threadqueue *tq, void *input);
 
+// lock-free bounded queue of pointers. if many_put and many_get are both
+// FALSE, only one thread may put and only one may get, which is cheaper;
+// otherwise any thread may do either. put and get never block or take a
+// lock; get_block sleeps on a semaphore, but only when the ring is empty.
+typedef struct stb__ring stb_ring;
+STB_EXTERN stb_ring *       stb_ring_new(int num_items, int many_put, int many_get);
+STB_EXTERN void             stb_ring_delete(stb_ring *r);
+STB_EXTERN int              stb_ring_put(stb_ring *r, void *item); // FALSE if full
+STB_EXTERN int              stb_ring_get(stb_ring *r, void **item); // FALSE if empty
+STB_EXTERN void *           stb_ring_get_block(stb_ring *r);
+
 #ifdef STB_DEFINE
 
 typedef struct
@@ -9775,6 +9881,50 @@ void stb_barrier(void)
    #endif
 }
 
+#if defined(_MSC_VER) && _MSC_VER >= 1300
+long __cdecl _InterlockedCompareExchange(long volatile *, long, long);
+long __cdecl _InterlockedExchangeAdd(long volatile *, long);
+#pragma intrinsic(_InterlockedCompareExchange)
+#pragma intrinsic(_InterlockedExchangeAdd)
+
+long stb_atomic_cas(volatile long *p, long xchg, long comparand)
+{
+   return _InterlockedCompareExchange(p, xchg, comparand);
+}
+
+long stb_atomic_add(volatile long *p, long v)
+{
+   return _InterlockedExchangeAdd(p, v);
+}
+#else
+// VC6 doesn't have the intrinsics, and the InterlockedCompareExchange
+// in its headers takes pointers, so just do it by hand
+long stb_atomic_cas(volatile long *p, long xchg, long comparand)
+{
+   long result;
+   __asm {
+      mov ecx, p
+      mov edx, xchg
+      mov eax, comparand
+      lock cmpxchg [ecx], edx
+      mov result, eax
+   }
+   return result;
+}
+
+long stb_atomic_add(volatile long *p, long v)
+{
+   long result;
+   __asm {
+      mov ecx, p
+      mov eax, v
+      lock xadd [ecx], eax
+      mov result, eax
+   }
+   return result;
+}
+#endif
+
 static void stb__thread_run(void *t)
 {
    void *res;
@@ -9932,6 +10082,170 @@ inline unsigned __int64 _InterlockedCompareExchange64(volatile unsigned __int64
     } 
 #endif // #if 0
 
+#else // !_WIN32
+
+// the same primitives on pthreads. a semaphore is a count under a mutex
+// and condition variable, since unnamed POSIX semaphores aren't
+// everywhere (e.g. OS X)
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct
+{
+   pthread_mutex_t mutex;
+   pthread_cond_t  cond;
+   int count, max_val;
+} stb__sem;
+
+void stb_barrier(void)
+{
+   __sync_synchronize();
+}
+
+long stb_atomic_cas(volatile long *p, long xchg, long comparand)
+{
+   return __sync_val_compare_and_swap(p, comparand, xchg);
+}
+
+long stb_atomic_add(volatile long *p, long v)
+{
+   return __sync_fetch_and_add(p, v);
+}
+
+static void *stb__thread_run(void *t)
+{
+   void *res;
+   stb__thread info = * (stb__thread *) t;
+   free(t);
+   res = info.f(info.d);
+   if (info.return_val)
+      *info.return_val = res;
+   if (info.sem != STB_SEMAPHORE_NULL)
+      stb_sem_release(info.sem);
+   return NULL;
+}
+
+static stb_thread stb_create_thread_raw(stb_thread_func f, void *d, volatile void **return_code, stb_semaphore rel)
+{
+   pthread_t id;
+   stb__thread *data = (stb__thread *) malloc(sizeof(*data));
+   if (!data) return NULL;
+   stb__threadmutex_init();
+   data->f = f;
+   data->d = d;
+   data->return_val = return_code;
+   data->sem = rel;
+   if (pthread_create(&id, NULL, stb__thread_run, data)) {
+      free(data);
+      return NULL;
+   }
+   pthread_detach(id);
+   // stb_thread is only ever compared against STB_THREAD_NULL (and
+   // stb_destroy_thread can't be supported anyway), so any non-NULL will do
+   return (stb_thread) data;
+}
+
+void stb_destroy_thread(stb_thread t)
+{
+   // there's no safe equivalent of TerminateThread
+   assert(0);
+}
+
+stb_semaphore stb_sem_new_extra(int maxv, int start)
+{
+   stb__sem *s = (stb__sem *) malloc(sizeof(*s));
+   if (!s) return NULL;
+   pthread_mutex_init(&s->mutex, NULL);
+   pthread_cond_init(&s->cond, NULL);
+   s->count = start;
+   s->max_val = maxv;
+   return s;
+}
+
+stb_semaphore stb_sem_new(int maxv)
+{
+   return stb_sem_new_extra(maxv, 0);
+}
+
+void stb_sem_delete(stb_semaphore p)
+{
+   stb__sem *s = (stb__sem *) p;
+   if (s) {
+      pthread_cond_destroy(&s->cond);
+      pthread_mutex_destroy(&s->mutex);
+      free(s);
+   }
+}
+
+void stb_sem_waitfor(stb_semaphore p)
+{
+   stb__sem *s = (stb__sem *) p;
+   pthread_mutex_lock(&s->mutex);
+   while (s->count == 0)
+      pthread_cond_wait(&s->cond, &s->mutex);
+   --s->count;
+   pthread_mutex_unlock(&s->mutex);
+}
+
+void stb_sem_release(stb_semaphore p)
+{
+   stb__sem *s = (stb__sem *) p;
+   pthread_mutex_lock(&s->mutex);
+   // like ReleaseSemaphore, releasing past the maximum does nothing
+   if (s->count < s->max_val) {
+      ++s->count;
+      pthread_cond_signal(&s->cond);
+   }
+   pthread_mutex_unlock(&s->mutex);
+}
+
+static void stb__thread_sleep(int ms)
+{
+   usleep(ms * 1000);
+}
+
+int stb_processor_count(void)
+{
+   long n = sysconf(_SC_NPROCESSORS_ONLN);
+   return n < 1 ? 1 : (int) n;
+}
+
+void stb_force_uniprocessor(void)
+{
+   // no portable way to set affinity; RDTSC is the caller's problem
+}
+
+#define STB_MUTEX_NATIVE
+void *stb_mutex_new(void)
+{
+   pthread_mutex_t *p = (pthread_mutex_t *) malloc(sizeof(*p));
+   if (p)
+      pthread_mutex_init(p, NULL);
+   return p;
+}
+
+void stb_mutex_delete(void *p)
+{
+   if (p) {
+      pthread_mutex_destroy((pthread_mutex_t *) p);
+      free(p);
+   }
+}
+
+void stb_mutex_begin(void *p)
+{
+   stb__wait(500);
+   if (p)
+      pthread_mutex_lock((pthread_mutex_t *) p);
+}
+
+void stb_mutex_end(void *p)
+{
+   if (p)
+      pthread_mutex_unlock((pthread_mutex_t *) p);
+   stb__wait(500);
+}
+
 #endif // _WIN32
 
 stb_thread stb_create_thread2(stb_thread_func f, void *d, volatile void **return_code, stb_semaphore rel)
@@ -10263,6 +10577,150 @@ error:
    return NULL;
 }
 
+// Lock-free ring. With a single producer and single consumer, each side
+// owns one index and only reads the other, so the barriers are all that's
+// needed. With many of either, each slot carries a sequence number which
+// says whether it's ready to be written or read on the current lap, and
+// the indices are claimed with compare-and-swap.
+typedef struct
+{
+   volatile long seq;
+   void *item;
+} stb__ringslot;
+
+struct stb__ring
+{
+   stb__ringslot *slot;
+   long mask;
+   int multi;
+   volatile long head;   // next slot to get
+   char pad[60];         // keep the indices on separate cache lines
+   volatile long tail;   // next slot to put
+   char pad2[60];
+   volatile long sleepers;
+   stb_semaphore avail;
+};
+
+stb_ring *stb_ring_new(int num_items, int many_put, int many_get)
+{
+   int i, n=1;
+   stb_ring *r = (stb_ring *) malloc(sizeof(*r));
+   if (r == NULL) return NULL;
+   while (n < num_items) n <<= 1;
+   r->slot = (stb__ringslot *) malloc(sizeof(*r->slot) * n);
+   r->avail = stb_sem_new(0x7fffffff);
+   if (r->slot == NULL || r->avail == STB_SEMAPHORE_NULL) {
+      free(r->slot);
+      stb_sem_delete(r->avail);
+      free(r);
+      return NULL;
+   }
+   for (i=0; i < n; ++i)
+      r->slot[i].seq = i;
+   r->mask = n-1;
+   r->multi = many_put || many_get;
+   r->head = r->tail = 0;
+   r->sleepers = 0;
+   return r;
+}
+
+void stb_ring_delete(stb_ring *r)
+{
+   if (r) {
+      stb_sem_delete(r->avail);
+      free(r->slot);
+      free(r);
+   }
+}
+
+int stb_ring_put(stb_ring *r, void *item)
+{
+   long pos = r->tail;
+   stb__ringslot *s;
+   if (!r->multi) {
+      if (pos - r->head > r->mask) return FALSE;
+      s = &r->slot[pos & r->mask];
+      s->item = item;
+      stb_barrier(); // item must be visible before the tail moves
+      r->tail = pos+1;
+   } else {
+      for(;;) {
+         long dif;
+         s = &r->slot[pos & r->mask];
+         dif = s->seq - pos;
+         if (dif == 0) {
+            if (stb_atomic_cas(&r->tail, pos+1, pos) == pos)
+               break;
+            pos = r->tail;
+         } else if (dif < 0)
+            return FALSE; // the consumer hasn't freed this slot from the last lap
+         else
+            pos = r->tail; // someone else got it, catch up
+      }
+      s->item = item;
+      stb_barrier();
+      s->seq = pos+1;
+   }
+   // the barrier orders the put against reading 'sleepers'; a getter
+   // increments sleepers before its last check, so one of us sees the other
+   stb_barrier();
+   if (r->sleepers)
+      stb_sem_release(r->avail);
+   return TRUE;
+}
+
+int stb_ring_get(stb_ring *r, void **item)
+{
+   long pos = r->head;
+   stb__ringslot *s;
+   if (!r->multi) {
+      if (pos == r->tail) return FALSE;
+      s = &r->slot[pos & r->mask];
+      stb_barrier();
+      *item = s->item;
+      stb_barrier(); // finish reading before the producer can reuse it
+      r->head = pos+1;
+   } else {
+      for(;;) {
+         long dif;
+         s = &r->slot[pos & r->mask];
+         dif = s->seq - (pos+1);
+         if (dif == 0) {
+            if (stb_atomic_cas(&r->head, pos+1, pos) == pos)
+               break;
+            pos = r->head;
+         } else if (dif < 0)
+            return FALSE; // nothing put in this slot yet
+         else
+            pos = r->head;
+      }
+      *item = s->item;
+      stb_barrier();
+      s->seq = pos + r->mask + 1; // ready for the next lap's put
+   }
+   return TRUE;
+}
+
+void *stb_ring_get_block(stb_ring *r)
+{
+   void *item;
+   for(;;) {
+      if (stb_ring_get(r, &item))
+         return item;
+      stb_atomic_add(&r->sleepers, 1);
+      // check again now that putters can see us; otherwise we could miss a
+      // put that happened just before the increment
+      if (stb_ring_get(r, &item)) {
+         stb_atomic_add(&r->sleepers, -1);
+         return item;
+      }
+      // this can wake up spuriously if an earlier put released the
+      // semaphore after we'd already found its item, so loop
+      stb_sem_waitfor(r->avail);
+      stb_atomic_add(&r->sleepers, -1);
+   }
+}
+
 typedef struct
 {
    stb_thread_func f;
@@ -10273,24 +10731,154 @@ typedef struct
 
 static volatile stb__workinfo *stb__work;
 
+// each worker has its own deque; the owner takes from the bottom (the most
+// recently added work, which is most likely to still be in cache), while
+// idle workers steal from the top of other workers' deques. the deques are
+// locked individually, so workers only contend when they're actually stealing
+typedef struct
+{
+   stb_mutex lock;
+   stb__workinfo *items;  // ring buffer
+   int head, count, size; // head is the oldest item
+   int limit;             // max items, or 0 if growable
+   struct stb__workqueue *q;
+} stb__workdeque;
+
 struct stb__workqueue
 {
    int numthreads;
-   stb_threadqueue *tq;
+   int num_deques;
+   stb__workdeque *deque;
+   stb_semaphore avail;  // released once for each item added
+   int next_add;         // round-robin; races just make the distribution uneven
 };
 
+static int stb__workdeque_add(stb__workdeque *d, stb__workinfo *w)
+{
+   if (d->count == d->size) {
+      int i;
+      stb__workinfo *p;
+      if (d->limit) return FALSE;
+      p = (stb__workinfo *) malloc(sizeof(*p) * d->size * 2);
+      if (p == NULL) return FALSE;
+      for (i=0; i < d->count; ++i)
+         p[i] = d->items[(d->head + i) % d->size];
+      free(d->items);
+      d->items = p;
+      d->head = 0;
+      d->size *= 2;
+   }
+   d->items[(d->head + d->count) % d->size] = *w;
+   ++d->count;
+   return TRUE;
+}
+
+// remove the i'th item (0 is the top), shifting the ones below it up
+static void stb__workdeque_remove(stb__workdeque *d, int i, stb__workinfo *w)
+{
+   *w = d->items[(d->head + i) % d->size];
+   for (; i < d->count-1; ++i)
+      d->items[(d->head + i) % d->size] = d->items[(d->head + i+1) % d->size];
+   --d->count;
+}
+
+// take an item from deque 'd'; from the bottom if we own it, else from the
+// top. if 'sync' is non-NULL, only take work that reaches that sync
+static int stb__workdeque_take(stb__workdeque *d, stb__workinfo *w, int owner, stb_sync sync)
+{
+   int i, found = FALSE;
+   if (((volatile stb__workdeque *) d)->count == 0) return FALSE;
+   stb_mutex_begin(d->lock);
+   if (sync == STB_SYNC_NULL) {
+      if (d->count) {
+         stb__workdeque_remove(d, owner ? d->count-1 : 0, w);
+         found = TRUE;
+      }
+   } else {
+      // the helping thread's own work was just added, so look from the bottom
+      for (i=d->count-1; i >= 0; --i) {
+         if (d->items[(d->head + i) % d->size].sync == sync) {
+            stb__workdeque_remove(d, i, w);
+            found = TRUE;
+            break;
+         }
+      }
+   }
+   stb_mutex_end(d->lock);
+   return found;
+}
+
+// look in our own deque first, then try to steal from everybody else
+static int stb__workq_take(stb_workqueue *q, int home, stb__workinfo *w, stb_sync sync)
+{
+   int i;
+   for (i=0; i < q->num_deques; ++i) {
+      int n = (home + i) % q->num_deques;
+      if (stb__workdeque_take(&q->deque[n], w, i==0 && sync == STB_SYNC_NULL, sync))
+         return TRUE;
+   }
+   return FALSE;
+}
+
+static void stb__workq_run(stb__workinfo *w)
+{
+   void *z = w->f(w->d);
+   if (w->retval) { stb_barrier(); *w->retval = z; }
+   if (w->sync != STB_SYNC_NULL) stb_sync_reach(w->sync);
+}
+
 static void *stb__thread_workloop(void *p)
 {
-   volatile stb_workqueue *q = (volatile stb_workqueue *) p;
+   stb__workdeque *d = (stb__workdeque *) p;
+   stb_workqueue *q = d->q;
+   int home = d - q->deque;
    for(;;) {
-      void *z;
       stb__workinfo w;
-      stb_threadq_get_block(q->tq, &w);
+      stb_sem_waitfor(q->avail);
+      // a helping thread may have taken the item we were woken for
+      if (!stb__workq_take(q, home, &w, STB_SYNC_NULL))
+         continue;
       if (w.f == NULL) // null work is a signal to end the thread
          return NULL;
-      z = w.f(w.d);
-      if (w.retval) { stb_barrier(); *w.retval = z; }
-      if (w.sync != STB_SYNC_NULL) stb_sync_reach(w.sync);
+      stb__workq_run(&w);
+   }
+}
+
+int stb_workq_help(stb_workqueue *q, stb_sync sync)
+{
+   stb__workinfo w;
+   if (sync == STB_SYNC_NULL) return FALSE;
+   if (!stb__workq_take(q, 0, &w, sync))
+      return FALSE;
+   stb__workq_run(&w);
+   return TRUE;
+}
+
+void stb_sync_reach_and_help(stb_sync s, stb_workqueue *q)
+{
+   stb_mutex_begin(s->mutex);
+   assert(s->sofar < s->target);
+   ++s->sofar;
+   if (s->sofar == s->target) {
+      stb__sync_release(s);
+      stb_mutex_end(s->mutex);
+   } else {
+      ++s->waiting;
+      stb_mutex_end(s->mutex);
+
+      // rather than going to sleep, run any of the work we're waiting on
+      // that nobody has gotten to yet. once there's none left on the queue,
+      // we just wait for whoever is running the rest
+      while (((volatile struct stb__sync *) s)->sofar < s->target)
+         if (!stb_workq_help(q, s))
+            break;
+
+      stb_sem_waitfor(s->release);
+
+      stb_mutex_begin(s->mutex);
+      --s->waiting;
+      stb__sync_release(s);
+      stb_mutex_end(s->mutex);
    }
 }
 
@@ -10301,12 +10889,37 @@ stb_workqueue *stb_workq_new(int num_threads, int max_units)
    return stb_workq_new_flags(num_threads, max_units, 0,0);
 }
 
+// the mutex flags are no longer needed, since every deque has its own lock
 stb_workqueue *stb_workq_new_flags(int numthreads, int max_units, int no_add_mutex, int no_remove_mutex)
 {
+   int i;
    stb_workqueue *q = (stb_workqueue *) malloc(sizeof(*q));
    if (q == NULL) return NULL;
-   q->tq = stb_threadq_new(sizeof(stb__workinfo), max_units, !no_add_mutex, !no_remove_mutex);
-   if (q->tq == NULL) { free(q); return NULL; }
+   q->num_deques = stb_max(numthreads, 1);
+   q->deque = (stb__workdeque *) malloc(sizeof(*q->deque) * q->num_deques);
+   q->avail = stb_sem_new(0x7fffffff);
+   if (q->deque == NULL || q->avail == STB_SEMAPHORE_NULL) {
+      free(q->deque);
+      stb_sem_delete(q->avail);
+      free(q);
+      return NULL;
+   }
+   for (i=0; i < q->num_deques; ++i) {
+      stb__workdeque *d = &q->deque[i];
+      // split max_units across the deques
+      d->limit = (max_units == STB_THREADQUEUE_DYNAMIC) ? 0 : (max_units + q->num_deques-1) / q->num_deques;
+      d->size  = d->limit ? d->limit : 32;
+      d->head  = d->count = 0;
+      d->q     = q;
+      d->lock  = stb_mutex_new();
+      d->items = (stb__workinfo *) malloc(sizeof(*d->items) * d->size);
+      if (d->lock == STB_MUTEX_NULL || d->items == NULL) {
+         q->num_deques = i+1;
+         stb_workq_delete(q);
+         return NULL;
+      }
+   }
+   q->next_add = 0;
    q->numthreads = 0;
    stb_workq_numthreads(q, numthreads);
    return q;
@@ -10314,9 +10927,15 @@ stb_workqueue *stb_workq_new_flags(int numthreads, int max_units, int no_add_mut
 
 void stb_workq_delete(stb_workqueue *q)
 {
+   int i;
    while (stb_workq_length(q) != 0)
       stb__thread_sleep(1);
-   stb_threadq_delete(q->tq);
+   for (i=0; i < q->num_deques; ++i) {
+      stb_mutex_delete(q->deque[i].lock);
+      free(q->deque[i].items);
+   }
+   stb_sem_delete(q->avail);
+   free(q->deque);
    free(q);
 }
 
@@ -10337,6 +10956,7 @@ static void stb_work_init(int num_threads)
 static int stb__work_raw(stb_workqueue *q, stb_thread_func f, void *d, volatile void **return_code, stb_sync rel)
 {
    stb__workinfo w;
+   int i, start, ok;
    if (q == NULL) {
       stb_work_init(1);
       q = stb__work_global;
@@ -10345,12 +10965,28 @@ static int stb__work_raw(stb_workqueue *q, stb_thread_func f, void *d, volatile
    w.d = d;
    w.retval = return_code;
    w.sync = rel;
-   return stb_threadq_add(q->tq, &w);
+
+   // spread work from outside across the deques; if one is full, try the rest
+   start = q->next_add++;
+   for (i=0; i < q->num_deques; ++i) {
+      stb__workdeque *dq = &q->deque[(start + i) % q->num_deques];
+      stb_mutex_begin(dq->lock);
+      ok = stb__workdeque_add(dq, &w);
+      stb_mutex_end(dq->lock);
+      if (ok) {
+         stb_sem_release(q->avail);
+         return TRUE;
+      }
+   }
+   return FALSE;
 }
 
 int stb_workq_length(stb_workqueue *q)
 {
-   return stb_threadq_length(q->tq);
+   int i, n=0;
+   for (i=0; i < q->num_deques; ++i)
+      n += ((volatile stb__workdeque *) &q->deque[i])->count;
+   return n;
 }
 
 int stb_workq(stb_workqueue *q, stb_thread_func f, void *d, volatile void **return_code)
@@ -10368,7 +11004,7 @@ int stb_workq_reach(stb_workqueue *q, stb_thread_func f, void *d, volatile void
 static void stb__workq_numthreads(stb_workqueue *q, int n)
 {
    while (q->numthreads < n) {
-      stb_create_thread(stb__thread_workloop, q);
+      stb_create_thread(stb__thread_workloop, &q->deque[q->numthreads % q->num_deques]);
       ++q->numthreads;
    }
    while (q->numthreads > n) {
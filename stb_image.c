@@ -1,4 +1,4 @@
-/* stbi-1.17 - public domain JPEG/PNG reader - http://nothings.org/stb_image.c
+/* stbi-1.20 - public domain JPEG/PNG reader - http://nothings.org/stb_image.c
                       when you control the images you're loading
 
    QUICK NOTES:
@@ -19,6 +19,9 @@
       stbi_info_*
   
    history:
+      1.20   optional per-stage decoder profiling (STBI_PROFILE)
+      1.19   streaming scanline API (stbi_load_rows_*) for JPEG and PNG
+      1.18   installable cancellation callback (stbi_install_cancel)
       1.17   support interlaced PNG
       1.16   major bugfix - convert_format converted one too many pixels
       1.15   initialize some fields for thread safety
@@ -199,6 +202,21 @@ extern int      stbi_info_from_file  (FILE *f,                  int *x, int *y,
 extern stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 // for stbi_load_from_file, file pointer is left pointing immediately after image
 
+// STREAMING API - instead of returning the whole image at the end, hand
+// each scanline to 'func' as soon as it's decoded, top to bottom. 'row'
+// has w pixels of 'comp' components (req_comp if non-zero, else the same
+// as *comp would be), and is only valid until 'func' returns; return 0
+// from 'func' to stop decoding early. JPEG and non-interlaced PNG never
+// hold the whole output image (and JPEG only holds a couple of MCU rows
+// of its component planes), so peak memory is much lower; other formats
+// are loaded normally and then handed over a row at a time. Returns 1
+// on success, 0 on failure (or if 'func' stopped it).
+typedef int (*stbi_row_func)(void *userdata, int y, stbi_uc const *row, int w, int h, int comp);
+#ifndef STBI_NO_STDIO
+extern int      stbi_load_rows_from_file  (FILE *f,              int *x, int *y, int *comp, int req_comp, stbi_row_func func, void *userdata);
+#endif
+extern int      stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_row_func func, void *userdata);
+
 #ifndef STBI_NO_HDR
 #ifndef STBI_NO_STDIO
 extern float *stbi_loadf            (char const *filename,     int *x, int *y, int *comp, int req_comp);
@@ -343,6 +361,63 @@ extern void stbi_install_idct(stbi_idct_8x8 func);
 extern void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
 #endif // STBI_SIMD
 
+// cooperative cancellation: if installed, 'func' is polled once per MCU row
+// (jpeg), per zlib block and per filtered row (png), and per scanline for the
+// other formats; if it returns non-zero, the load is abandoned and returns
+// NULL with stbi_failure_reason() == "cancelled". It may be called from
+// whatever thread is doing the decode, so it should be cheap and threadsafe.
+// Pass NULL to uninstall. NOT THREADSAFE to install while a decode is running.
+typedef int (*stbi_cancel_func)(void *userdata);
+extern void stbi_install_cancel(stbi_cancel_func func, void *userdata);
+
+// decoder profiling: #define STBI_PROFILE (everywhere stb_image.c is
+// included) to time the inner stages of the decoders; without it none of
+// this exists and the decoders are unchanged. Between
+// stbi_profile_capture(p) and stbi_profile_capture(NULL), every load on
+// the calling thread adds to *p, so clear it first to get the stats for
+// one call. Other threads aren't affected. 'cycles' is the timestamp
+// counter where there is one, nanoseconds otherwise; the fine-grained
+// stages (huffman, idct) are timed per block, so they include the cost
+// of reading the counter. 'bytes' is what the stage wrote, except for
+// the jpeg header (marker segments parsed) and huffman (entropy-coded
+// bytes read). Flat (non-RLE) HDR files aren't counted.
+#ifdef STBI_PROFILE
+#ifdef _MSC_VER
+typedef __int64 stbi_int64;
+#else
+typedef long long stbi_int64;
+#endif
+
+enum
+{
+   STBI_PROF_jpeg_header,
+   STBI_PROF_jpeg_huffman,     // decode_block()
+   STBI_PROF_jpeg_idct,
+   STBI_PROF_jpeg_resample,    // resample_row_*()
+   STBI_PROF_jpeg_color,       // YCbCr to RGB, or grey expansion
+   STBI_PROF_zlib_inflate,
+   STBI_PROF_png_unfilter,
+   STBI_PROF_png_deinterlace,
+   STBI_PROF_png_palette,
+   STBI_PROF_hdr_rle,
+   STBI_PROF_hdr_convert,      // rgbE to float
+
+   STBI_PROF_count
+};
+
+typedef struct
+{
+   struct
+   {
+      stbi_int64 cycles, bytes;
+      unsigned int calls;
+   } stage[STBI_PROF_count];
+} stbi_profile;
+
+extern void  stbi_profile_capture(stbi_profile *p);
+extern char *stbi_profile_stage_name(int stage);
+#endif // STBI_PROFILE
+
 #ifdef __cplusplus
 }
 #endif
@@ -418,6 +493,96 @@ static int e(char *str)
    #define e(x,y)  e(x)
 #endif
 
+static stbi_cancel_func stbi_cancel_installed;
+static void *stbi_cancel_data;
+
+void stbi_install_cancel(stbi_cancel_func func, void *userdata)
+{
+   stbi_cancel_installed = func;
+   stbi_cancel_data = userdata;
+}
+
+// poll the cancel hook; sets the failure reason so callers can just bail
+static int cancelled(void)
+{
+   if (stbi_cancel_installed == NULL) return 0;
+   if (!stbi_cancel_installed(stbi_cancel_data)) return 0;
+   e("cancelled", "Decode cancelled");
+   return 1;
+}
+
+#ifdef STBI_PROFILE
+#ifdef _MSC_VER
+#define STBI_THREAD_LOCAL  __declspec(thread)
+#else
+#define STBI_THREAD_LOCAL  __thread
+#endif
+
+#if defined(_MSC_VER) && defined(_M_IX86)
+#pragma warning(disable:4035) // rdtsc leaves the result in edx:eax
+static stbi_int64 prof_clock(void)
+{
+   __asm _emit 0x0f __asm _emit 0x31  // rdtsc
+}
+#pragma warning(default:4035)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define prof_clock()  ((stbi_int64) __rdtsc())
+#elif defined(__i386__) || defined(__x86_64__)
+static stbi_int64 prof_clock(void)
+{
+   unsigned int lo,hi;
+   __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+   return ((stbi_int64) hi << 32) | lo;
+}
+#else
+#include <time.h>
+static stbi_int64 prof_clock(void)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (stbi_int64) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+#endif
+
+// per thread, so concurrent decodes each count into their own caller's
+// struct; no stage ever contains itself, so one start time per stage
+static STBI_THREAD_LOCAL stbi_profile *prof_current;
+static STBI_THREAD_LOCAL stbi_int64 prof_start[STBI_PROF_count];
+
+void stbi_profile_capture(stbi_profile *p)
+{
+   prof_current = p;
+}
+
+char *stbi_profile_stage_name(int stage)
+{
+   static char *names[STBI_PROF_count] =
+   {
+      "jpeg_header", "jpeg_huffman", "jpeg_idct", "jpeg_resample", "jpeg_color",
+      "zlib_inflate", "png_unfilter", "png_deinterlace", "png_palette",
+      "hdr_rle", "hdr_convert",
+   };
+   return stage >= 0 && stage < STBI_PROF_count ? names[stage] : NULL;
+}
+
+static void prof_end(int stage, uint32 bytes)
+{
+   prof_current->stage[stage].cycles += prof_clock() - prof_start[stage];
+   prof_current->stage[stage].bytes  += bytes;
+   prof_current->stage[stage].calls  += 1;
+}
+
+#define PROF_BEGIN(st)      (prof_current ? (void) (prof_start[st] = prof_clock()) : (void) 0)
+#define PROF_END(st,n)      (prof_current ? prof_end(st, (uint32) (n)) : (void) 0)
+#define PROF_BYTES(st,n)    (prof_current ? (void) (prof_current->stage[st].bytes += (n)) : (void) 0)
+#else
+// the arguments aren't evaluated, so they mustn't have side effects
+#define PROF_BEGIN(st)
+#define PROF_END(st,n)
+#define PROF_BYTES(st,n)
+#endif
+
 #define epf(x,y)   ((float *) (e(x,y)?NULL:NULL))
 #define epuc(x,y)  ((unsigned char *) (e(x,y)?NULL:NULL))
 
@@ -634,12 +799,19 @@ typedef struct
    FILE  *img_file;
    #endif
    uint8 *img_buffer, *img_buffer_end;
+
+   // streaming output, if row_func isn't NULL
+   stbi_row_func row_func;
+   void *row_data;
+   int row_comp;     // components the caller wants
+   uint8 *row_buf;   // img_x*4 bytes for converting rows to row_comp
 } stbi;
 
 #ifndef STBI_NO_STDIO
 static void start_file(stbi *s, FILE *f)
 {
    s->img_file = f;
+   s->row_func = NULL;
 }
 #endif
 
@@ -650,6 +822,7 @@ static void start_mem(stbi *s, uint8 const *buffer, int len)
 #endif
    s->img_buffer = (uint8 *) buffer;
    s->img_buffer_end = (uint8 *) buffer+len;
+   s->row_func = NULL;
 }
 
 __forceinline static int get8(stbi *s)
@@ -741,9 +914,36 @@ static uint8 compute_y(int r, int g, int b)
    return (uint8) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
+// convert one scanline of x pixels
+static void convert_row(unsigned char *src, int img_n, unsigned char *dest, int req_comp, uint x)
+{
+   int i;
+   #define COMBO(a,b)  ((a)*8+(b))
+   #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch(COMBO(img_n, req_comp)) {
+      CASE(1,2) dest[0]=src[0], dest[1]=255; break;
+      CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
+      CASE(2,1) dest[0]=src[0]; break;
+      CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
+      CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
+      CASE(3,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
+      CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
+      CASE(4,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
+      CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
+      CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
+      default: assert(0);
+   }
+   #undef CASE
+   #undef COMBO
+}
+
 static unsigned char *convert_format(unsigned char *data, int img_n, int req_comp, uint x, uint y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
@@ -755,36 +955,26 @@ static unsigned char *convert_format(unsigned char *data, int img_n, int req_com
       return epuc("outofmem", "Out of memory");
    }
 
-   for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define COMBO(a,b)  ((a)*8+(b))
-      #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch(COMBO(img_n, req_comp)) {
-         CASE(1,2) dest[0]=src[0], dest[1]=255; break;
-         CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
-         CASE(2,1) dest[0]=src[0]; break;
-         CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
-         CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
-         CASE(3,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
-         CASE(4,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
-         CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
-         default: assert(0);
-      }
-      #undef CASE
-   }
+   for (j=0; j < (int) y; ++j)
+      convert_row(data + j * x * img_n, img_n, good + j * x * req_comp, req_comp, x);
 
    free(data);
    return good;
 }
 
+// streaming: hand a finished scanline with n components to the caller,
+// converting it to the number they asked for first if needed
+static int emit_row(stbi *s, uint8 *row, int n, int y)
+{
+   if (n != s->row_comp) {
+      convert_row(row, n, s->row_buf, s->row_comp, s->img_x);
+      row = s->row_buf;
+   }
+   if (!s->row_func(s->row_data, y, row, s->img_x, s->img_y, s->row_comp))
+      return e("cancelled", "Decode cancelled");
+   return 1;
+}
+
 #ifndef STBI_NO_HDR
 static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 {
@@ -807,7 +997,9 @@ static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp)
 {
    int i,k,n;
-   stbi_uc *output = (stbi_uc *) malloc(x * y * comp);
+   stbi_uc *output;
+   if (data == NULL) return NULL; // failed or cancelled; reason already set
+   output = (stbi_uc *) malloc(x * y * comp);
    if (output == NULL) { free(data); return epuc("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
@@ -965,6 +1157,7 @@ static void grow_buffer_unsafe(jpeg *j)
       }
       j->code_buffer = (j->code_buffer << 8) | b;
       j->code_bits += 8;
+      PROF_BYTES(STBI_PROF_jpeg_huffman, 1);
    } while (j->code_bits <= 24);
 }
 
@@ -1291,11 +1484,16 @@ static void reset(jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int parse_entropy_coded_data(jpeg *z)
+// decode one row of entropy-coded data into the component buffers: a row
+// of 8x8 blocks for a non-interleaved scan, or a row of MCUs for an
+// interleaved one. when streaming, the buffers only hold a couple of
+// rows (h2), so the row wraps around vertically. returns 0 on error, 1
+// to keep going, 2 if the data ended early--in which case we just stop,
+// so we get corrupt data rather than no data
+static int parse_entropy_coded_row(jpeg *z, int j)
 {
-   reset(z);
    if (z->scan_n == 1) {
-      int i,j;
+      int i;
       #if STBI_SIMD
       __declspec(align(16))
       #endif
@@ -1306,63 +1504,88 @@ static int parse_entropy_coded_data(jpeg *z)
       // number of blocks to do just depends on how many actual "pixels" this
       // component has, independent of interleaved MCU blocking and such
       int w = (z->img_comp[n].x+7) >> 3;
-      int h = (z->img_comp[n].y+7) >> 3;
-      for (j=0; j < h; ++j) {
-         for (i=0; i < w; ++i) {
-            if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
-            #if STBI_SIMD
-            stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
-            #else
-            idct_block(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
-            #endif
-            // every data block is an MCU, so countdown the restart interval
-            if (--z->todo <= 0) {
-               if (z->code_bits < 24) grow_buffer_unsafe(z);
-               // if it's NOT a restart, then just bail, so we get corrupt data
-               // rather than no data
-               if (!RESTART(z->marker)) return 1;
-               reset(z);
-            }
+      uint8 *row = z->img_comp[n].data + z->img_comp[n].w2 * ((j*8) % z->img_comp[n].h2);
+      for (i=0; i < w; ++i) {
+         PROF_BEGIN(STBI_PROF_jpeg_huffman);
+         if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+         PROF_END(STBI_PROF_jpeg_huffman, 0);
+         PROF_BEGIN(STBI_PROF_jpeg_idct);
+         #if STBI_SIMD
+         stbi_idct_installed(row+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
+         #else
+         idct_block(row+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+         #endif
+         PROF_END(STBI_PROF_jpeg_idct, 64);
+         // every data block is an MCU, so countdown the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!RESTART(z->marker)) return 2;
+            reset(z);
          }
       }
    } else { // interleaved!
-      int i,j,k,x,y;
+      int i,k,x,y;
       short data[64];
-      for (j=0; j < z->img_mcu_y; ++j) {
-         for (i=0; i < z->img_mcu_x; ++i) {
-            // scan an interleaved mcu... process scan_n components in order
-            for (k=0; k < z->scan_n; ++k) {
-               int n = z->order[k];
-               // scan out an mcu's worth of this component; that's just determined
-               // by the basic H and V specified for the component
-               for (y=0; y < z->img_comp[n].v; ++y) {
-                  for (x=0; x < z->img_comp[n].h; ++x) {
-                     int x2 = (i*z->img_comp[n].h + x)*8;
-                     int y2 = (j*z->img_comp[n].v + y)*8;
-                     if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
-                     #if STBI_SIMD
-                     stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
-                     #else
-                     idct_block(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
-                     #endif
-                  }
+      for (i=0; i < z->img_mcu_x; ++i) {
+         // scan an interleaved mcu... process scan_n components in order
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            // scan out an mcu's worth of this component; that's just determined
+            // by the basic H and V specified for the component
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*8;
+                  int y2 = ((j*z->img_comp[n].v + y)*8) % z->img_comp[n].h2;
+                  PROF_BEGIN(STBI_PROF_jpeg_huffman);
+                  if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+                  PROF_END(STBI_PROF_jpeg_huffman, 0);
+                  PROF_BEGIN(STBI_PROF_jpeg_idct);
+                  #if STBI_SIMD
+                  stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
+                  #else
+                  idct_block(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+                  #endif
+                  PROF_END(STBI_PROF_jpeg_idct, 64);
                }
             }
-            // after all interleaved components, that's an interleaved MCU,
-            // so now count down the restart interval
-            if (--z->todo <= 0) {
-               if (z->code_bits < 24) grow_buffer_unsafe(z);
-               // if it's NOT a restart, then just bail, so we get corrupt data
-               // rather than no data
-               if (!RESTART(z->marker)) return 1;
-               reset(z);
-            }
+         }
+         // after all interleaved components, that's an interleaved MCU,
+         // so now count down the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!RESTART(z->marker)) return 2;
+            reset(z);
          }
       }
    }
    return 1;
 }
 
+// number of rows parse_entropy_coded_row() needs to do for this scan
+static int entropy_coded_rows(jpeg *z)
+{
+   if (z->scan_n == 1)
+      return (z->img_comp[z->order[0]].y+7) >> 3;
+   return z->img_mcu_y;
+}
+
+static int parse_entropy_coded_data(jpeg *z)
+{
+   int j, rows = entropy_coded_rows(z);
+   reset(z);
+   for (j=0; j < rows; ++j) {
+      int r = parse_entropy_coded_row(z, j);
+      if (r != 1) return r == 2;
+      // one row of blocks done; see if the caller has lost interest
+      if (cancelled()) return 0;
+   }
+   return 1;
+}
+
 static int process_marker(jpeg *z, int m)
 {
    int L;
@@ -1375,11 +1598,13 @@ static int process_marker(jpeg *z, int m)
 
       case 0xDD: // DRI - specify restart interval
          if (get16(&z->s) != 4) return e("bad DRI len","Corrupt JPEG");
+         PROF_BYTES(STBI_PROF_jpeg_header, 4);
          z->restart_interval = get16(&z->s);
          return 1;
 
       case 0xDB: // DQT - define quantization table
          L = get16(&z->s)-2;
+         PROF_BYTES(STBI_PROF_jpeg_header, L+2);
          while (L > 0) {
             int q = get8(&z->s);
             int p = q >> 4;
@@ -1398,6 +1623,7 @@ static int process_marker(jpeg *z, int m)
 
       case 0xC4: // DHT - define huffman table
          L = get16(&z->s)-2;
+         PROF_BYTES(STBI_PROF_jpeg_header, L+2);
          while (L > 0) {
             uint8 *v;
             int sizes[16],i,m=0;
@@ -1425,7 +1651,9 @@ static int process_marker(jpeg *z, int m)
    }
    // check for comment block or APP blocks
    if ((m >= 0xE0 && m <= 0xEF) || m == 0xFE) {
-      skip(&z->s, get16(&z->s)-2);
+      L = get16(&z->s);
+      PROF_BYTES(STBI_PROF_jpeg_header, L);
+      skip(&z->s, L-2);
       return 1;
    }
    return 0;
@@ -1439,6 +1667,7 @@ static int process_scan_header(jpeg *z)
    z->scan_n = get8(&z->s);
    if (z->scan_n < 1 || z->scan_n > 4 || z->scan_n > (int) z->s.img_n) return e("bad SOS component count","Corrupt JPEG");
    if (Ls != 6+2*z->scan_n) return e("bad SOS len","Corrupt JPEG");
+   PROF_BYTES(STBI_PROF_jpeg_header, Ls);
    for (i=0; i < z->scan_n; ++i) {
       int id = get8(&z->s), which;
       int q = get8(&z->s);
@@ -1457,6 +1686,31 @@ static int process_scan_header(jpeg *z)
    return 1;
 }
 
+// allocate buffers for mcu_rows rows of MCUs for each component
+static int alloc_components(jpeg *z, int mcu_rows)
+{
+   int i;
+   for (i=0; i < z->s.img_n; ++i) {
+      // to simplify generation, we'll allocate enough memory to decode
+      // the bogus oversized data from using interleaved MCUs and their
+      // big blocks (e.g. a 16x16 iMCU on an image of width 33); we won't
+      // discard the extra data until colorspace conversion
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
+      z->img_comp[i].h2 = mcu_rows * z->img_comp[i].v * 8;
+      z->img_comp[i].raw_data = malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
+      if (z->img_comp[i].raw_data == NULL) {
+         for(--i; i >= 0; --i) {
+            free(z->img_comp[i].raw_data);
+            z->img_comp[i].data = NULL;
+         }
+         return e("outofmem", "Out of memory");
+      }
+      // align blocks for installable-idct using mmx/sse
+      z->img_comp[i].data = (uint8*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+   }
+   return 1;
+}
+
 static int process_frame_header(jpeg *z, int scan)
 {
    stbi *s = &z->s;
@@ -1474,6 +1728,7 @@ static int process_frame_header(jpeg *z, int scan)
    }
 
    if (Lf != 8+3*s->img_n) return e("bad SOF len","Corrupt JPEG");
+   PROF_BYTES(STBI_PROF_jpeg_header, Lf);
 
    for (i=0; i < s->img_n; ++i) {
       z->img_comp[i].id = get8(s);
@@ -1507,26 +1762,12 @@ static int process_frame_header(jpeg *z, int scan)
       // number of effective pixels (e.g. for non-interleaved MCU)
       z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
       z->img_comp[i].y = (s->img_y * z->img_comp[i].v + v_max-1) / v_max;
-      // to simplify generation, we'll allocate enough memory to decode
-      // the bogus oversized data from using interleaved MCUs and their
-      // big blocks (e.g. a 16x16 iMCU on an image of width 33); we won't
-      // discard the extra data until colorspace conversion
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
-      z->img_comp[i].raw_data = malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
-      if (z->img_comp[i].raw_data == NULL) {
-         for(--i; i >= 0; --i) {
-            free(z->img_comp[i].raw_data);
-            z->img_comp[i].data = NULL;
-         }
-         return e("outofmem", "Out of memory");
-      }
-      // align blocks for installable-idct using mmx/sse
-      z->img_comp[i].data = (uint8*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
-      z->img_comp[i].linebuf = NULL;
    }
 
-   return 1;
+   // when streaming, we only need the MCU row being decoded and the one
+   // before it (for upsampling across the boundary); if it turns out to
+   // have one scan per component, we'll grow them to full size then
+   return alloc_components(z, s->row_func && z->img_mcu_y > 2 ? 2 : z->img_mcu_y);
 }
 
 // use comparisons since in some cases we handle more than one case (e.g. SOF)
@@ -1561,14 +1802,19 @@ static int decode_jpeg_image(jpeg *j)
 {
    int m;
    j->restart_interval = 0;
+   PROF_BEGIN(STBI_PROF_jpeg_header);
    if (!decode_jpeg_header(j, SCAN_load)) return 0;
+   PROF_END(STBI_PROF_jpeg_header, 0);
    m = get_marker(j);
    while (!EOI(m)) {
+      PROF_BEGIN(STBI_PROF_jpeg_header);
       if (SOS(m)) {
          if (!process_scan_header(j)) return 0;
+         PROF_END(STBI_PROF_jpeg_header, 0);
          if (!parse_entropy_coded_data(j)) return 0;
       } else {
          if (!process_marker(j, m)) return 0;
+         PROF_END(STBI_PROF_jpeg_header, 0);
       }
       m = get_marker(j);
    }
@@ -1717,9 +1963,106 @@ typedef struct
    int ypos;    // which pre-expansion row we're on
 } stbi_resample;
 
+static int start_resample(jpeg *z, stbi_resample *res_comp, int decode_n)
+{
+   int k;
+   for (k=0; k < decode_n; ++k) {
+      stbi_resample *r = &res_comp[k];
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (uint8 *) malloc(z->s.img_x + 3);
+      if (!z->img_comp[k].linebuf) return e("outofmem", "Out of memory");
+
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (z->s.img_x + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = resample_row_hv_2;
+      else                               r->resample = resample_row_generic;
+   }
+   return 1;
+}
+
+// resample and color-convert the next row of output into 'out'
+static void resample_row(jpeg *z, stbi_resample *res_comp, int decode_n, int n, uint8 *out)
+{
+   int k;
+   uint i;
+   uint8 *coutput[4];
+   for (k=0; k < decode_n; ++k) {
+      stbi_resample *r = &res_comp[k];
+      int y_bot = r->ystep >= (r->vs >> 1);
+      PROF_BEGIN(STBI_PROF_jpeg_resample);
+      coutput[k] = r->resample(z->img_comp[k].linebuf,
+                               y_bot ? r->line1 : r->line0,
+                               y_bot ? r->line0 : r->line1,
+                               r->w_lores, r->hs);
+      PROF_END(STBI_PROF_jpeg_resample, r->w_lores * r->hs);
+      if (++r->ystep >= r->vs) {
+         r->ystep = 0;
+         r->line0 = r->line1;
+         if (++r->ypos < z->img_comp[k].y) {
+            r->line1 += z->img_comp[k].w2;
+            // when streaming, the component buffer only holds a couple
+            // of MCU rows, so wrap around (never happens otherwise)
+            if (r->line1 == z->img_comp[k].data + z->img_comp[k].w2 * z->img_comp[k].h2)
+               r->line1 = z->img_comp[k].data;
+         }
+      }
+   }
+   PROF_BEGIN(STBI_PROF_jpeg_color);
+   if (n >= 3) {
+      uint8 *y = coutput[0];
+      if (z->s.img_n == 3) {
+         #if STBI_SIMD
+         stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s.img_x, n);
+         #else
+         YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s.img_x, n);
+         #endif
+      } else
+         for (i=0; i < z->s.img_x; ++i) {
+            out[0] = out[1] = out[2] = y[i];
+            out[3] = 255; // not used if n==3
+            out += n;
+         }
+   } else {
+      uint8 *y = coutput[0];
+      if (n == 1)
+         for (i=0; i < z->s.img_x; ++i) out[i] = y[i];
+      else
+         for (i=0; i < z->s.img_x; ++i) *out++ = y[i], *out++ = 255;
+   }
+   PROF_END(STBI_PROF_jpeg_color, z->s.img_x * n);
+}
+
+// when streaming: have all the source rows the next output row needs
+// been decoded, given how many rows of entropy-coded data are done?
+static int resample_row_ready(jpeg *z, stbi_resample *res_comp, int decode_n, int rows_done)
+{
+   int k;
+   for (k=0; k < decode_n; ++k) {
+      int need = res_comp[k].ypos;
+      int have = rows_done * 8 * (z->scan_n == 1 ? 1 : z->img_comp[k].v);
+      if (need >= z->img_comp[k].y) need = z->img_comp[k].y-1; // line1 stops advancing
+      if (need >= have) return 0;
+   }
+   return 1;
+}
+
 static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n;
+   uint j;
+   uint8 *output;
+   stbi_resample res_comp[4];
+
    // validate req_comp
    if (req_comp < 0 || req_comp > 4) return epuc("bad req_comp", "Internal error");
    z->s.img_n = 0;
@@ -1736,85 +2079,113 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
       decode_n = z->s.img_n;
 
    // resample and color-convert
-   {
-      int k;
-      uint i,j;
-      uint8 *output;
-      uint8 *coutput[4];
-
-      stbi_resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
-         stbi_resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (uint8 *) malloc(z->s.img_x + 3);
-         if (!z->img_comp[k].linebuf) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s.img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = resample_row_hv_2;
-         else                               r->resample = resample_row_generic;
+   if (!start_resample(z, res_comp, decode_n)) { cleanup_jpeg(z); return NULL; }
+
+   // the only failure after this is cancellation, which frees it
+   output = (uint8 *) malloc(n * z->s.img_x * z->s.img_y + 1);
+   if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
+
+   // now go ahead and resample
+   for (j=0; j < z->s.img_y; ++j) {
+      // poll about once per MCU row (16 lines for the common 2x2 case)
+      if ((j & 15) == 15 && cancelled()) {
+         free(output);
+         cleanup_jpeg(z);
+         return NULL;
       }
+      resample_row(z, res_comp, decode_n, n, output + n * z->s.img_x * j);
+   }
+   cleanup_jpeg(z);
+   *out_x = z->s.img_x;
+   *out_y = z->s.img_y;
+   if (comp) *comp  = z->s.img_n; // report original components, not output
+   return output;
+}
+
+// streaming version of the above: rather than decoding everything and
+// then resampling, resample each output row (and hand it to row_func) as
+// soon as the MCU rows it needs are in, so the component buffers only
+// need to hold a couple of MCU rows. if the file has a separate scan for
+// each component we can't do that, so we fall back to full-size buffers
+// and emit the rows once the last scan is in.
+static int load_jpeg_rows(jpeg *z, int req_comp)
+{
+   int m, n, decode_n, streaming=1, ok=0;
+   uint out_y;
+   uint8 *row = NULL;
+   stbi_resample res_comp[4];
+
+   if (req_comp < 0 || req_comp > 4) return e("bad req_comp", "Internal error");
+   z->s.img_n = 0;
+   z->restart_interval = 0;
+   PROF_BEGIN(STBI_PROF_jpeg_header);
+   if (!decode_jpeg_header(z, SCAN_load)) goto done;
+   PROF_END(STBI_PROF_jpeg_header, 0);
+
+   n = req_comp ? req_comp : z->s.img_n;
+   decode_n = (z->s.img_n == 3 && n < 3) ? 1 : z->s.img_n;
+   z->s.row_comp = n;
+   z->s.row_buf = NULL; // we generate n components directly
+   row = (uint8 *) malloc(n * z->s.img_x + 1); // +1 as colorspace conversion writes a 4th byte
+   if (!row) { e("outofmem", "Out of memory"); goto done; }
 
-      // can't error after this so, this is safe
-      output = (uint8 *) malloc(n * z->s.img_x * z->s.img_y + 1);
-      if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s.img_y; ++j) {
-         uint8 *out = output + n * z->s.img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi_resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
+   m = get_marker(z);
+   while (!EOI(m)) {
+      PROF_BEGIN(STBI_PROF_jpeg_header);
+      if (SOS(m)) {
+         if (!process_scan_header(z)) goto done;
+         PROF_END(STBI_PROF_jpeg_header, 0);
+         if (streaming && z->scan_n != z->s.img_n) {
+            int i;
+            for (i=0; i < z->s.img_n; ++i) {
+               free(z->img_comp[i].raw_data);
+               z->img_comp[i].data = NULL;
             }
+            if (!alloc_components(z, z->img_mcu_y)) goto done;
+            streaming = 0;
          }
-         if (n >= 3) {
-            uint8 *y = coutput[0];
-            if (z->s.img_n == 3) {
-               #if STBI_SIMD
-               stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s.img_x, n);
-               #else
-               YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s.img_x, n);
-               #endif
-            } else
-               for (i=0; i < z->s.img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
+         if (streaming) {
+            int j, rows = entropy_coded_rows(z);
+            if (!start_resample(z, res_comp, decode_n)) goto done;
+            reset(z);
+            out_y = 0;
+            for (j=0; j < rows; ++j) {
+               int r = parse_entropy_coded_row(z, j);
+               if (r == 0) goto done;
+               // if the data stopped early, flush out whatever we've got
+               while (out_y < z->s.img_y && resample_row_ready(z, res_comp, decode_n, r == 2 ? rows : j+1)) {
+                  resample_row(z, res_comp, decode_n, n, row);
+                  if (!emit_row(&z->s, row, n, out_y++)) goto done;
                }
-         } else {
-            uint8 *y = coutput[0];
-            if (n == 1)
-               for (i=0; i < z->s.img_x; ++i) out[i] = y[i];
-            else
-               for (i=0; i < z->s.img_x; ++i) *out++ = y[i], *out++ = 255;
+               if (r == 2) break;
+               if (cancelled()) goto done;
+            }
+            // that's the whole image; we don't care about anything after it
+            ok = 1;
+            goto done;
          }
+         if (!parse_entropy_coded_data(z)) goto done;
+      } else {
+         if (!process_marker(z, m)) goto done;
+         PROF_END(STBI_PROF_jpeg_header, 0);
       }
-      cleanup_jpeg(z);
-      *out_x = z->s.img_x;
-      *out_y = z->s.img_y;
-      if (comp) *comp  = z->s.img_n; // report original components, not output
-      return output;
+      m = get_marker(z);
    }
+   if (streaming) { e("no SOS", "Corrupt JPEG"); goto done; }
+
+   // all the scans are in, so now we can resample the whole thing
+   if (!start_resample(z, res_comp, decode_n)) goto done;
+   for (out_y=0; out_y < z->s.img_y; ++out_y) {
+      if ((out_y & 15) == 15 && cancelled()) goto done;
+      resample_row(z, res_comp, decode_n, n, row);
+      if (!emit_row(&z->s, row, n, out_y)) goto done;
+   }
+   ok = 1;
+
+done:
+   free(row);
+   cleanup_jpeg(z);
+   return ok;
 }
 
 #ifndef STBI_NO_STDIO
@@ -2187,7 +2558,7 @@ static void init_defaults(void)
    for (i=0; i <=  31; ++i)     default_distance[i] = 5;
 }
 
-int stbi_png_partial; // a quick hack to only allow decoding some of a PNG... I should implement real streaming support instead
+int stbi_png_partial; // a quick hack to only allow decoding some of a PNG... see stbi_load_rows for real streaming support
 static int parse_zlib(zbuf *a, int parse_header)
 {
    int final, type;
@@ -2215,18 +2586,23 @@ static int parse_zlib(zbuf *a, int parse_header)
       }
       if (stbi_png_partial && a->zout - a->zout_start > 65536)
          break;
+      if (!final && cancelled()) return 0;
    } while (!final);
    return 1;
 }
 
 static int do_zlib(zbuf *a, char *obuf, int olen, int exp, int parse_header)
 {
+   int ok;
    a->zout_start = obuf;
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
 
-   return parse_zlib(a, parse_header);
+   PROF_BEGIN(STBI_PROF_zlib_inflate);
+   ok = parse_zlib(a, parse_header);
+   PROF_END(STBI_PROF_zlib_inflate, a->zout - a->zout_start);
+   return ok;
 }
 
 char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
@@ -2328,8 +2704,18 @@ typedef struct
 {
    stbi s;
    uint8 *idata, *expanded, *out;
+
+   // streaming: emit rows as they're unfiltered, doing the fixups that
+   // are normally done on the whole image a row at a time instead
+   int stream;
+   uint8 *tc;        // tRNS color key, or NULL
+   uint8 *palette;   // expand to pal_out_n components, or NULL
+   int pal_out_n;
+   uint8 *pal_row;   // img_x*4 bytes to expand the palette into
 } png;
 
+static int png_emit_row(png *a, uint8 *row, int y);
+
 
 enum {
    F_none=0, F_sub=1, F_up=2, F_avg=3, F_paeth=4,
@@ -2361,7 +2747,8 @@ static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, u
    int img_n = s->img_n; // copy it into a local for later
    assert(out_n == s->img_n || out_n == s->img_n+1);
    if (stbi_png_partial) y = 1;
-   a->out = (uint8 *) malloc(x * y * out_n);
+   // when streaming we only need this row and the one before it
+   a->out = (uint8 *) malloc(x * (a->stream ? 2 : y) * out_n);
    if (!a->out) return e("outofmem", "Out of memory");
    if (!stbi_png_partial) {
       if (s->img_x == x && s->img_y == y)
@@ -2370,10 +2757,18 @@ static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, u
          if (raw_len < (img_n * x + 1) * y) return e("not enough pixels","Corrupt PNG");
    }
    for (j=0; j < y; ++j) {
-      uint8 *cur = a->out + stride*j;
-      uint8 *prior = cur - stride;
+      uint8 *cur, *prior;
       int filter = *raw++;
+      if (a->stream) {
+         cur   = a->out + stride*(j&1);
+         prior = a->out + stride*(~j&1);
+      } else {
+         cur   = a->out + stride*j;
+         prior = cur - stride;
+      }
       if (filter > 4) return e("invalid filter","Corrupt PNG");
+      if (cancelled()) return 0;
+      PROF_BEGIN(STBI_PROF_png_unfilter);
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
       // handle first pixel explicitly
@@ -2425,6 +2820,9 @@ static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, u
          }
          #undef CASE
       }
+      PROF_END(STBI_PROF_png_unfilter, stride);
+      if (a->stream)
+         if (!png_emit_row(a, a->out + stride*(j&1), j)) return 0;
    }
    return 1;
 }
@@ -2453,12 +2851,15 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int i
       if (x && y) {
          if (!create_png_image_raw(a, raw, raw_len, out_n, x, y)) {
             free(final);
+            stbi_png_partial = save;
             return 0;
          }
+         PROF_BEGIN(STBI_PROF_png_deinterlace);
          for (j=0; j < y; ++j)
             for (i=0; i < x; ++i)
                memcpy(final + (j*yspc[p]+yorig[p])*a->s.img_x*out_n + (i*xspc[p]+xorig[p])*out_n,
                       a->out + (j*x+i)*out_n, out_n);
+         PROF_END(STBI_PROF_png_deinterlace, x*y*out_n);
          free(a->out);
          raw += (x*out_n+1)*y;
          raw_len -= (x*out_n+1)*y;
@@ -2470,11 +2871,9 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int i
    return 1;
 }
 
-static int compute_transparency(png *z, uint8 tc[3], int out_n)
+static void compute_transparency_row(uint8 *p, uint32 pixel_count, uint8 tc[3], int out_n)
 {
-   stbi *s = &z->s;
-   uint32 i, pixel_count = s->img_x * s->img_y;
-   uint8 *p = z->out;
+   uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -2492,20 +2891,18 @@ static int compute_transparency(png *z, uint8 tc[3], int out_n)
          p += 4;
       }
    }
-   return 1;
 }
 
-static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+static int compute_transparency(png *z, uint8 tc[3], int out_n)
 {
-   uint32 i, pixel_count = a->s.img_x * a->s.img_y;
-   uint8 *p, *temp_out, *orig = a->out;
-
-   p = (uint8 *) malloc(pixel_count * pal_img_n);
-   if (p == NULL) return e("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
+   compute_transparency_row(z->out, z->s.img_x * z->s.img_y, tc, out_n);
+   return 1;
+}
 
+static void expand_palette_row(uint8 *p, uint8 *orig, uint32 pixel_count, uint8 *palette, int pal_img_n)
+{
+   uint32 i;
+   PROF_BEGIN(STBI_PROF_png_palette);
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -2524,11 +2921,34 @@ static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
          p += 4;
       }
    }
+   PROF_END(STBI_PROF_png_palette, pixel_count * pal_img_n);
+}
+
+static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+{
+   uint32 pixel_count = a->s.img_x * a->s.img_y;
+   uint8 *p = (uint8 *) malloc(pixel_count * pal_img_n);
+   if (p == NULL) return e("outofmem", "Out of memory");
+   expand_palette_row(p, a->out, pixel_count, palette, pal_img_n);
    free(a->out);
-   a->out = temp_out;
+   a->out = p;
    return 1;
 }
 
+// streaming: finish off one unfiltered row and pass it on
+static int png_emit_row(png *a, uint8 *row, int y)
+{
+   int n = a->s.img_out_n;
+   if (a->tc)
+      compute_transparency_row(row, a->s.img_x, a->tc, n);
+   if (a->palette) {
+      expand_palette_row(a->pal_row, row, a->s.img_x, a->palette, a->pal_out_n);
+      row = a->pal_row;
+      n = a->pal_out_n;
+   }
+   return emit_row(&a->s, row, n, y);
+}
+
 static int parse_png_file(png *z, int scan, int req_comp)
 {
    uint8 palette[1024], pal_img_n=0;
@@ -2642,6 +3062,21 @@ static int parse_png_file(png *z, int scan, int req_comp)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
+            if (s->row_func && !interlace) {
+               // streaming; interlaced images have to be done the slow way
+               z->stream    = 1;
+               z->tc        = has_trans ? tc : NULL;
+               z->palette   = pal_img_n ? palette : NULL;
+               z->pal_out_n = req_comp >= 3 ? req_comp : pal_img_n;
+               s->row_comp  = req_comp ? req_comp : pal_img_n ? pal_img_n : s->img_out_n; // keep tRNS alpha
+               s->row_buf   = (uint8 *) malloc(s->img_x * 4);
+               z->pal_row   = (uint8 *) malloc(s->img_x * 4);
+               if (!s->row_buf || !z->pal_row) return e("outofmem", "Out of memory");
+               if (!create_png_image_raw(z, z->expanded, raw_len, s->img_out_n, s->img_x, s->img_y)) return 0;
+               if (pal_img_n) s->img_n = pal_img_n; // record the actual colors we had
+               free(z->expanded); z->expanded = NULL;
+               return 1;
+            }
             if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace)) return 0;
             if (has_trans)
                if (!compute_transparency(z, tc, s->img_out_n)) return 0;
@@ -2684,6 +3119,7 @@ static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
    p->expanded = NULL;
    p->idata = NULL;
    p->out = NULL;
+   p->stream = 0;
    if (req_comp < 0 || req_comp > 4) return epuc("bad req_comp", "Internal error");
    if (parse_png_file(p, SCAN_load, req_comp)) {
       result = p->out;
@@ -2973,6 +3409,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
             if (target == 4) out[z++] = 255;
          }
          skip(s, pad);
+         if (cancelled()) { free(out); return NULL; }
       }
    } else {
       int rshift=0,gshift=0,bshift=0,ashift=0,rcount=0,gcount=0,bcount=0,acount=0;
@@ -2998,6 +3435,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
          ashift = high_bit(ma)-7; acount = bitcount(mr);
       }
       for (j=0; j < (int) s->img_y; ++j) {
+         if (cancelled()) { free(out); return NULL; }
          if (easy) {
             for (i=0; i < (int) s->img_x; ++i) {
                int a;
@@ -3192,6 +3630,16 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 	//	load the data
 	for( i = 0; i < tga_width * tga_height; ++i )
 	{
+		//	once per scanline, see if we should give up
+		if( (i % tga_width == 0) && cancelled() )
+		{
+			free( tga_data );
+			if( tga_palette != NULL )
+			{
+				free( tga_palette );
+			}
+			return NULL;
+		}
 		//	if I'm in RLE mode, do I need to get a RLE chunk?
 		if( tga_is_RLE )
 		{
@@ -3390,7 +3838,7 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 	int	pixelCount;
 	int channelCount, compression;
 	int channel, i, count, len;
-   int w,h;
+   int w,h,next_row;
    uint8 *out;
 
 	// Check identifier
@@ -3480,7 +3928,13 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 			} else {
 				// Read the RLE data.
 				count = 0;
+				next_row = w;
 				while (count < pixelCount) {
+					// runs don't respect rows, so poll whenever we cross one
+					if (count >= next_row) {
+						next_row = count + w;
+						if (cancelled()) { free(out); return NULL; }
+					}
 					len = get8(s);
 					if (len == 128) {
 						// No-op.
@@ -3526,8 +3980,10 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 			} else {
 				// Read the data.
 				count = 0;
-				for (i = 0; i < pixelCount; i++)
+				for (i = 0; i < pixelCount; i++) {
+					if (i % w == 0 && cancelled()) { free(out); return NULL; }
 					*p = get8(s), p += 4;
+				}
 			}
 		}
 	}
@@ -3706,6 +4162,7 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 	if( width < 8 || width >= 32768) {
 		// Read flat data
       for (j=0; j < height; ++j) {
+         if (cancelled()) { free(hdr_data); return NULL; }
          for (i=0; i < width; ++i) {
             stbi_uc rgbe[4];
            main_decode_loop:
@@ -3718,6 +4175,7 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 		scanline = NULL;
 
 		for (j = 0; j < height; ++j) {
+         if (cancelled()) { free(hdr_data); free(scanline); return NULL; }
          c1 = get8(s);
          c2 = get8(s);
          len = get8(s);
@@ -3736,6 +4194,7 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
          if (len != width) { free(hdr_data); free(scanline); return epf("invalid decoded scanline length", "corrupt HDR"); }
          if (scanline == NULL) scanline = (stbi_uc *) malloc(width * 4);
 				
+         PROF_BEGIN(STBI_PROF_hdr_rle);
 			for (k = 0; k < 4; ++k) {
 				i = 0;
 				while (i < width) {
@@ -3753,8 +4212,11 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 					}
 				}
 			}
+         PROF_END(STBI_PROF_hdr_rle, width * 4);
+         PROF_BEGIN(STBI_PROF_hdr_convert);
          for (i=0; i < width; ++i)
             hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
+         PROF_END(STBI_PROF_hdr_convert, width * req_comp * sizeof(float));
 		}
       free(scanline);
 	}
@@ -3780,6 +4242,125 @@ float *stbi_hdr_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y,
 
 #endif // STBI_NO_HDR
 
+/////////////////////// streaming rows ///////////////////////
+
+// for formats that can't stream: hand over an already-decoded image
+static int emit_image(stbi *s, uint8 *data, int n)
+{
+   uint j;
+   int ok=1;
+   s->row_buf = (uint8 *) malloc(s->img_x * 4);
+   if (!s->row_buf) return e("outofmem", "Out of memory");
+   for (j=0; ok && j < s->img_y; ++j)
+      ok = emit_row(s, data + j * s->img_x * n, n, j);
+   free(s->row_buf); s->row_buf = NULL;
+   return ok;
+}
+
+static int do_png_rows(png *p, int req_comp)
+{
+   int ok;
+   p->expanded = NULL;
+   p->idata = NULL;
+   p->out = NULL;
+   p->stream = 0;
+   p->pal_row = NULL;
+   p->s.row_buf = NULL;
+   if (req_comp < 0 || req_comp > 4) return e("bad req_comp", "Internal error");
+   ok = parse_png_file(p, SCAN_load, req_comp);
+   if (ok && !p->stream) {
+      // interlaced, so we got it all in one go
+      p->s.row_comp = req_comp ? req_comp : p->s.img_out_n;
+      ok = emit_image(&p->s, p->out, p->s.img_out_n);
+   }
+   free(p->s.row_buf); p->s.row_buf = NULL;
+   free(p->pal_row);   p->pal_row   = NULL;
+   free(p->out);       p->out       = NULL;
+   free(p->expanded);  p->expanded  = NULL;
+   free(p->idata);     p->idata     = NULL;
+   return ok;
+}
+
+// everything else gets loaded normally and then handed over
+static int load_rows_whole(stbi_uc *data, int x, int y, int comp, int req_comp, stbi_row_func func, void *userdata)
+{
+   stbi s;
+   int ok;
+   if (data == NULL) return 0;
+   s.img_x = x;
+   s.img_y = y;
+   s.row_func = func;
+   s.row_data = userdata;
+   s.row_comp = req_comp ? req_comp : comp;
+   ok = emit_image(&s, data, s.row_comp);
+   free(data);
+   return ok;
+}
+
+#ifndef STBI_NO_STDIO
+int stbi_load_rows_from_file(FILE *f, int *x, int *y, int *comp, int req_comp, stbi_row_func func, void *userdata)
+{
+   stbi_uc *data;
+   stbi *s=NULL;
+   int n;
+   jpeg j;
+   png p;
+   if (stbi_jpeg_test_file(f)) {
+      start_file(&j.s, f);
+      s = &j.s;
+      s->row_func = func;
+      s->row_data = userdata;
+      if (!load_jpeg_rows(&j, req_comp)) return 0;
+   } else if (stbi_png_test_file(f)) {
+      start_file(&p.s, f);
+      s = &p.s;
+      s->row_func = func;
+      s->row_data = userdata;
+      if (!do_png_rows(&p, req_comp)) return 0;
+   }
+   if (s) {
+      *x = s->img_x;
+      *y = s->img_y;
+      if (comp) *comp = s->img_n;
+      return 1;
+   }
+   data = stbi_load_from_file(f, x, y, &n, req_comp);
+   if (data && comp) *comp = n;
+   return load_rows_whole(data, *x, *y, n, req_comp, func, userdata);
+}
+#endif
+
+int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_row_func func, void *userdata)
+{
+   stbi_uc *data;
+   stbi *s=NULL;
+   int n;
+   jpeg j;
+   png p;
+   if (stbi_jpeg_test_memory(buffer,len)) {
+      start_mem(&j.s, buffer, len);
+      s = &j.s;
+      s->row_func = func;
+      s->row_data = userdata;
+      if (!load_jpeg_rows(&j, req_comp)) return 0;
+   } else if (stbi_png_test_memory(buffer,len)) {
+      start_mem(&p.s, buffer, len);
+      s = &p.s;
+      s->row_func = func;
+      s->row_data = userdata;
+      if (!do_png_rows(&p, req_comp)) return 0;
+   }
+   if (s) {
+      *x = s->img_x;
+      *y = s->img_y;
+      if (comp) *comp = s->img_n;
+      return 1;
+   }
+   data = stbi_load_from_memory(buffer, len, x, y, &n, req_comp);
+   if (data && comp) *comp = n;
+   return load_rows_whole(data, *x, *y, n, req_comp, func, userdata);
+}
+
 /////////////////////// write image ///////////////////////
 
 #ifndef STBI_NO_WRITE